@@ -148,6 +148,16 @@ enum mcapi_status_codes {
  */
 enum mcapi_node_attribute_numbers {
 	MCAPI_NODE_ATTR_TYPE,                                   /* Node type */
+	/* implementation specific: capacities of the database, an mcapi_uint_t
+	   each, used when mcapi_initialize() creates it (0 keeps the default) */
+	MCAPI_NODE_ATTR_MAX_DOMAINS,
+	MCAPI_NODE_ATTR_MAX_NODES,                              /* per domain */
+	MCAPI_NODE_ATTR_MAX_ENDPOINTS,                          /* per node */
+	MCAPI_NODE_ATTR_MAX_BUFFERS,                            /* also the number of requests */
+	MCAPI_NODE_ATTR_MAX_QUEUE_ELEMENTS,
+	/* implementation specific: an mcapi_uint_t, non zero keeps the database
+	   and the endpoints across mcapi_finalize() for a warm restart */
+	MCAPI_NODE_ATTR_WARM_RESTART,
 	MCAPI_NODE_ATTR_END                                             /* This should always be last */
 };
 
@@ -234,7 +244,8 @@ typedef mcapi_uint_t mcapi_endp_attr_memory_type_t;
 enum mcapi_memory_type {
 	MCAPI_ENDP_ATTR_LOCAL_MEMORY,           /* Zero copy operations not possible - Default */
 	MCAPI_ENDP_ATTR_SHARED_MEMORY,          /* The user buffer provided by the sender is a shared memory buffer, zero copy possible */
-	MCAPI_ENDP_ATTR_REMOTE_MEMORY
+	MCAPI_ENDP_ATTR_REMOTE_MEMORY,
+	MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY    /* Implementation specific: shared memory the CPU caches, see mcapi_buffer_sync_for_device() */
 };
 
 /* MCAPI Attribute Memory Behavior Types
@@ -684,6 +695,156 @@ extern void mcapi_cancel(
 	MCAPI_OUT mcapi_status_t* mcapi_status
 );
 
+/* Flow control (implementation specific, not part of the MCAPI spec) */
+
+/* key_offset of mcapi_msg_recv_dispatch(): any worker takes any message */
+#define MCAPI_DISPATCH_NO_KEY ((size_t)-1)
+
+/* flags of mcapi_msg_send_multi(): the receivers on other cores take
+   references, see mcapi_shared_parse() in mcapi_frame.h */
+#define MCAPI_MULTI_SHARED 0x00000001
+
+/* called when a send endpoint that had run out of credit gets some back */
+typedef void (*mcapi_credit_callback_t)(
+	mcapi_endpoint_t send_endpoint,
+	mcapi_uint_t credits,
+	void* context
+);
+
+extern mcapi_uint_t mcapi_msg_credits_available(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern mcapi_uint_t mcapi_msg_credits_wait(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN mcapi_timeout_t timeout,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_credits_notify(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN mcapi_credit_callback_t callback,
+	MCAPI_IN void* context,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_send_backlog(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN mcapi_uint_t depth,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_send_flush(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN mcapi_timeout_t timeout,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_send_multi(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN mcapi_endpoint_t* receive_endpoints,
+	MCAPI_IN mcapi_uint_t count,
+	MCAPI_IN void* buffer,
+	MCAPI_IN size_t buffer_size,
+	MCAPI_IN mcapi_priority_t priority,
+	MCAPI_IN mcapi_uint_t flags,
+	MCAPI_OUT mcapi_status_t* statuses,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_coalesce(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_IN size_t max_bytes,
+	MCAPI_IN mcapi_uint_t deadline_us,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_coalesce_flush(
+	MCAPI_IN mcapi_endpoint_t send_endpoint,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_coalesce_accept(
+	MCAPI_IN mcapi_endpoint_t receive_endpoint,
+	MCAPI_IN mcapi_boolean_t enable,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_recv_prefetch(
+	MCAPI_IN mcapi_endpoint_t receive_endpoint,
+	MCAPI_IN mcapi_uint_t depth,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_recv_dispatch(
+	MCAPI_IN mcapi_endpoint_t receive_endpoint,
+	MCAPI_IN mcapi_uint_t workers,
+	MCAPI_IN size_t key_offset,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_msg_recv_worker(
+	MCAPI_IN mcapi_endpoint_t receive_endpoint,
+	MCAPI_IN mcapi_uint_t worker,
+	MCAPI_OUT void* buffer,
+	MCAPI_IN size_t buffer_size,
+	MCAPI_OUT size_t* received_size,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+/* Endpoints (implementation specific, not part of the MCAPI spec) */
+extern void mcapi_endpoint_create_many(
+	MCAPI_IN mcapi_uint_t number,
+	MCAPI_IN mcapi_port_t* port_ids,
+	MCAPI_OUT mcapi_endpoint_t* endpoints,
+	MCAPI_OUT mcapi_status_t* statuses,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_endpoint_delete_many(
+	MCAPI_IN mcapi_uint_t number,
+	MCAPI_IN mcapi_endpoint_t* endpoints,
+	MCAPI_OUT mcapi_status_t* statuses,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_endpoint_get_many(
+	MCAPI_IN mcapi_uint_t number,
+	MCAPI_IN mcapi_domain_t* domain_ids,
+	MCAPI_IN mcapi_node_t* node_ids,
+	MCAPI_IN mcapi_port_t* port_ids,
+	MCAPI_OUT mcapi_endpoint_t* endpoints,
+	MCAPI_OUT mcapi_status_t* statuses,
+	MCAPI_IN mcapi_timeout_t timeout,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+/* Shared buffers (implementation specific, not part of the MCAPI spec) */
+extern void* mcapi_buffer_alloc(
+	MCAPI_IN size_t size,
+	MCAPI_IN mcapi_uint_t memory_type,
+	MCAPI_OUT mcapi_uint_t* paddr,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_buffer_free(
+	MCAPI_IN void* buffer,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_buffer_sync_for_device(
+	MCAPI_IN void* buffer,
+	MCAPI_IN size_t size,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
+extern void mcapi_buffer_sync_for_cpu(
+	MCAPI_IN void* buffer,
+	MCAPI_IN size_t size,
+	MCAPI_OUT mcapi_status_t* mcapi_status
+);
+
 /* Convenience functions */
 char* mcapi_display_status(mcapi_status_t status,char* status_message,size_t size);
 void mcapi_set_debug_level(int d);
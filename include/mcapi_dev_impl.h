@@ -3,6 +3,7 @@
 */
 #ifndef _MCAPI_DEV_IMPL_H_
 #define _MCAPI_DEV_IMPL_H_
+#include <stddef.h>
 #include <stdint.h>
 #include <icc.h>
 
@@ -12,20 +13,36 @@ void sm_dev_finalize(void);
 
 int sm_create_session(uint32_t src_ep, uint32_t type);
 int sm_destroy_session(uint32_t src_ep);
-int sm_connect_session(uint32_t dst_ep, uint32_t dst_cpu, uint32_t src_ep);
-int sm_disconnect_session(uint32_t dst_ep, uint32_t src_ep);
+int sm_connect_session(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu, uint32_t type);
+int sm_disconnect_session(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu);
 int sm_send_packet(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
-		void *buf, uint32_t len, int *payload, int blocking);
+		void *buf, uint32_t len, uint32_t *payload, int blocking);
 int sm_recv_packet(uint32_t session_idx, uint16_t *dst_ep,
 		uint16_t *dst_cpu, void *buf, uint32_t *len, int blocking);
 int sm_send_scalar(uint32_t session_idx, uint16_t dst_ep, uint16_t dst_cpu, 
 		uint32_t scalar0, uint32_t scalar1, uint32_t size, int blocking);
 int sm_recv_scalar(uint32_t session_idx, uint16_t *src_ep, uint16_t *src_cpu, uint32_t *scalar0,
 		uint32_t *scalar1, uint32_t *size, int blocking);
+struct sm_recv_desc;	/* see transport_sm.h */
+int sm_recv_packets(uint32_t session_idx, struct sm_recv_desc *desc, uint32_t count);
+struct sm_send_desc;	/* see transport_sm.h */
+int sm_send_packets(uint32_t session_idx, struct sm_send_desc *desc, uint32_t count, int blocking);
 int sm_get_session_status(uint32_t session_idx, struct sm_session_status *status);
 int sm_get_node_status(uint32_t node, uint32_t *session_mask, uint32_t *session_pending, uint32_t *nfree);
 int sm_wait_nonblocking(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
 		void *buf, uint32_t *len, uint32_t type, uint32_t payload, unsigned int timeout, int blocking);
+int sm_wait_recv_packet(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
+		uint16_t *src_ep, uint16_t *src_cpu, void *buf, uint32_t *len, unsigned int timeout);
 int sm_get_remote_ep(uint32_t dst_ep, uint32_t dst_cpu, int timeout, int blocking);
+void *sm_request_uncached_buf(uint32_t size, uint32_t *paddr);
+int sm_release_uncached_buf(void *buf, uint32_t size, uint32_t paddr);
+int sm_have_cached_buf(void);
+void *sm_request_cached_buf(uint32_t size, uint32_t *paddr);
+int sm_release_cached_buf(void *buf, uint32_t size, uint32_t paddr);
+int sm_sync_for_device(void *buf, uint32_t size, uint32_t paddr);
+int sm_sync_for_cpu(void *buf, uint32_t size, uint32_t paddr);
+void sm_copy_to_uncached(void *dst, const void *src, size_t len);
+void sm_copy_from_uncached(void *dst, const void *src, size_t len);
+const char *sm_copy_kernel(void);
 
 #endif
@@ -0,0 +1,180 @@
+/*
+ ** Copyright (c) 2019, Analog Devices, Inc.  All rights reserved.
+*/
+/*
+ * mcapi_frame.h
+ *
+ * Framing of coalesced messages (see mcapi_msg_coalesce()). Several small
+ * messages are packed into one transport packet:
+ *
+ *   mcapi_frame_header | mcapi_frame_record | payload | pad | mcapi_frame_record | ...
+ *
+ * Every record starts on a 4 byte boundary. All fields are little endian.
+ * The magic alone doesn't make a frame: the receiver only decodes packets
+ * of senders it knows to coalesce, any other packet is a plain message.
+ * It also has the header of messages to virtual endpoints, see
+ * MCAPI_VPORT_FIRST, and the references of fan-outs, see
+ * MCAPI_SHARED_MAGIC. The header only depends on <stdint.h>/<stddef.h> so
+ * that it can be built as is on the SHARC side, where mcapi_frame_next(),
+ * mcapi_mux_parse() and mcapi_shared_parse() are the reference decoders.
+*/
+#ifndef MCAPI_FRAME_H
+#define MCAPI_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#define MCAPI_FRAME_MAGIC 0xCA7Cu
+
+typedef struct {
+	uint16_t magic;		/* MCAPI_FRAME_MAGIC */
+	uint16_t count;		/* number of records */
+} mcapi_frame_header;
+
+typedef struct {
+	uint16_t size;		/* payload bytes, without padding */
+	uint16_t reserved;
+} mcapi_frame_record;
+
+#define MCAPI_FRAME_ALIGN(x) (((x) + 3u) & ~3u)
+
+/* bytes a message of size bytes takes up in a frame */
+#define MCAPI_FRAME_RECORD_SPACE(size) \
+	(sizeof(mcapi_frame_record) + MCAPI_FRAME_ALIGN(size))
+
+/* returns the record count if packet is a well formed frame, 0 otherwise */
+static inline unsigned mcapi_frame_count(const void* packet, size_t len)
+{
+	const mcapi_frame_header* h = (const mcapi_frame_header*)packet;
+
+	if (len < sizeof(*h) || h->magic != MCAPI_FRAME_MAGIC)
+		return 0;
+	return h->count;
+}
+
+/* Walks the records of a frame. *offset must start at 0; each call returns
+   1 and the next payload/size, or 0 at the end of the frame (or when it is
+   malformed). */
+static inline int mcapi_frame_next(const void* packet, size_t len,
+		size_t* offset, const void** payload, size_t* size)
+{
+	const char* p = (const char*)packet;
+	const mcapi_frame_record* r;
+
+	if (*offset == 0)
+		*offset = sizeof(mcapi_frame_header);
+	if (*offset + sizeof(*r) > len)
+		return 0;
+	r = (const mcapi_frame_record*)(p + *offset);
+	if (*offset + sizeof(*r) + r->size > len)
+		return 0;
+	*payload = p + *offset + sizeof(*r);
+	*size = r->size;
+	*offset += MCAPI_FRAME_RECORD_SPACE(r->size);
+	return 1;
+}
+
+/* Virtual endpoints: ports MCAPI_VPORT_FIRST and up are channels of 16
+   carriers, each one transport session on port MCAPI_VPORT(carrier, 0).
+   A message to a virtual port goes to the session of its carrier and
+   starts with a mcapi_mux_header naming the channels:
+
+     mcapi_mux_header | payload
+
+   Channel 0 is the carrier itself, it is not an endpoint. */
+#define MCAPI_VPORT_FIRST 0xF000u
+#define MCAPI_VPORT_CARRIERS 16
+#define MCAPI_VPORT_CHANNELS 256
+#define MCAPI_VPORT(carrier, channel) (MCAPI_VPORT_FIRST | ((carrier) << 8) | (channel))
+#define MCAPI_VPORT_IS(port) (((uint32_t)(port) & ~0xFFFu) == MCAPI_VPORT_FIRST)
+#define MCAPI_VPORT_CARRIER(port) (((port) >> 8) & 0xFu)
+#define MCAPI_VPORT_CHANNEL(port) ((port) & 0xFFu)
+/* port of the session a port's messages are sent to */
+#define MCAPI_VPORT_SESSION(port) \
+	(MCAPI_VPORT_IS(port) ? MCAPI_VPORT(MCAPI_VPORT_CARRIER(port), 0) : (port))
+
+#define MCAPI_MUX_MAGIC 0xCA7Du
+
+typedef struct {
+	uint16_t magic;		/* MCAPI_MUX_MAGIC */
+	uint8_t dst;		/* channel of the receiving endpoint */
+	uint8_t src;		/* channel of the sending one, 0 from a plain endpoint */
+} mcapi_mux_header;
+
+/* returns the payload offset of a multiplexed packet and sets its
+   channels, 0 if packet is not one */
+static inline size_t mcapi_mux_parse(const void* packet, size_t len,
+		unsigned* dst, unsigned* src)
+{
+	const mcapi_mux_header* h = (const mcapi_mux_header*)packet;
+
+	if (len < sizeof(*h) || h->magic != MCAPI_MUX_MAGIC)
+		return 0;
+	*dst = h->dst;
+	*src = h->src;
+	return sizeof(*h);
+}
+
+/* Fan-out (mcapi_msg_send_multi()): a payload for several receivers on
+   other cores is staged once in shared memory, and each receiver gets a
+   reference to it instead of a copy:
+
+     mcapi_shared_ref  ->  mcapi_shared_buffer | payload
+
+   The sender only does so with MCAPI_MULTI_SHARED, for receivers that
+   decode these. The receiver reads the payload in place and then sets
+   its byte of done[] with mcapi_shared_release(); the buffer is only
+   reused once every receiver has. Small payloads, and fan-outs the
+   sender has no shared buffer for, arrive as plain messages, so
+   receivers take both. A buffer
+   flagged MCAPI_SHARED_CACHED is cacheable: a receiver reading it through
+   its cache invalidates it first, and writes its done byte back. */
+#define MCAPI_SHARED_MAGIC 0xCA7Eu
+#define MCAPI_SHARED_CONSUMERS 16
+#define MCAPI_SHARED_CACHED 0x01u
+
+typedef struct {
+	uint16_t magic;		/* MCAPI_SHARED_MAGIC */
+	uint8_t slot;		/* the receiver's byte of done[] */
+	uint8_t flags;		/* MCAPI_SHARED_CACHED */
+	uint32_t paddr;		/* physical address of the mcapi_shared_buffer */
+} mcapi_shared_ref;
+
+typedef struct {
+	uint32_t size;		/* payload bytes */
+	uint32_t count;		/* receivers, done[0] to done[count - 1] */
+	volatile uint8_t done[MCAPI_SHARED_CONSUMERS];
+} mcapi_shared_buffer;
+
+#define MCAPI_SHARED_PAYLOAD(b) ((void*)((mcapi_shared_buffer*)(b) + 1))
+
+/* returns 1 and the buffer address and slot if packet is a reference,
+   0 otherwise */
+static inline int mcapi_shared_parse(const void* packet, size_t len,
+		uint32_t* paddr, unsigned* slot)
+{
+	const mcapi_shared_ref* r = (const mcapi_shared_ref*)packet;
+
+	if (len != sizeof(*r) || r->magic != MCAPI_SHARED_MAGIC ||
+			r->slot >= MCAPI_SHARED_CONSUMERS)
+		return 0;
+	*paddr = r->paddr;
+	*slot = r->slot;
+	return 1;
+}
+
+/* hands the buffer back, after the last read of its payload */
+static inline void mcapi_shared_release(mcapi_shared_buffer* b, unsigned slot)
+{
+	b->done[slot] = 1;
+}
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* MCAPI_FRAME_H */
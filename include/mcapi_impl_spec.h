@@ -55,7 +55,7 @@ extern "C" {
 #endif
 
 #ifndef MAX_NUM_ATTRIBUTES
-#define MAX_NUM_ATTRIBUTES 4
+#define MAX_NUM_ATTRIBUTES 8
 #endif
 
 /******************************************************************
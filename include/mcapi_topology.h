@@ -0,0 +1,105 @@
+/*
+ ** Copyright (c) 2019, Analog Devices, Inc.  All rights reserved.
+*/
+/*
+ * mcapi_topology.h
+ *
+ * Static topology: the routes and endpoints of a system that does not
+ * change at run time, described once in a file of X-macros:
+ *
+ *   MCAPI_TOPO_ROUTE(domain, node, cpu)          node is on SHARC core cpu
+ *   MCAPI_TOPO_ENDPOINT(name, domain, node, port)
+ *
+ * e.g. audio.def:
+ *
+ *   MCAPI_TOPO_ROUTE(0, 1, 1)
+ *   MCAPI_TOPO_ENDPOINT(arm_ctl, 0, 0, 101)
+ *   MCAPI_TOPO_ENDPOINT(sharc_ctl, 0, 1, 5)
+ *
+ * Defining MCAPI_TOPOLOGY_FILE to the file's name before including this
+ * header compiles it into constant tables: the enum MCAPI_TOPO_<name> of
+ * endpoint indices, MCAPI_TOPO_ENDPOINTS, and mcapi_topology. After
+ * mcapi_initialize(), mcapi_topology_bring_up(&mcapi_topology, eps, &status)
+ * sets the routes, creates the endpoints of the calling node and fills in
+ * eps[MCAPI_TOPO_<name>] for all of them, the remote ones without asking
+ * the driver.
+*/
+#ifndef MCAPI_TOPOLOGY_H
+#define MCAPI_TOPOLOGY_H
+
+#include <mcapi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+typedef struct {
+	mcapi_domain_t domain_id;
+	mcapi_node_t node_id;
+	mcapi_uint_t cpu;
+} mcapi_topology_route;
+
+typedef struct {
+	const char* name;
+	mcapi_domain_t domain_id;
+	mcapi_node_t node_id;
+	mcapi_port_t port_id;
+} mcapi_topology_endpoint;
+
+typedef struct {
+	const mcapi_topology_route* routes;
+	mcapi_uint_t num_routes;
+	const mcapi_topology_endpoint* endpoints;
+	mcapi_uint_t num_endpoints;
+} mcapi_topology_t;
+
+extern void mcapi_topology_bring_up(
+	MCAPI_IN mcapi_topology_t* topology,
+	MCAPI_OUT mcapi_endpoint_t* endpoints,
+	MCAPI_OUT mcapi_status_t* mcapi_status);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* MCAPI_TOPOLOGY_H */
+
+#if defined(MCAPI_TOPOLOGY_FILE) && !defined(MCAPI_TOPOLOGY_TABLES)
+#define MCAPI_TOPOLOGY_TABLES
+
+enum {
+#define MCAPI_TOPO_ROUTE(domain, node, cpu)
+#define MCAPI_TOPO_ENDPOINT(name, domain, node, port) MCAPI_TOPO_##name,
+#include MCAPI_TOPOLOGY_FILE
+#undef MCAPI_TOPO_ROUTE
+#undef MCAPI_TOPO_ENDPOINT
+	MCAPI_TOPO_ENDPOINTS
+};
+
+/* the last entry of each table only keeps it from being empty */
+static const mcapi_topology_route mcapi_topology_routes[] = {
+#define MCAPI_TOPO_ROUTE(domain, node, cpu) {domain, node, cpu},
+#define MCAPI_TOPO_ENDPOINT(name, domain, node, port)
+#include MCAPI_TOPOLOGY_FILE
+#undef MCAPI_TOPO_ROUTE
+#undef MCAPI_TOPO_ENDPOINT
+	{0, 0, 0}
+};
+
+static const mcapi_topology_endpoint mcapi_topology_endpoints[] = {
+#define MCAPI_TOPO_ROUTE(domain, node, cpu)
+#define MCAPI_TOPO_ENDPOINT(name, domain, node, port) {#name, domain, node, port},
+#include MCAPI_TOPOLOGY_FILE
+#undef MCAPI_TOPO_ROUTE
+#undef MCAPI_TOPO_ENDPOINT
+	{NULL, 0, 0, 0}
+};
+
+static const mcapi_topology_t mcapi_topology = {
+	mcapi_topology_routes,
+	sizeof(mcapi_topology_routes) / sizeof(mcapi_topology_routes[0]) - 1,
+	mcapi_topology_endpoints,
+	MCAPI_TOPO_ENDPOINTS
+};
+
+#endif /* MCAPI_TOPOLOGY_FILE */
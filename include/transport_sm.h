@@ -39,6 +39,7 @@ extern "C" {
 #define _TRANSPORT_SM_H_
 
 #include "mcapi_impl_spec.h"
+#include "mcapi_frame.h" /* for the virtual ports */
 #include <stdarg.h> /* for va_list */
 #include <stdio.h> /* for the inlined dprintf routine */
 #include <pthread.h> /* for getting the tid (pthread_self) */
@@ -50,15 +51,62 @@ extern "C" {
   definitions and constants
 *******************************************************************/    
 
-/* we leave one empty element so that the array implementation 
-   can tell the difference between empty and full */
-#define MCAPI_MAX_QUEUE_ENTRIES (MCAPI_MAX_QUEUE_ELEMENTS + 1)
-  
 #define MCAPI_MAX_REQUESTS MCA_MAX_REQUESTS 
 
 #define mcapi_dprintf mca_dprintf
   
 #define MCAPI_MAX(X,Y) ((X) > (Y) ? (X) : (Y))
+
+/* minimum time between two reads of the transport free slot count while
+   a send endpoint is out of credit */
+#define MCAPI_CREDIT_REFRESH_US 100
+
+/* first poll interval of the library side polls (mcapi_endpoint_get_many(),
+   receives from virtual endpoints with a timeout) */
+#define MCAPI_GET_POLL_US 50
+
+/* upper bound for the poll interval of library side waits */
+#define MCAPI_BACKOFF_MAX_US 10000
+
+/* request ids a thread keeps reserved between mcapi_trans_remove_request()
+   and mcapi_trans_reserve_request() */
+#define MCAPI_REQUEST_CACHE 8
+
+/* the caches of all threads together hold at most 1 / this of the
+   requests, threads beyond that reserve without a cache */
+#define MCAPI_REQUEST_CACHE_SHARE 2
+
+/* most messages a send combiner hands to sm_send_packets() at once */
+#define MCAPI_COMBINE_BATCH 16
+
+/* messages each worker queue of a dispatching receive endpoint can hold */
+#define MCAPI_DISPATCH_DEPTH 16
+
+/* messages the queue of a virtual endpoint can hold */
+#define MCAPI_MUX_DEPTH 8
+
+/* fan-outs (mcapi_msg_send_multi()) a process can have staged in shared
+   memory at once, and the smallest payload worth staging */
+#define MCAPI_SHARED_SLOTS 32
+#define MCAPI_SHARED_MIN 64
+#define MCAPI_SHARED_SLOT_SIZE \
+  ((sizeof(mcapi_shared_buffer) + MCAPI_MAX_MSG_SIZE + MCAPI_CACHE_LINE - 1) & ~(MCAPI_CACHE_LINE - 1))
+
+/* buffers from mcapi_buffer_alloc() a process can hold at once */
+#define MCAPI_BUFFERS_MAX 64
+
+/* structures threads write concurrently are aligned to this to keep
+   them from sharing cache lines */
+#define MCAPI_CACHE_LINE 64
+#define MCAPI_CACHE_ALIGNED __attribute__((aligned(MCAPI_CACHE_LINE)))
+
+/* processes that can have the database attached at once: each takes a
+   slot, a byte of the database file it keeps locked while it lives, and
+   owns the endpoints and requests it allocates through it */
+#define MCAPI_DB_PROCESSES 256
+
+/* request handle of transport work nobody waits for (coalesced batches) */
+#define MCAPI_NO_REQUEST ((mcapi_request_t)~0)
   
 /*******************************************************************
  The mcapi database
@@ -80,69 +128,213 @@ typedef enum {
   GET_ENDPT
 } mcapi_request_type;
 
+/* A request is written on every test/wait by the thread that owns it, so
+   each gets a cache line of its own: neighbouring requests of other
+   threads and processes do not false share. What test/wait polls comes
+   first. */
 typedef struct {
   mca_boolean_t valid;
-  size_t size;
-  mcapi_request_type type;
-  void* buffer;
-  void** buffer_ptr;
-  uint32_t ep_node_num; /* used only for get_endpoint */
-  uint32_t ep_port_num; /* used only for get_endpoint */
-  mca_domain_t ep_domain_num; /* used only for get_endpoint */
   mca_boolean_t completed;
   mca_boolean_t cancelled;
-  mcapi_endpoint_t handle;
+  mca_boolean_t credit; /* used only for send_i: still holds a flow control credit */
+  mca_boolean_t backlogged; /* used only for send_i: still queued in the sender's backlog */
+  mcapi_request_type type;
   mca_status_t status;
+  size_t size;
+  void* buffer;
+  mcapi_endpoint_t handle;
   mcapi_endpoint_t ep_endpoint;
   uint32_t payload;   /* used only for send_i */
-} mcapi_request_data;
+  uint32_t ep_node_num; /* used only for get_endpoint */
+  uint32_t ep_port_num; /* used only for get_endpoint */
+  mca_domain_t ep_domain_num; /* used only for get_endpoint */
+  uint16_t owner;   /* process slot + 1 of the process holding it, 0 while free */
+} MCAPI_CACHE_ALIGNED mcapi_request_data;
 
 typedef struct  {
         int next_index;
         int prev_index;
 } indexed_array_node;
 
+/* the nodes themselves are the reserves array of the database */
 typedef struct  {
-        indexed_array_node array[MCAPI_MAX_REQUESTS];
         int curr_count;
         int max_count;
         int empty_head_index;
         int full_head_index;
 } indexed_array_header;
 
-typedef struct {
-  mcapi_request_t request; /* holds a reservation (request handle) for an outstanding receive request */
-  int32_t buff_index;               /* the pointer to the actual buffer entry in the buffer pool */
-  mcapi_boolean_t invalid;
-} buffer_descriptor;
-
-
+/* the message queues live in the icc driver, only the channel peer of a
+   receive endpoint is kept here */
 typedef struct {  
-  /* the next 3 data members are only valid for channels */
-  mcapi_endpoint_t send_endpt;
   mcapi_endpoint_t recv_endpt;
   uint8_t channel_type;
-
-  uint32_t num_elements;
-  uint16_t head;
-  uint16_t tail;
-  buffer_descriptor elements[MCAPI_MAX_QUEUE_ENTRIES+1];
 }queue;
 
+/* read on every operation, written only on create, connect and delete:
+   kept to 16 bytes so that an operation touches a single cache line */
 typedef struct {
   uint32_t port_num;
   mcapi_boolean_t valid;
   mcapi_boolean_t anonymous;
   mcapi_boolean_t open;
   mcapi_boolean_t connected;
-  uint32_t num_attributes;
-  mcapi_endpt_attributes_t attributes;
   queue recv_queue;
 } endpoint_entry;
 
+/* a message mcapi_msg_send_i() couldn't hand to the transport yet */
+typedef struct {
+  mcapi_endpoint_t receive_endpoint;
+  mcapi_request_t request;
+  size_t size;
+  char data[MCAPI_MAX_MSG_SIZE];
+} backlog_entry;
+
+/* one packet of a sm_recv_packets() batch */
+struct sm_recv_desc {
+  void *buf;
+  uint32_t len;       /* in: room in buf, out: packet length */
+  uint16_t src_ep;
+  uint16_t src_cpu;
+};
+
+/* one packet of a sm_send_packets() batch */
+struct sm_send_desc {
+  void *buf;
+  uint32_t len;
+  uint16_t dst_ep;
+  uint16_t dst_cpu;
+  int err;            /* out: 0 or the errno of the send */
+};
+
+/* a blocking mcapi_msg_send() queued for the endpoint's send combiner */
+typedef struct send_slot {
+  struct send_slot* volatile next;
+  struct sm_send_desc desc;
+  volatile int done;  /* futex word its sender sleeps on until it is sent */
+} send_slot;
+
+/* a packet received ahead of mcapi_msg_recv() */
+typedef struct {
+  uint16_t se;
+  uint16_t sn;
+  uint32_t len;
+  char data[MCAPI_MAX_MSG_SIZE];
+} prefetch_entry;
+
+/* messages waiting for the worker(s) of one queue */
+typedef struct {
+  pthread_cond_t cond;
+  uint16_t waiting;     /* workers blocked on cond */
+  uint16_t head;
+  uint16_t count;
+  prefetch_entry q[MCAPI_DISPATCH_DEPTH];
+} dispatch_queue;
+
+/* receive distribution to worker threads (mcapi_msg_recv_dispatch) */
+typedef struct {
+  pthread_mutex_t lock;
+  mcapi_boolean_t reading; /* a worker is receiving from the transport */
+  mcapi_boolean_t dead;    /* the endpoint was deleted, the last user frees it */
+  uint16_t users;       /* workers in mcapi_trans_dispatch_recv_internal() */
+  size_t key_offset;
+  uint16_t queues;      /* 1 without a routing key, else one per worker */
+  prefetch_entry stage[MCAPI_DISPATCH_DEPTH]; /* the reader's batch */
+  dispatch_queue queue[];
+} dispatch_state;
+
+/* messages received for a virtual endpoint */
+typedef struct {
+  pthread_cond_t cond;
+  uint16_t waiting;     /* receivers blocked on cond */
+  mcapi_boolean_t dead; /* deleted, the last waiter frees it */
+  uint16_t head;
+  uint16_t count;
+  prefetch_entry q[MCAPI_MUX_DEPTH];
+} mux_queue;
+
+/* The session a carrier's virtual endpoints share and their queues, by
+   channel. Like a dispatching endpoint, one receiver at a time reads from
+   the session and sorts what it gets into the queues; nothing is read
+   while a queue is full. */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;  /* signalled when closing clears */
+  int index;            /* session index, while refs */
+  uint16_t dindex;      /* node it is open for */
+  uint16_t nindex;
+  uint16_t refs;        /* virtual endpoints */
+  uint16_t full;        /* queues that are full */
+  mcapi_boolean_t reading;
+  mcapi_boolean_t closing; /* the session was closed under the reader */
+  uint64_t waiters[MCAPI_VPORT_CHANNELS / 64]; /* channels with waiting receivers */
+  prefetch_entry stage; /* the reader's packet */
+  mux_queue* chan[MCAPI_VPORT_CHANNELS];
+} MCAPI_CACHE_ALIGNED mux_carrier;
+
+/* per endpoint state private to this process (not in the shared database) */
+typedef struct {
+  /* database row of the endpoint: indices of the local node that created it */
+  uint16_t dindex;
+  uint16_t nindex;
+  /* flow control: sends we may still post before the free slot count
+     has to be read from the transport again */
+  mcapi_uint_t credits;
+  mcapi_uint_t credit_limit;
+  uint64_t credit_refreshed; /* usecs, 0 if never read */
+  mcapi_boolean_t credit_unknown; /* the transport can't report free slots */
+  mcapi_endpoint_t credit_endpoint;
+  mcapi_credit_callback_t credit_cb;
+  void* credit_cb_context;
+  /* send backlog (mcapi_msg_send_backlog), NULL when disabled */
+  backlog_entry* backlog;
+  uint16_t backlog_depth;
+  uint16_t backlog_head;
+  uint16_t backlog_count;
+  /* send side coalescing (mcapi_msg_coalesce), NULL when disabled */
+  char* co_buf;
+  size_t co_len;        /* bytes used in co_buf, frame header included */
+  uint16_t co_count;    /* messages in co_buf */
+  mcapi_endpoint_t co_dest;
+  uint64_t co_first;    /* usecs, when the oldest message was added */
+  size_t co_max;
+  size_t co_target;     /* current batch size, adapts between the header and co_max */
+  uint64_t co_deadline; /* usecs */
+  mcapi_boolean_t co_failed; /* the transport refused the batch, nobody was told yet */
+  /* receive side unpacking of coalesced packets (mcapi_msg_coalesce_accept) */
+  mcapi_boolean_t unpack;
+  /* a receiver of an endpoint with unpacking or a prefetch ring waits in
+     the driver with the lock dropped; nothing is buffered meanwhile */
+  mcapi_boolean_t rx_blocked;
+  char* rx_packet;      /* last packet received, NULL when unpack is off */
+  uint32_t rx_len;
+  size_t rx_off;
+  uint16_t rx_left;     /* records of rx_packet not handed out yet */
+  uint16_t rx_sn;
+  uint16_t rx_se;
+  /* receive prefetch ring (mcapi_msg_recv_prefetch), NULL when disabled */
+  prefetch_entry* ring;
+  uint16_t ring_depth;
+  uint16_t ring_head;
+  uint16_t ring_count;
+  /* blocking sends waiting to be submitted (newest first) and whether a
+     thread is currently submitting them; both are lock free */
+  send_slot* volatile combine_head;
+  volatile int combining;
+  /* receive distribution to worker threads, NULL when disabled */
+  dispatch_state* dispatch;
+  /* MCAPI_ENDP_ATTR_MEMORY_TYPE */
+  mcapi_uint_t memory_type;
+} MCAPI_CACHE_ALIGNED endpoint_local;
+
+/* an endpoint's lock, on a cache line of its own */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t rx_cond; /* signalled when rx_blocked clears */
+} MCAPI_CACHE_ALIGNED endpoint_lock;
+
 typedef struct {
   uint16_t num_endpoints;
-  endpoint_entry endpoints[MCAPI_MAX_ENDPOINTS];
 } node_descriptor;
 
 typedef struct {
@@ -160,17 +352,140 @@ typedef struct {
   uint16_t num_nodes;
   mca_domain_t domain_id;
   mcapi_boolean_t valid;
-  node_entry nodes[MCA_MAX_NODES];
 } domain_entry;
 
+/* capacities of the database. The process that creates it picks them
+   (mca.h has the defaults, see mcapi_initialize()), the others use what
+   they find in the header. */
 typedef struct {
-  domain_entry domains[MCA_MAX_DOMAINS];
-  buffer_entry buffers [MCAPI_MAX_BUFFERS];
-  mcapi_request_data requests[MCAPI_MAX_REQUESTS];
+  uint32_t domains;
+  uint32_t nodes;           /* per domain */
+  uint32_t endpoints;       /* per node, one icc session each */
+  uint32_t buffers;
+  uint32_t requests;        /* a request owns the buffer of its index, == buffers */
+  uint32_t queue_elements;  /* deepest local queue (backlog, prefetch ring) */
+} mcapi_db_limits;
+
+/* Where a <domain, node> is: on this processor, in the node table, or on
+   a core behind the transport. The ids the handles carry index the table
+   directly (MCAPI_DB_ROUTE), so every send finds its destination with two
+   loads. */
+typedef struct {
+  uint16_t node_index;      /* database node index + 1, 0 when not on this processor */
+  uint16_t cpu;             /* core + 1 the transport reaches it on, 0: the node number */
+} mcapi_route;
+
+/* <domain, node> a core's messages come from, for the sender handles */
+typedef struct {
+  uint8_t valid;
+  uint8_t domain_id;
+  uint8_t node_id;
+} mcapi_cpu_route;
+
+/* node ids a domain can route, and cores the transport can address */
+#define MCAPI_ROUTE_NODES (MCAPI_NODE_MASK + 1)
+#define MCAPI_ROUTE_CPUS 256
+
+/* The ports in use on this processor: a bit per port, and a bit per word
+   of them that is full, so that a free port is found with a couple of
+   loads. The driver addresses a session by core and port, so the nodes of
+   the processor share one map. framed has a bit per port whose endpoint
+   has coalesced messages (mcapi_msg_coalesce()); only packets from those
+   are taken for frames on receive. index has the database endpoint index
+   + 1 of the endpoint on each port, 0 if there is none, so that a handle
+   finds its session without scanning the endpoints. */
+#define MCAPI_PORT_WORDS ((MCAPI_PORT_MASK + 1) / 64)
+typedef struct {
+  uint64_t full[MCAPI_PORT_WORDS / 64];
+  uint64_t used[MCAPI_PORT_WORDS];
+  uint64_t framed[MCAPI_PORT_WORDS];
+  uint16_t index[MCAPI_PORT_MASK + 1];
+} mcapi_port_map;
+
+/* most sessions the session pool keeps open (MCAPI_SESSION_POOL) */
+#define MCAPI_SESSION_POOL_MAX 16
+
+/* MCAPI_PORT_ANY hands out ports from here up first, leaving the ones
+   below to the endpoints created with a port of their own */
+#define MCAPI_PORT_ANY_FIRST 0x8000
+
+/* version of the database layout: a warm restart only reuses a database
+   of the same version, bump it whenever the layout changes */
+#define MCAPI_DB_VERSION 9
+
+/* The shared segment is this header followed by the arrays it has the
+   offsets of, each sized from limits. The buffers come last: pages of
+   buffers that are never used are never touched. */
+typedef struct {
+  uint32_t size;            /* bytes of the segment in use, 0 until laid out */
+  uint32_t magic;           /* MAGIC_NUM */
+  uint32_t version;         /* MCAPI_DB_VERSION */
+  /* guards the tables shared by the processes; robust, so a process dying
+     with it held does not block the others */
+  pthread_mutex_t lock;
+  mcapi_db_limits limits;
+  uint32_t domains_off;     /* domain_entry[domains] */
+  uint32_t nodes_off;       /* node_entry[domains][nodes] */
+  uint32_t endpoints_off;   /* endpoint_entry[domains][nodes][endpoints] */
+  uint32_t endpoint_owners_off; /* uint16_t[domains][nodes][endpoints], process slot + 1 */
+  uint32_t requests_off;    /* mcapi_request_data[requests] */
+  uint32_t reserves_off;    /* indexed_array_node[requests] */
+  uint32_t domain_routes_off; /* uint8_t[MCAPI_DOMAIN_MASK + 1], domain index + 1 */
+  uint32_t routes_off;      /* mcapi_route[domains][MCAPI_ROUTE_NODES] */
+  uint32_t cpu_routes_off;  /* mcapi_cpu_route[MCAPI_ROUTE_CPUS] */
+  uint32_t port_map_off;    /* mcapi_port_map */
+  uint32_t pooled_off;      /* uint16_t[MCAPI_DB_PROCESSES][MCAPI_SESSION_POOL_MAX], port + 1 */
+  uint32_t buffers_off;     /* buffer_entry[buffers] */
   indexed_array_header request_reserves_header;
-  uint16_t num_domains;
+  /* request ids the thread caches of each process slot may hold */
+  uint16_t request_quotas[MCAPI_DB_PROCESSES];
+  uint16_t num_domains;     /* domain indices handed out (MCAPI_DB_DOMAIN_ROUTE) */
 } mcapi_database;
 
+#define MCAPI_DB_ARRAY(db, off, type) ((type*)((char*)(db) + (db)->off))
+#define MCAPI_DB_DOMAIN(db, d) \
+  (MCAPI_DB_ARRAY(db, domains_off, domain_entry)[d])
+#define MCAPI_DB_NODE(db, d, n) \
+  (MCAPI_DB_ARRAY(db, nodes_off, node_entry)[(d) * (db)->limits.nodes + (n)])
+#define MCAPI_DB_ENDPOINT(db, d, n, e) \
+  (MCAPI_DB_ARRAY(db, endpoints_off, endpoint_entry) \
+    [((d) * (db)->limits.nodes + (n)) * (db)->limits.endpoints + (e)])
+#define MCAPI_DB_ENDPOINT_OWNER(db, d, n, e) \
+  (MCAPI_DB_ARRAY(db, endpoint_owners_off, uint16_t) \
+    [((d) * (db)->limits.nodes + (n)) * (db)->limits.endpoints + (e)])
+#define MCAPI_DB_DOMAIN_ROUTE(db, id) \
+  (MCAPI_DB_ARRAY(db, domain_routes_off, uint8_t)[(id) & MCAPI_DOMAIN_MASK])
+#define MCAPI_DB_ROUTE(db, d, id) \
+  (MCAPI_DB_ARRAY(db, routes_off, mcapi_route)[(d) * MCAPI_ROUTE_NODES + ((id) & MCAPI_NODE_MASK)])
+#define MCAPI_DB_CPU_ROUTE(db, cpu) \
+  (MCAPI_DB_ARRAY(db, cpu_routes_off, mcapi_cpu_route)[cpu])
+#define MCAPI_DB_PORT_MAP(db) \
+  (*MCAPI_DB_ARRAY(db, port_map_off, mcapi_port_map))
+#define MCAPI_DB_POOLED(db, slot, i) \
+  (MCAPI_DB_ARRAY(db, pooled_off, uint16_t)[(slot) * MCAPI_SESSION_POOL_MAX + (i)])
+#define MCAPI_DB_BUFFER(db, b) \
+  (MCAPI_DB_ARRAY(db, buffers_off, buffer_entry)[b])
+#define MCAPI_DB_REQUEST(db, r) \
+  (MCAPI_DB_ARRAY(db, requests_off, mcapi_request_data)[r])
+#define MCAPI_DB_RESERVE(db, r) \
+  (MCAPI_DB_ARRAY(db, reserves_off, indexed_array_node)[r])
+
+/* this process's copy of c_db->limits */
+extern mcapi_db_limits mcapi_limits;
+/* A node this process hosts. The thread that initialized it works as
+   that node, threads that initialized none as the first node of the
+   process (see mcapi_trans_self_internal()). */
+typedef struct {
+  mcapi_boolean_t valid;
+  uint16_t dindex;          /* database indices */
+  uint16_t nindex;
+  mcapi_node_t node_num;
+  mcapi_domain_t domain_id;
+} mcapi_local_node;
+
+/* nodes one process can host */
+#define MCAPI_LOCAL_NODES 16
+
 
 
 /*******************************************************************
@@ -180,15 +495,6 @@ typedef struct {
   extern mcapi_boolean_t transport_sm_initialize(); 
   
   
-  /* shared memory management */
-  extern mcapi_boolean_t transport_sm_create_shared_mem(void** addr,
-                                                        uint32_t shmkey,
-                                                        uint32_t size);
-
-  extern mcapi_boolean_t transport_sm_get_shared_mem(void** addr,
-                                                     uint32_t shmkey,
-                                                     uint32_t size);
-
   extern mcapi_boolean_t transport_sm_finalize(mcapi_boolean_t last_man_standing,
                                                mcapi_boolean_t last_man_standing_for_this_process,
                                                mcapi_boolean_t finalize_mrapi,
@@ -205,6 +511,20 @@ typedef struct {
                                                  uint32_t num_readers);
 
   extern void transport_sm_yield_internal();
+
+  /* core the transport reaches a node on, see mcapi_route */
+  extern uint16_t mcapi_trans_route_cpu_internal(uint16_t domain_id, uint16_t node_id);
+
+  /* forgets the remote endpoints confirmed on a core, when it no longer
+     knows one of them */
+  extern void mcapi_trans_remote_invalidate_internal(uint16_t cpu);
+
+  /* the node the calling thread works as */
+  extern mcapi_local_node* mcapi_trans_self_internal(void);
+
+  /* database entry of the endpoint of this process at session index */
+  extern endpoint_entry* mcapi_trans_local_endpoint_internal(int index);
+#define MCAPI_DB_LOCAL_ENDPOINT(index) (*mcapi_trans_local_endpoint_internal(index))
   
   
   
@@ -36,6 +36,8 @@ extern "C" {
 #endif /* __cplusplus */
 
 #include <mcapi.h>
+#include <mcapi_frame.h>
+#include <mcapi_topology.h>
 #include <string.h> /* for strncpy */
 
 /* FIXME: (errata B5) anyone can get an endpoint handle and call receive on it.  should
@@ -130,6 +132,43 @@ thread of control - process, thread, or other -- is a node) in
 that implementation. A thread and process are just two examples 
 of threads of control, and there could be other. 
 
+The first node to initialize creates the database shared by the 
+nodes of this processor. Its capacities default to the values in 
+mca.h; they can be set with the MCA_MAX_DOMAINS, MCA_MAX_NODES, 
+MCAPI_MAX_ENDPOINTS, MCAPI_MAX_BUFFERS and MCAPI_MAX_QUEUE_ELEMENTS 
+environment variables, and the MCAPI_NODE_ATTR_MAX_* node attributes 
+override those. Nodes initializing later use the capacities the 
+database was created with. This is implementation specific.
+
+Nodes of other domains and nodes on this processor are addressed 
+like any other. The messages to a node of another core go to the 
+core of its number, unless the MCAPI_ROUTES environment variable of 
+the first node to initialize gives it: a comma separated list of 
+domain:node=cpu, e.g. "0:1=1,1:1=2". A domain only named there also 
+takes one of the MCA_MAX_DOMAINS entries. This is implementation 
+specific.
+
+With the MCAPI_WARM_RESTART environment variable or the 
+MCAPI_NODE_ATTR_WARM_RESTART node attribute set, the database outlives 
+mcapi_finalize() and the process. A node that initializes again then 
+finds its endpoints and connected channels as it left them: endpoints 
+whose driver sessions are gone get new sessions on the same ports, 
+so peers need not reconnect. The database is only reused by the same 
+version of the library. This is implementation specific.
+
+Endpoints and requests a process held when it died without calling 
+mcapi_finalize() are taken back when another node initializes, or 
+when the others run out of them. In warm restart mode the endpoints 
+are kept instead, for the process to take over when it initializes 
+again. At most 256 processes can have nodes initialized at once. 
+This is implementation specific.
+
+A process may host up to 16 nodes, each initialized by a thread of 
+its own. The thread works as the node it initialized; threads that 
+initialized none work as the first node of the process. The nodes 
+share the process's connection to the driver. This is implementation 
+specific.
+
 RETURN VALUE
 
 On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
@@ -302,6 +341,13 @@ mcapi_initialize(), but it is an error to call mcapi_finalize()
 multiple times from a given node unless mcapi_initialize() has 
 been called prior to each mcapi_finalize() call.
 
+mcapi_finalize() finalizes the node the calling thread works as (see 
+mcapi_initialize()) and deletes its endpoints; the process stays 
+attached to the database while it hosts other nodes. 
+
+In warm restart mode (see mcapi_initialize()) the database and the 
+node's endpoints are kept for the next mcapi_initialize(). 
+
 RETURN VALUE
 
 On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
@@ -423,6 +469,27 @@ MCAPI_ERR_PARAMETER
 NOTE
 The node number can only be set using the mcapi_intialize() function.
 
+MCAPI_PORT_ANY hands out the lowest free port from 0x8000 up, then 
+from 0, and a port is free again once its endpoint is deleted. Ports 
+below 0x8000 are best for the endpoints that are created with a port 
+of their own. The transport addresses endpoints by core and port, so 
+the nodes of this processor share the ports: a port one of them has 
+is taken for the others. This is implementation specific.
+
+The ports from MCAPI_VPORT_FIRST (0xF000) up are virtual 
+(mcapi_frame.h): MCAPI_VPORT(carrier, channel), for carriers 0 to 15 
+and channels 1 to 255. The endpoints of a carrier share one transport 
+session on port MCAPI_VPORT(carrier, 0), which the first of them 
+opens, so that hundreds of them fit in MCAPI_MAX_ENDPOINTS. Their 
+messages carry the channels in a header and are sorted into a queue 
+per endpoint as the session is read. A carrier's endpoints belong to 
+the node and process that created the first of them. A virtual 
+endpoint sends to virtual endpoints only, with up to 
+MCAPI_MAX_MSG_SIZE - 4 bytes a message, and has none of the 
+implementation specific message options (flow control, backlog, 
+coalescing, prefetch, dispatch). MCAPI_PORT_ANY never hands out a 
+virtual port. This is implementation specific.
+
 ***********************************************************************/
 
 mcapi_endpoint_t mcapi_endpoint_create(
@@ -434,15 +501,16 @@ mcapi_endpoint_t mcapi_endpoint_create(
 
     mcapi_status_t status;
     *mcapi_status = MCAPI_SUCCESS;
-    mcapi_domain_t domain_id = mcapi_domain_id_get(&status);
+    mcapi_domain_id_get(&status);
     if (status != MCAPI_SUCCESS) {
       printf("%s() %d\n", __func__, __LINE__);
       *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
-    } else if (mcapi_trans_endpoint_exists (domain_id,port_id)) {
+    } else if (mcapi_trans_endpoint_exists (port_id)) {
 
       printf("%s() %d\n", __func__, __LINE__);
       *mcapi_status = MCAPI_ERR_ENDP_EXISTS;
-    } else if (mcapi_trans_num_endpoints (domain_id) == MCAPI_MAX_ENDPOINTS) {
+    } else if (!MCAPI_VPORT_IS(port_id) &&
+               mcapi_trans_num_endpoints () >= mcapi_trans_max_endpoints ()) {
 
       printf("%s() %d\n", __func__, __LINE__);
       *mcapi_status = MCAPI_ERR_ENDP_LIMIT;
@@ -450,7 +518,7 @@ mcapi_endpoint_t mcapi_endpoint_create(
 
       printf("%s() %d\n", __func__, __LINE__);
       *mcapi_status = MCAPI_ERR_PORT_INVALID;  
-    } else if (!mcapi_trans_endpoint_create(&e,port_id,MCAPI_FALSE))  {
+    } else if (!mcapi_trans_endpoint_create(&e,port_id,port_id == MCAPI_PORT_ANY))  {
 
       printf("%s() %d\n", __func__, __LINE__);
       *mcapi_status = MCAPI_ERR_ENDP_NOPORTS;
@@ -461,6 +529,121 @@ mcapi_endpoint_t mcapi_endpoint_create(
 
 
 
+/************************************************************************
+mcapi_endpoint_create_many - create several endpoints.
+
+DESCRIPTION
+
+mcapi_endpoint_create_many() creates number endpoints on the local 
+node, endpoints[i] on port_ids[i], like mcapi_endpoint_create() for 
+each of them. Entries that fail leave the others as they are. 
+
+With the MCAPI_SESSION_POOL environment variable set to n (up to 16), 
+the sessions of deleted endpoints are kept open for the next endpoint 
+on the same port, and the first n MCAPI_PORT_ANY ports get theirs at 
+mcapi_initialize(): such endpoints are created and deleted without 
+calls into the driver. The ports of the kept sessions stay taken for 
+other processes; MCAPI_PORT_ANY hands them out to the process that 
+keeps them first, and they are free again with its last 
+mcapi_finalize(). This is implementation specific.
+
+RETURN VALUE
+
+statuses[i] is set to the status mcapi_endpoint_create() gives for 
+entry i. *mcapi_status is set to MCAPI_SUCCESS when all the entries 
+succeeded, else to the error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT	The node is not initialized.
+
+MCAPI_ERR_PARAMETER	Incorrect array parameter.
+
+MCAPI_ERR_GENERAL	Some of the entries failed, see statuses.
+
+NOTE
+
+This function is implementation specific.
+
+***********************************************************************/
+
+void mcapi_endpoint_create_many(
+ 	MCAPI_IN mcapi_uint_t number,
+ 	MCAPI_IN mcapi_port_t* port_ids,
+ 	MCAPI_OUT mcapi_endpoint_t* endpoints,
+ 	MCAPI_OUT mcapi_status_t* statuses,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+  mcapi_uint_t i;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (number && (!port_ids || !endpoints || !statuses)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    *mcapi_status = MCAPI_SUCCESS;
+    for (i = 0; i < number; i++) {
+      endpoints[i] = mcapi_endpoint_create(port_ids[i], &statuses[i]);
+      if (statuses[i] != MCAPI_SUCCESS)
+        *mcapi_status = MCAPI_ERR_GENERAL;
+    }
+  }
+}
+
+
+
+/************************************************************************
+mcapi_endpoint_delete_many - delete several endpoints.
+
+DESCRIPTION
+
+mcapi_endpoint_delete_many() deletes number endpoints, like 
+mcapi_endpoint_delete() for each of them. Entries that fail leave 
+the others as they are. See mcapi_endpoint_create_many() for the 
+sessions of deleted endpoints.
+
+RETURN VALUE
+
+statuses[i] is set to the status mcapi_endpoint_delete() gives for 
+entry i. *mcapi_status is set to MCAPI_SUCCESS when all the entries 
+succeeded, else to the error defined below.
+
+ERRORS
+
+MCAPI_ERR_PARAMETER	Incorrect array parameter.
+
+MCAPI_ERR_GENERAL	Some of the entries failed, see statuses.
+
+NOTE
+
+This function is implementation specific.
+
+***********************************************************************/
+
+void mcapi_endpoint_delete_many(
+ 	MCAPI_IN mcapi_uint_t number,
+ 	MCAPI_IN mcapi_endpoint_t* endpoints,
+ 	MCAPI_OUT mcapi_status_t* statuses,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_uint_t i;
+
+  if (number && (!endpoints || !statuses)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+    return;
+  }
+  *mcapi_status = MCAPI_SUCCESS;
+  for (i = 0; i < number; i++) {
+    mcapi_endpoint_delete(endpoints[i], &statuses[i]);
+    if (statuses[i] != MCAPI_SUCCESS)
+      *mcapi_status = MCAPI_ERR_GENERAL;
+  }
+}
+
+
+
 /************************************************************************
 mcapi_endpoint_get_i - obtain the endpoint associated with a given tuple.
 
@@ -522,6 +705,67 @@ void mcapi_endpoint_get_i(
 }
 
 
+/************************************************************************
+mcapi_endpoint_get_many - obtain the endpoints of several tuples at once.
+
+DESCRIPTION
+
+mcapi_endpoint_get_many() gets the endpoints of number tuples 
+<domain_ids[i], node_ids[i], port_ids[i]> into endpoints[i], like 
+mcapi_endpoint_get_i() for each of them followed by waiting for all 
+of the requests. The remote endpoints are all asked for before any is 
+waited for, so the time taken is that of the slowest peer rather than 
+the sum of them. It is a blocking function that returns once every 
+entry has completed or timeout (in milliseconds, MCAPI_TIMEOUT_INFINITE 
+to wait for all of them) has passed.
+
+RETURN VALUE
+
+statuses[i] is set to MCAPI_SUCCESS when endpoints[i] was filled in, 
+else to the error of the entry: any error of mcapi_endpoint_get_i() or 
+mcapi_wait(), or MCAPI_TIMEOUT. *mcapi_status is set to MCAPI_SUCCESS 
+when all the entries succeeded, else to the error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT	The node is not initialized.
+
+MCAPI_ERR_PARAMETER	Incorrect array parameter.
+
+MCAPI_ERR_GENERAL	Some of the entries failed, see statuses.
+
+NOTE
+
+This function is implementation specific.
+
+***********************************************************************/
+
+void mcapi_endpoint_get_many(
+ 	MCAPI_IN mcapi_uint_t number,
+ 	MCAPI_IN mcapi_domain_t* domain_ids,
+ 	MCAPI_IN mcapi_node_t* node_ids,
+ 	MCAPI_IN mcapi_port_t* port_ids,
+ 	MCAPI_OUT mcapi_endpoint_t* endpoints,
+ 	MCAPI_OUT mcapi_status_t* statuses,
+ 	MCAPI_IN mcapi_timeout_t timeout,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (number && (!domain_ids || !node_ids || !port_ids || !endpoints || !statuses)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else if (mcapi_trans_endpoint_get_many(number, domain_ids, node_ids, port_ids,
+                                           endpoints, statuses, timeout) == number) {
+    *mcapi_status = MCAPI_SUCCESS;
+  } else {
+    *mcapi_status = MCAPI_ERR_GENERAL;
+  }
+}
+
+
 /************************************************************************
 mcapi_endpoint_get - obtain the endpoint associated with a given tuple.
 
@@ -533,6 +777,13 @@ a global tuple name <domain_id, node_id, port_id>.  This function
 will block until the specified remote endpoint has been created 
 via the mcapi_endpoint_create() call. 
 
+The endpoints of other cores the driver has confirmed are 
+remembered by the process, so getting one again (also with 
+mcapi_endpoint_get_i()) does not ask the core. They are forgotten 
+when a send or query to their core finds a port gone, as after 
+the core was reset, and on the last mcapi_finalize(). This is 
+implementation specific.
+
 
 RETURN VALUE
 
@@ -636,6 +887,92 @@ void mcapi_endpoint_delete(
 }
 
 
+
+/************************************************************************
+mcapi_topology_bring_up - sets up a static topology on the local node.
+
+DESCRIPTION
+
+Brings up the routes and endpoints a topology file describes (see 
+mcapi_topology.h) in one call. The routes are set first, then the 
+endpoints of the local node are created and the handles of all the 
+endpoints are filled in, endpoints[i] for topology->endpoints[i]. 
+The handles of remote endpoints are made from their tuples without 
+asking the driver, so unlike mcapi_endpoint_get() the call does not 
+wait for the remote endpoints to be created. It is a blocking 
+function and has to be called after mcapi_initialize().
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below and the 
+endpoints created so far are left as they are.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT	The node is not initialized.
+
+MCAPI_ERR_PARAMETER	Incorrect topology or endpoints parameter.
+
+MCAPI_ERR_NODE_INVALID	A route names a node or core that is not valid.
+
+MCAPI_ERR_PORT_INVALID	A remote endpoint has no valid port.
+
+Any error of mcapi_endpoint_create() for a local endpoint.
+
+NOTE
+
+This function is implementation specific.
+
+***********************************************************************/
+
+void mcapi_topology_bring_up(
+ 	MCAPI_IN mcapi_topology_t* topology,
+ 	MCAPI_OUT mcapi_endpoint_t* endpoints,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  const mcapi_topology_route* route;
+  const mcapi_topology_endpoint* ep;
+  mcapi_domain_t domain_id;
+  mcapi_node_t node_id = 0;
+  mcapi_status_t status;
+  mcapi_uint_t i;
+
+  domain_id = mcapi_domain_id_get(&status);
+  if (status == MCAPI_SUCCESS)
+    node_id = mcapi_node_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+    return;
+  }
+  if (!topology || !endpoints) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+    return;
+  }
+  *mcapi_status = MCAPI_SUCCESS;
+  for (i = 0; i < topology->num_routes; i++) {
+    route = &topology->routes[i];
+    if (!mcapi_trans_route_set(route->domain_id, route->node_id, route->cpu)) {
+      *mcapi_status = MCAPI_ERR_NODE_INVALID;
+      return;
+    }
+  }
+  for (i = 0; i < topology->num_endpoints; i++) {
+    ep = &topology->endpoints[i];
+    if (ep->domain_id == domain_id && ep->node_id == node_id) {
+      endpoints[i] = mcapi_endpoint_create(ep->port_id, mcapi_status);
+      if (*mcapi_status != MCAPI_SUCCESS)
+        return;
+    } else if (ep->port_id == MCAPI_PORT_ANY || !mcapi_trans_valid_port(ep->port_id)) {
+      *mcapi_status = MCAPI_ERR_PORT_INVALID;
+      return;
+    } else {
+      mcapi_trans_get_endpoint_internal(&endpoints[i], ep->domain_id, ep->node_id, ep->port_id);
+    }
+  }
+}
+
+
 /************************************************************************
 mcapi_endpoint_get_attribute- get endpoint attributes.
 
@@ -663,7 +1000,244 @@ mcapi_endpoint_set_attribute - set endpoint attributes.
 
 DESCRIPTION
 
+Sets the attribute attribute_num of the local endpoint to the value 
+attribute points to, of attribute_size bytes. The only attribute this 
+implementation keeps is MCAPI_ENDP_ATTR_MEMORY_TYPE, an 
+mcapi_endp_attr_memory_type_t. Its locality picks the shared buffers 
+mcapi_msg_send_multi() stages payloads in for the endpoint: uncached 
+ones, the default, or cacheable ones for 
+MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY, which are cleaned from the cache 
+once staged; without driver support for cacheable buffers that type 
+is refused. MCAPI_ENDP_ATTR_FAIL_ON_MEM_LIMIT or'ed into the value 
+makes mcapi_msg_send_i() fail with MCAPI_ERR_MEM_LIMIT when the 
+transport has no free slot, rather than leave the send pending (see 
+mcapi_msg_credits_available()). The other attributes are accepted and 
+ignored. 
+mcapi_endpoint_get_attribute() returns the value.
+
+RETURN VALUE
+
+On success *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_ENDP_REMOTE		The endpoint is not a local one.
+
+MCAPI_ERR_ATTR_NUM		Unknown attribute number.
+
+MCAPI_ERR_ATTR_SIZE		Incorrect attribute size.
+
+MCAPI_ERR_ATTR_VALUE		Incorrect attribute value.
+
+MCAPI_ERR_ATTR_NOTSUPPORTED	The memory type of a virtual endpoint, or 
+				cacheable memory without driver support.
+
+MCAPI_ERR_PARAMETER		Incorrect attribute parameter.
+
+***********************************************************************/
+void mcapi_endpoint_set_attribute(
+        MCAPI_IN mcapi_endpoint_t endpoint,
+        MCAPI_IN mcapi_uint_t attribute_num,
+        MCAPI_IN const void* attribute,
+        MCAPI_IN size_t attribute_size,
+        MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if ( ! mcapi_trans_valid_endpoint(endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (attribute == NULL) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_endpoint_set_attribute(endpoint,attribute_num,attribute,attribute_size,mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_buffer_alloc - allocates a buffer the other cores can access.
+
+DESCRIPTION
+
+Allocates size bytes of shared memory from the driver and returns 
+their address in this process, and their physical address, which the 
+other cores use, in *paddr. memory_type is a 
+mcapi_endp_attr_memory_type_t locality: MCAPI_ENDP_ATTR_SHARED_MEMORY 
+gives uncached memory, every access of which goes to the memory, 
+MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY cacheable memory, faster to work 
+in for large payloads but handed between the cores with 
+mcapi_buffer_sync_for_device() and mcapi_buffer_sync_for_cpu(). 
+Without driver support for cacheable buffers, asking for one fails 
+with MCAPI_ERR_MEM_LIMIT; only the emulator build (SM_EMULATOR) hands 
+out uncached ones instead. The buffers that are not 
+freed go back to the driver with the last mcapi_finalize() of the 
+process. This function is implementation specific and not part of 
+the MCAPI specification.
+
+RETURN VALUE
+
+On success the buffer is returned and *mcapi_status is set to 
+MCAPI_SUCCESS. On error, NULL is returned and *mcapi_status is set 
+to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT		The node is not initialized.
+
+MCAPI_ERR_PARAMETER		Incorrect size, memory_type or paddr parameter.
+
+MCAPI_ERR_MEM_LIMIT		No memory available, or no cacheable memory 
+				without driver support.
+
+***********************************************************************/
+void* mcapi_buffer_alloc(
+        MCAPI_IN size_t size,
+        MCAPI_IN mcapi_uint_t memory_type,
+        MCAPI_OUT mcapi_uint_t* paddr,
+        MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+  void* buffer = NULL;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (!size || size > UINT32_MAX || !paddr ||
+             ((memory_type & 0xffff) != MCAPI_ENDP_ATTR_SHARED_MEMORY &&
+              (memory_type & 0xffff) != MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_buffer_alloc(size, (memory_type & 0xffff) == MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY,
+      &buffer, paddr, mcapi_status);
+  }
+  return buffer;
+}
+
+
+/************************************************************************
+mcapi_buffer_free - frees a buffer of mcapi_buffer_alloc().
+
+DESCRIPTION
+
+Gives the buffer back to the driver. This function is implementation 
+specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT		The node is not initialized.
+
+MCAPI_ERR_PARAMETER		buffer was not returned by mcapi_buffer_alloc().
+
+***********************************************************************/
+void mcapi_buffer_free(
+        MCAPI_IN void* buffer,
+        MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (!buffer) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_buffer_free(buffer, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_buffer_sync_for_device - hands a cached buffer to the other cores.
+
+DESCRIPTION
+
+Cleans the size bytes at buffer, in a buffer of mcapi_buffer_alloc(), 
+from the CPU caches, so that the other cores read what this one wrote. 
+Call it after writing and before sending the physical address. It does 
+nothing for an uncached buffer. This function is implementation specific and not part 
+of the MCAPI specification.
+
+RETURN VALUE
+
+On success *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT		The node is not initialized.
+
+MCAPI_ERR_PARAMETER		The bytes are not in a buffer of mcapi_buffer_alloc().
+
+MCAPI_ERR_GENERAL		The driver failed.
+
+***********************************************************************/
+void mcapi_buffer_sync_for_device(
+        MCAPI_IN void* buffer,
+        MCAPI_IN size_t size,
+        MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (!buffer) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_buffer_sync(buffer, size, MCAPI_TRUE, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_buffer_sync_for_cpu - takes a cached buffer back from the other cores.
+
+DESCRIPTION
+
+Invalidates the size bytes at buffer, in a buffer of 
+mcapi_buffer_alloc(), in the CPU caches, so that this core reads what 
+the other ones wrote. Call it after they are done with the buffer and 
+before reading it. It does nothing for an uncached buffer. This 
+function is implementation specific and not part of the MCAPI 
+specification.
+
+RETURN VALUE
+
+On success *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_NODE_NOTINIT		The node is not initialized.
+
+MCAPI_ERR_PARAMETER		The bytes are not in a buffer of mcapi_buffer_alloc().
+
+MCAPI_ERR_GENERAL		The driver failed.
+
 ***********************************************************************/
+void mcapi_buffer_sync_for_cpu(
+        MCAPI_IN void* buffer,
+        MCAPI_IN size_t size,
+        MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_status_t status;
+
+  mcapi_domain_id_get(&status);
+  if (status != MCAPI_SUCCESS) {
+    *mcapi_status = MCAPI_ERR_NODE_NOTINIT;
+  } else if (!buffer) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_buffer_sync(buffer, size, MCAPI_FALSE, mcapi_status);
+  }
+}
 
 
 /************************************************************************
@@ -997,6 +1571,605 @@ mcapi_uint_t mcapi_msg_available(
 }
 
 
+/************************************************************************
+mcapi_msg_credits_available - number of messages that can be sent without blocking.
+
+DESCRIPTION
+
+Returns the flow control credit of a local send endpoint. The credit 
+is the number of messages the endpoint can post with mcapi_msg_send_i() 
+before the transport runs out of free slots: the free slots of the 
+node, split between its endpoints. It is read from the transport 
+when the endpoint runs out, and given back when a non-blocking send 
+completes (mcapi_test() or mcapi_wait()). mcapi_msg_send_i() on an 
+endpoint without credit reads it again at once and still issues the 
+send, which is left MCAPI_PENDING if the node has no free slot. An 
+endpoint whose MCAPI_ENDP_ATTR_MEMORY_TYPE includes 
+MCAPI_ENDP_ATTR_FAIL_ON_MEM_LIMIT fails such a send with 
+MCAPI_ERR_MEM_LIMIT instead, and releases its request. This function is 
+implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, the number of credits is returned and *mcapi_status 
+is set to MCAPI_SUCCESS. On error, MCAPI_NULL is returned and 
+*mcapi_status is set to the appropriate error defined below. 
+MCAPI_NULL (or 0) could be a valid number of credits, so status 
+has to be checked to ensure correctness.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+***********************************************************************/
+
+mcapi_uint_t mcapi_msg_credits_available(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_uint_t rc = 0;
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    rc = mcapi_trans_msg_credits_available(send_endpoint, mcapi_status);
+  }
+  return rc;
+}
+
+
+/************************************************************************
+mcapi_msg_credits_wait - waits until a send endpoint has credit.
+
+DESCRIPTION
+
+Blocks until the local send endpoint has flow control credit (see 
+mcapi_msg_credits_available()) or the timeout expires. timeout 
+is in milliseconds, MCAPI_TIMEOUT_INFINITE waits forever and 
+MCAPI_TIMEOUT_IMMEDIATE checks once. The transport is polled with 
+an exponential backoff, so waiting senders don't load the driver. 
+This function is implementation specific and not part of the MCAPI 
+specification.
+
+RETURN VALUE
+
+On success, the number of credits is returned and *mcapi_status 
+is set to MCAPI_SUCCESS. On error, MCAPI_NULL is returned and 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_TIMEOUT		No credit became available within timeout.
+
+***********************************************************************/
+
+mcapi_uint_t mcapi_msg_credits_wait(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN mcapi_timeout_t timeout,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_uint_t rc = 0;
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    rc = mcapi_trans_msg_credits_wait(send_endpoint, timeout, mcapi_status);
+  }
+  return rc;
+}
+
+
+/************************************************************************
+mcapi_msg_credits_notify - registers a callback for returning credit.
+
+DESCRIPTION
+
+Registers callback to be called with context when the local send 
+endpoint goes from no credit to some credit. The callback runs in 
+the thread whose MCAPI call (mcapi_test(), mcapi_wait(), sends or 
+the credit functions above) noticed the change, and must not block. 
+A NULL callback removes the registration. This function is 
+implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+***********************************************************************/
+
+void mcapi_msg_credits_notify(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN mcapi_credit_callback_t callback,
+ 	MCAPI_IN void* context,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    mcapi_trans_msg_credits_notify(send_endpoint, callback, context, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_send_backlog - sets the send backlog depth of an endpoint.
+
+DESCRIPTION
+
+Gives the local send endpoint a userspace backlog of depth messages 
+(0 removes it). With a backlog, mcapi_msg_send_i() does not fail 
+or return MCAPI_PENDING because the transport is momentarily full: 
+the message is copied into the backlog and the call returns 
+MCAPI_SUCCESS with a request that completes once the message has 
+actually been handed to the transport. The backlog is pushed out 
+in order by later sends on the endpoint, by mcapi_test() and 
+mcapi_wait() on its requests and by mcapi_msg_send_flush(). The 
+caller's buffer can be reused as soon as mcapi_msg_send_i() returns. 
+This function is implementation specific and not part of the MCAPI 
+specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MEM_LIMIT		No memory available for the backlog.
+
+MCAPI_ERR_PARAMETER		depth is larger than the queue element limit 
+			(MCAPI_NODE_ATTR_MAX_QUEUE_ELEMENTS).
+
+MCAPI_PENDING		The current backlog still holds messages, flush it first.
+
+***********************************************************************/
+
+void mcapi_msg_send_backlog(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN mcapi_uint_t depth,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (depth > mcapi_trans_max_queue_elements()) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_msg_send_backlog(send_endpoint, depth, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_send_flush - pushes out the send backlog of an endpoint.
+
+DESCRIPTION
+
+Blocks until every message in the backlog of the local send endpoint 
+(see mcapi_msg_send_backlog()) has been handed to the transport or 
+the timeout expires. timeout is in milliseconds, MCAPI_TIMEOUT_INFINITE 
+waits forever and MCAPI_TIMEOUT_IMMEDIATE pushes out what fits 
+right now. This function is implementation specific and not part 
+of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_TIMEOUT		The backlog was not empty when the timeout expired.
+
+***********************************************************************/
+
+void mcapi_msg_send_flush(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN mcapi_timeout_t timeout,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    mcapi_trans_msg_send_flush(send_endpoint, timeout, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_send_multi - sends the same message to several receive endpoints.
+
+DESCRIPTION
+
+Sends the message in buffer from the local send endpoint to each of 
+the count receive endpoints, like mcapi_msg_send() for each of them, 
+and returns once buffer can be reused. The messages are handed to the 
+transport together, in the order of receive_endpoints. 
+
+With MCAPI_MULTI_SHARED in flags, the receivers on other cores must 
+decode references, see mcapi_shared_parse() in mcapi_frame.h. When two 
+or more of them get the message and it has MCAPI_SHARED_MIN (64) 
+bytes or more, it is copied once into a shared buffer, and those 
+receivers (up to 16) get a reference to it instead: they read the 
+payload in place and release it with mcapi_shared_release(). The 
+buffer is uncached unless the MCAPI_ENDP_ATTR_MEMORY_TYPE of 
+send_endpoint is MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY, see 
+mcapi_endpoint_set_attribute(). The buffer is reused once all of them 
+have released it, never before: a receiver that does not release its 
+reference keeps the buffer busy. Receivers on this processor, and every receiver when no shared buffer 
+is free, get a plain message. Without the flag every receiver gets a 
+plain message. The shared buffers go back to the driver with the last 
+mcapi_finalize() of the process. This function is implementation 
+specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+statuses[i] is set to the status of the message to receive_endpoints[i]. 
+*mcapi_status is set to MCAPI_SUCCESS when all of them were sent, else 
+to the error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		send_endpoint is not a valid endpoint descriptor.
+
+MCAPI_ERR_MSG_LIMIT		The message size exceeds the maximum size allowed by the MCAPI implementation.
+
+MCAPI_ERR_MEM_LIMIT		No memory available.
+
+MCAPI_ERR_PRIORITY		Incorrect priority level.
+
+MCAPI_ERR_PARAMETER		Incorrect array or buffer parameter, or unknown flags.
+
+MCAPI_ERR_GENERAL		Some of the messages failed, see statuses.
+
+***********************************************************************/
+
+void mcapi_msg_send_multi(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN mcapi_endpoint_t* receive_endpoints, 
+ 	MCAPI_IN mcapi_uint_t count, 
+ 	MCAPI_IN void* buffer, 
+ 	MCAPI_IN size_t buffer_size, 
+ 	MCAPI_IN mcapi_priority_t priority, 
+ 	MCAPI_IN mcapi_uint_t flags, 
+ 	MCAPI_OUT mcapi_status_t* statuses, 
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  mcapi_uint_t i;
+
+  *mcapi_status = MCAPI_SUCCESS;
+  if (! mcapi_trans_valid_priority (priority)) {
+    *mcapi_status = MCAPI_ERR_PRIORITY;
+  } else if (!mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (count && (!receive_endpoints || !statuses)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else if ((!buffer && buffer_size) || (flags & ~MCAPI_MULTI_SHARED)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else if (buffer_size > MCAPI_MAX_MSG_SIZE) {
+    *mcapi_status = MCAPI_ERR_MSG_LIMIT;
+  } else {
+    for (i = 0; i < count; i++) {
+      statuses[i] = mcapi_trans_valid_endpoints(send_endpoint, receive_endpoints[i]) ?
+        MCAPI_SUCCESS : MCAPI_ERR_ENDP_INVALID;
+    }
+    mcapi_trans_msg_send_multi(send_endpoint, receive_endpoints, count, buffer, buffer_size,
+      flags, statuses, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_coalesce - packs small messages of an endpoint together.
+
+DESCRIPTION
+
+Makes the local send endpoint coalesce messages: consecutive messages 
+for the same receive endpoint are packed into one transport packet 
+of at most max_bytes (framed as described in mcapi_frame.h) instead 
+of being sent one by one. A batch is sent when it is full, when the 
+next message goes to another endpoint or doesn't fit, when its oldest 
+message is older than deadline_us microseconds, or on 
+mcapi_msg_coalesce_flush(). The batch size adapts between a single 
+message and max_bytes: it grows while batches fill up before the 
+deadline and shrinks when they don't. The deadline is checked when 
+the endpoint is used (sends, receives, mcapi_msg_available(), 
+mcapi_test() and mcapi_wait() on its requests), and by a thread the 
+process starts with its first coalescing endpoint, which sends the 
+batches whose deadline passes meanwhile. Requests of coalesced 
+mcapi_msg_send_i() calls complete immediately. A batch the transport 
+refuses is kept and tried again by the next send or flush on the 
+endpoint, which fails with MCAPI_ERR_TRANSMISSION and drops it if it 
+is refused again. Messages that don't fit into max_bytes on their 
+own are sent as usual. The receive endpoint has to accept coalesced 
+packets, see mcapi_msg_coalesce_accept(). max_bytes 0 turns 
+coalescing off. 
+This function is implementation specific and not part of the MCAPI 
+specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MEM_LIMIT		No memory available for the batch.
+
+MCAPI_ERR_PARAMETER		max_bytes is larger than MCAPI_MAX_MSG_SIZE or too small 
+			to hold a message.
+
+MCAPI_ERR_TRANSMISSION		The previous batch could not be sent.
+
+***********************************************************************/
+
+void mcapi_msg_coalesce(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_IN size_t max_bytes,
+ 	MCAPI_IN mcapi_uint_t deadline_us,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (max_bytes && (max_bytes > MCAPI_MAX_MSG_SIZE ||
+      max_bytes < sizeof(mcapi_frame_header) + MCAPI_FRAME_RECORD_SPACE(1))) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_msg_coalesce(send_endpoint, max_bytes, deadline_us, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_coalesce_flush - sends the pending batch of an endpoint.
+
+DESCRIPTION
+
+Sends the messages the local send endpoint has coalesced so far 
+(see mcapi_msg_coalesce()), blocking until the transport takes 
+the packet. Does nothing if there are none. This function is 
+implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_TRANSMISSION		The batch could not be sent.
+
+***********************************************************************/
+
+void mcapi_msg_coalesce_flush(
+ 	MCAPI_IN mcapi_endpoint_t send_endpoint, 
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(send_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    mcapi_trans_msg_coalesce_flush(send_endpoint, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_coalesce_accept - unpacks coalesced packets on receive.
+
+DESCRIPTION
+
+With enable set, the local receive endpoint splits packets sent by 
+coalescing endpoints (see mcapi_msg_coalesce()) back into the 
+original messages: each mcapi_msg_recv(), mcapi_msg_recv_i() and 
+mcapi_wait() returns one message, and mcapi_msg_available() counts 
+the messages of a packet that are still to be received. Packets 
+that are not coalesced are received unchanged: only packets from 
+endpoints of this processor that have had coalescing turned on 
+since they were created are split, so a plain message is never 
+taken for a frame because of its first bytes. This function is 
+implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MEM_LIMIT		No memory available for the receive buffer.
+
+MCAPI_PENDING		Messages of the last packet have not been received yet.
+
+***********************************************************************/
+
+void mcapi_msg_coalesce_accept(
+ 	MCAPI_IN mcapi_endpoint_t receive_endpoint, 
+ 	MCAPI_IN mcapi_boolean_t enable,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(receive_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else {
+    mcapi_trans_msg_coalesce_accept(receive_endpoint, enable, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_recv_prefetch - sets the receive prefetch depth of an endpoint.
+
+DESCRIPTION
+
+Gives the local receive endpoint a userspace ring of depth messages 
+(0 removes it). When a receive finds the ring empty and more messages 
+are queued in the transport, up to depth of them are fetched in one 
+batch, and the following mcapi_msg_recv(), mcapi_msg_recv_i(), 
+mcapi_test() and mcapi_wait() calls are served from the ring without 
+going to the driver. mcapi_msg_available() includes the messages in 
+the ring. Message order is not affected. This function is 
+implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MEM_LIMIT		No memory available for the ring.
+
+MCAPI_ERR_PARAMETER		depth is larger than the queue element limit 
+			(MCAPI_NODE_ATTR_MAX_QUEUE_ELEMENTS).
+
+MCAPI_PENDING		The ring still holds messages, receive them first.
+
+***********************************************************************/
+
+void mcapi_msg_recv_prefetch(
+ 	MCAPI_IN mcapi_endpoint_t receive_endpoint, 
+ 	MCAPI_IN mcapi_uint_t depth,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(receive_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (depth > mcapi_trans_max_queue_elements()) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_msg_recv_prefetch(receive_endpoint, depth, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_recv_dispatch - shares a receive endpoint between worker threads.
+
+DESCRIPTION
+
+Lets up to workers threads receive from the local receive endpoint 
+at the same time (0 turns it off). Only one of them waits in the 
+driver: it receives a batch of messages and hands them to the 
+others, which sleep until a message is queued for them. With 
+key_offset set to MCAPI_DISPATCH_NO_KEY any worker gets the next 
+message, through mcapi_msg_recv() or mcapi_msg_recv_worker(). 
+Otherwise the 32 bit value at key_offset of each message selects 
+worker key % workers, so messages with the same key are received in 
+order by the same thread, and each worker calls 
+mcapi_msg_recv_worker() with its own number (mcapi_msg_recv() is 
+worker 0). Messages shorter than key_offset + 4 bytes go to worker 0. 
+mcapi_msg_available() includes the queued messages. 
+mcapi_msg_recv_i() is not dispatched and should not be mixed with it. 
+This function is implementation specific and not part of the MCAPI 
+specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MEM_LIMIT		No memory available for the worker queues.
+
+MCAPI_ERR_PARAMETER		workers is larger than the queue element limit 
+			(MCAPI_NODE_ATTR_MAX_QUEUE_ELEMENTS).
+
+MCAPI_PENDING		Workers are still receiving or messages are still queued.
+
+***********************************************************************/
+
+void mcapi_msg_recv_dispatch(
+ 	MCAPI_IN mcapi_endpoint_t receive_endpoint, 
+ 	MCAPI_IN mcapi_uint_t workers,
+ 	MCAPI_IN size_t key_offset,
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if( !mcapi_trans_valid_endpoint(receive_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (workers > mcapi_trans_max_queue_elements()) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else {
+    mcapi_trans_msg_recv_dispatch(receive_endpoint, workers, key_offset, mcapi_status);
+  }
+}
+
+
+/************************************************************************
+mcapi_msg_recv_worker - receives a message as one of an endpoint's workers.
+
+DESCRIPTION
+
+Blocking receive like mcapi_msg_recv(), made by worker number worker 
+of an endpoint shared with mcapi_msg_recv_dispatch(). With a routing 
+key the call returns the messages routed to this worker; otherwise, 
+or on an endpoint without workers, worker is not used. This function 
+is implementation specific and not part of the MCAPI specification.
+
+RETURN VALUE
+
+On success, *mcapi_status is set to MCAPI_SUCCESS. On error, 
+*mcapi_status is set to the appropriate error defined below.
+
+ERRORS
+
+MCAPI_ERR_PARAMETER		Invalid buffer or received_size parameter, or 
+			worker is not below the number of workers.
+
+MCAPI_ERR_ENDP_INVALID		Argument is not a valid endpoint descriptor.
+
+MCAPI_ERR_MSG_TRUNCATED		The message size exceeds the buffer_size.
+
+***********************************************************************/
+
+void mcapi_msg_recv_worker(
+ 	MCAPI_IN mcapi_endpoint_t receive_endpoint, 
+ 	MCAPI_IN mcapi_uint_t worker,
+ 	MCAPI_OUT void* buffer, 
+ 	MCAPI_IN size_t buffer_size, 
+ 	MCAPI_OUT size_t* received_size, 
+ 	MCAPI_OUT mcapi_status_t* mcapi_status)
+{
+  *mcapi_status = MCAPI_SUCCESS;
+  if (! mcapi_trans_valid_buffer_param(buffer) || ! mcapi_trans_valid_size_param(received_size)) {
+    *mcapi_status = MCAPI_ERR_PARAMETER;
+  } else if (!mcapi_trans_valid_endpoint(receive_endpoint)) {
+    *mcapi_status = MCAPI_ERR_ENDP_INVALID;
+  } else if (mcapi_trans_msg_recv_worker(receive_endpoint,worker,buffer,buffer_size,received_size, mcapi_status)) {
+	if (*received_size > buffer_size) {
+	  *received_size = buffer_size;
+	  *mcapi_status = MCAPI_ERR_MSG_TRUNCATED;
+	}
+  }
+}
+
+
 /************************************************************************
 mcapi_pktchan_connect_i - connects send & receive side endpoints.
 
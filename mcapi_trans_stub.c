@@ -30,18 +30,31 @@ notice, this list of conditions and the following disclaimer.
  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the open file description locks */
+#endif
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/sem.h>
-#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/vfs.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/magic.h>
 
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include <mcapi_dev_impl.h>
 #include <mcapi.h>
 #include <transport_sm.h>
+#include <mcapi_frame.h>
 #include <mcapi_test.h>
 #include <icc.h>
 
@@ -49,23 +62,72 @@ notice, this list of conditions and the following disclaimer.
 #define MASTER_NODE_NUM 0
 #define SLAVE_NODE_NUM 1
 
-#define SEMKEYPATH "/dev/null"  /* Path used on ftok for semget key  */
-#define SEMKEYID 1              /* Id used on ftok for semget key    */
-#define SHMKEYPATH "/dev/null"  /* Path used on ftok for shmget key  */
-#define SHMKEYID 2              /* Id used on ftok for shmget key    */
 #define MAGIC_NUM 0xdeadcafe
 
-/* the semaphore id */
-uint32_t sem_id;
-/* the shared memory address */
-void* shm_addr;
+/* name of the database segment, MCAPI_SHM_NAME in the environment
+   overrides it */
+#define MCAPI_SHM_NAME "/mcapi_db"
+/* bytes of the segment's file used as locks: the first is write locked
+   while a process attaches or detaches, the second is read locked by every
+   process that has the segment mapped. The kernel drops both when their
+   holder dies. */
+#define MCAPI_DB_LOCK_ATTACH 0
+#define MCAPI_DB_LOCK_USER 1
+/* first of the MCAPI_DB_PROCESSES process slot bytes */
+#define MCAPI_DB_LOCK_PROCESS 2
+
 /* the shared memory database */
 mcapi_database* c_db = NULL;
-
-unsigned mcapi_nindex = 0;
-unsigned mcapi_dindex = 0;
-mcapi_node_t mcapi_node_num = 0;
-mcapi_domain_t mcapi_domain_id = 0;
+/* the file backing it, how much of it is mapped and where it lives */
+static int mcapi_db_fd = -1;
+static size_t mcapi_db_map_size;
+static char mcapi_db_path[PATH_MAX];
+static mcapi_boolean_t mcapi_db_hugetlb;
+/* keep the database on finalize, and whether it was reused on initialize */
+static mcapi_boolean_t mcapi_db_warm;
+static mcapi_boolean_t mcapi_db_reused;
+/* this process's slot, owner of what it allocates (as slot + 1) */
+static int mcapi_db_slot = -1;
+/* serialises attaching and detaching within the process */
+static pthread_mutex_t mcapi_db_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the capacities c_db was laid out with */
+mcapi_db_limits mcapi_limits;
+/* this process's view of its endpoints, indexed like the db endpoints,
+   mcapi_limits.endpoints of them */
+endpoint_local* mcapi_ep_local;
+/* serialises the threads using an endpoint's mcapi_ep_local entry; kept
+   apart so that resetting the entry leaves the lock alone */
+static endpoint_lock* mcapi_ep_lock;
+static uint32_t mcapi_ep_local_count;
+
+/* requests reserved by this thread but not handed out yet, see
+   mcapi_trans_reserve_request() */
+typedef struct {
+	int count;
+	int quota;		/* ids it may hold, 0 or MCAPI_REQUEST_CACHE */
+	uint32_t generation;
+	int ids[MCAPI_REQUEST_CACHE + 1];
+} request_cache;
+static __thread request_cache mcapi_req_cache;
+static uint32_t mcapi_req_generation;
+static pthread_key_t mcapi_req_key;
+static pthread_once_t mcapi_req_once = PTHREAD_ONCE_INIT;
+
+/* the nodes this process hosts and the node each thread works as */
+static mcapi_local_node mcapi_local_nodes[MCAPI_LOCAL_NODES];
+static int mcapi_local_node_count;
+static __thread mcapi_local_node* mcapi_node_self;
+/* the first of them, for the threads that initialized none */
+static mcapi_local_node* volatile mcapi_node_default;
+/* what a process without a node works as: node index 0 of domain index 0 */
+static mcapi_local_node mcapi_node_none;
+/* serialises initializing and finalizing the nodes of the process */
+static pthread_mutex_t mcapi_local_node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the virtual endpoints of this process, by the carrier of their ports */
+static mux_carrier mcapi_mux_carriers[MCAPI_VPORT_CARRIERS] = {
+	[0 ... MCAPI_VPORT_CARRIERS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER }
+};
 
 /* the debug level */
 int mcapi_debug = 0;
@@ -85,127 +147,497 @@ static inline void mcapi_dprintf(int level,const char *format, ...) {
 }
 mcapi_endpoint_t mcapi_icc_index;
 mcapi_boolean_t mcapi_trans_valid_request_handle (mcapi_request_t* request);
+static void mcapi_trans_backlog_free_internal(int index);
+static void mcapi_trans_coalesce_free_internal(int index);
+static void mcapi_trans_coalesce_stop_internal(void);
+static mcapi_boolean_t mcapi_trans_dispatch_free_internal(dispatch_state* d);
+static mcapi_boolean_t mcapi_trans_dispatch_close_internal(dispatch_state* d);
+static void mcapi_trans_dispatch_destroy_internal(dispatch_state* d);
+static uint64_t mcapi_trans_now_us(void);
+static mcapi_boolean_t mcapi_trans_backoff_internal(uint64_t start, mcapi_timeout_t timeout, useconds_t* backoff);
+mcapi_boolean_t mcapi_trans_test_i(mcapi_request_t* request, size_t* size, mcapi_status_t* mcapi_status);
+uint32_t mcapi_trans_encode_handle_internal(uint16_t domain_id, uint16_t node_id, uint16_t port_id);
+static int mcapi_trans_reclaim_internal(int fd, mcapi_database* db, mcapi_boolean_t attach_locked);
+static mcapi_boolean_t mcapi_trans_owner_dead_internal(int fd, uint16_t owner, uint8_t* known);
+static mux_carrier* mcapi_trans_mux_carrier_internal(uint16_t d, uint16_t n, uint16_t port);
+static mcapi_boolean_t mcapi_trans_mux_exists_internal(mcapi_domain_t d, mcapi_uint_t n, mcapi_uint_t port);
+static mcapi_boolean_t mcapi_trans_mux_create_internal(mcapi_local_node* self, uint16_t port);
+static void mcapi_trans_mux_delete_internal(mux_carrier* c, uint16_t port);
+static void mcapi_trans_mux_remove_node_internal(uint16_t dindex, uint16_t nindex);
+static void mcapi_trans_shared_free_internal(void);
+static int mcapi_trans_port_take_internal(mcapi_port_map* map, mcapi_uint_t port_num);
+static void mcapi_trans_port_put_internal(mcapi_port_map* map, mcapi_uint_t port_num);
+static void mcapi_trans_port_put_entry_internal(mcapi_port_map* map, mcapi_uint_t port_num);
+static void mcapi_trans_port_unindex_internal(mcapi_port_map* map, mcapi_uint_t port_num, int index);
+
+/* The database lock: a process shared, robust mutex in the segment. Taking
+   it uncontended is an atomic operation and no system call. When its owner
+   died holding it, the next locker gets it marked consistent again; the
+   tables it guards are only ever changed by short, self contained updates. */
+static mcapi_boolean_t transport_sm_init_db_lock(mcapi_database* db)
+{
+	pthread_mutexattr_t attr;
+	int rc;
 
-/* semaphore management */
-int transport_sm_create_semaphore(uint32_t semkey) {
-	int sem_id;
-	union semun {
-		int              val;    /* Value for SETVAL */
-		struct semid_ds *buf;    /* Buffer for IPC_STAT, IPC_SET */
-		unsigned short  *array;  /* Array for GETALL, SETALL */
-		struct seminfo  *__buf;  /* Buffer for IPC_INFO
-					    (Linux-specific) */
-	} arg;
-
-	if((sem_id = semget(semkey, 1, IPC_CREAT|IPC_EXCL|0666)) == -1)  {
-		printf("semget\n");
-		if (errno == EEXIST) {
-			if((sem_id = semget(semkey, 1, 0)) == -1)  {
-				printf("semget failed\n");
-				return -1;
-			}
-			return sem_id;
-		}
-		return -1;
-	} else {
-		arg.val = 1;
-		if (semctl(sem_id, 0, SETVAL, arg) == -1) {
-			printf("semctl\n");
-			return -1;
-		}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	/* priority inheritance if the kernel has it */
+	pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+	rc = pthread_mutex_init(&db->lock, &attr);
+	if (rc) {
+		pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_NONE);
+		rc = pthread_mutex_init(&db->lock, &attr);
 	}
-	return sem_id;
+	pthread_mutexattr_destroy(&attr);
+	return rc ? MCAPI_FALSE : MCAPI_TRUE;
 }
 
-mcapi_boolean_t transport_sm_lock_semaphore(uint32_t semid)
+mcapi_boolean_t transport_sm_lock_db(mcapi_database* db)
 {
-	struct sembuf sem_lock={ 0, -1, 0}; 
-	if((semop(sem_id, &sem_lock, 1)) == -1) {
-		return -1;
+	int rc = pthread_mutex_lock(&db->lock);
+
+	if (rc == EOWNERDEAD) {
+		mcapi_dprintf(1, "%s: owner of the database lock died, recovering\n", __func__);
+		pthread_mutex_consistent(&db->lock);
+		rc = 0;
 	}
-	return 0;
+	return rc ? MCAPI_FALSE : MCAPI_TRUE;
+}
+
+mcapi_boolean_t transport_sm_unlock_db(mcapi_database* db)
+{
+	return pthread_mutex_unlock(&db->lock) ? MCAPI_FALSE : MCAPI_TRUE;
+}
+
+/****************** routing ******************************/
+/* route of <domain_id, node_id>, NULL when the domain is unknown */
+static inline mcapi_route* mcapi_trans_route_internal(uint16_t domain_id, uint16_t node_id)
+{
+	uint8_t d = MCAPI_DB_DOMAIN_ROUTE(c_db, domain_id);
+
+	return d ? &MCAPI_DB_ROUTE(c_db, d - 1, node_id) : NULL;
 }
 
-mcapi_boolean_t transport_sm_unlock_semaphore(uint32_t semid)
+/* database index of domain_id, when create taking the next free one for
+   it; -1 when there is none. The database should already be locked. */
+static int mcapi_trans_route_domain_internal(mcapi_database* db, mca_domain_t domain_id,
+		mcapi_boolean_t create)
 {
-	struct sembuf sem_unlock={ 0, 1, 0};
-	/* Attempt to unlock the semaphore set */
-	if((semop(sem_id, &sem_unlock, 1)) == -1) {
+	uint8_t d = MCAPI_DB_DOMAIN_ROUTE(db, domain_id);
+
+	if (d)
+		return d - 1;
+	if (!create || db->num_domains >= db->limits.domains)
 		return -1;
+	d = db->num_domains++;
+	MCAPI_DB_DOMAIN(db, d).domain_id = domain_id;
+	MCAPI_DB_DOMAIN_ROUTE(db, domain_id) = d + 1;
+	return d;
+}
+
+/* core the transport reaches <domain_id, node_id> on: this one for the
+   nodes of this processor, the configured one for the others, else the
+   core of the node's number */
+uint16_t mcapi_trans_route_cpu_internal(uint16_t domain_id, uint16_t node_id)
+{
+	mcapi_route* r = mcapi_trans_route_internal(domain_id, node_id);
+
+	if (r && r->node_index)
+		return MASTER_NODE_NUM;
+	return (r && r->cpu) ? r->cpu - 1 : node_id;
+}
+
+/* handle of port on the node the messages of core cpu come from */
+static mcapi_endpoint_t mcapi_trans_sender_handle_internal(uint16_t cpu, uint16_t port)
+{
+	mcapi_cpu_route* r;
+
+	if (cpu < MCAPI_ROUTE_CPUS) {
+		r = &MCAPI_DB_CPU_ROUTE(c_db, cpu);
+		if (r->valid)
+			return mcapi_trans_encode_handle_internal(r->domain_id, r->node_id, port);
 	}
+	return mcapi_trans_encode_handle_internal(mcapi_trans_self_internal()->domain_id, cpu, port);
+}
 
-	return 0;
+/****************** remote endpoint cache ******************************/
+/* Remote endpoints the driver confirmed, so that getting one again is
+   answered without querying its core. An entry is the handle, a valid bit
+   and the generation of the core the endpoint is on: bumping a core's
+   generation drops all of its entries at once, when it no longer knows a
+   port (the session was shut down, the core was reset). */
+#define MCAPI_REMOTE_CACHE 256	/* power of 2 */
+#define MCAPI_REMOTE_CACHE_PROBES 4
+static uint64_t mcapi_remote_cache[MCAPI_REMOTE_CACHE];
+static uint32_t mcapi_remote_gen[MCAPI_ROUTE_CPUS];
+
+static inline uint64_t mcapi_trans_remote_entry_internal(mcapi_endpoint_t handle, uint16_t cpu)
+{
+	uint32_t gen = __atomic_load_n(&mcapi_remote_gen[cpu % MCAPI_ROUTE_CPUS], __ATOMIC_ACQUIRE);
+
+	return ((uint64_t)gen << 33) | (1ULL << 32) | handle;
 }
 
-void* sm_attach_shared_mem(uint32_t shmid){ 
-	void *shm_addr;
-	int rval;
-	struct shmid_ds dsbuf;
+static inline unsigned mcapi_trans_remote_slot_internal(mcapi_endpoint_t handle)
+{
+	return ((handle * 2654435761u) >> 16) & (MCAPI_REMOTE_CACHE - 1);
+}
 
-	shm_addr = shmat(shmid, 0, 0);
-	if ((long)shm_addr == (-1)) {
-		return NULL;
+/* checks if <domain, node, port> on core cpu is confirmed, *handle is its
+   handle when it is */
+static mcapi_boolean_t mcapi_trans_remote_cached_internal(uint16_t domain_id, uint16_t node_id,
+		uint16_t port_id, uint16_t cpu, mcapi_endpoint_t* handle)
+{
+	mcapi_endpoint_t h = ((domain_id & MCAPI_DOMAIN_MASK) << MCAPI_DOMAIN_SHIFT) |
+		((node_id & MCAPI_NODE_MASK) << MCAPI_NODE_SHIFT) | ((port_id & MCAPI_PORT_MASK) << MCAPI_PORT_SHIFT);
+	uint64_t want = mcapi_trans_remote_entry_internal(h, cpu);
+	unsigned slot = mcapi_trans_remote_slot_internal(h);
+	int i;
+
+	for (i = 0; i < MCAPI_REMOTE_CACHE_PROBES; i++) {
+		if (__atomic_load_n(&mcapi_remote_cache[(slot + i) & (MCAPI_REMOTE_CACHE - 1)],
+				__ATOMIC_RELAXED) == want) {
+			*handle = h;
+			return MCAPI_TRUE;
+		}
 	}
-	rval = shmctl(shmid, IPC_STAT, &dsbuf);
-	if (rval != 0) {
-		shmdt(shm_addr);
-		return NULL;
+	return MCAPI_FALSE;
+}
+
+/* the driver confirmed handle on core cpu; the entry takes the place of a
+   stale one, else of the first of its slots */
+static void mcapi_trans_remote_confirm_internal(mcapi_endpoint_t handle, uint16_t cpu)
+{
+	uint64_t entry = mcapi_trans_remote_entry_internal(handle, cpu);
+	unsigned slot = mcapi_trans_remote_slot_internal(handle);
+	uint64_t old;
+	int i;
+
+	for (i = 0; i < MCAPI_REMOTE_CACHE_PROBES; i++) {
+		old = __atomic_load_n(&mcapi_remote_cache[(slot + i) & (MCAPI_REMOTE_CACHE - 1)], __ATOMIC_RELAXED);
+		if (old == entry)
+			return;
+		if (!old || (uint32_t)old == handle)
+			break;
+	}
+	if (i == MCAPI_REMOTE_CACHE_PROBES)
+		i = 0;
+	__atomic_store_n(&mcapi_remote_cache[(slot + i) & (MCAPI_REMOTE_CACHE - 1)], entry, __ATOMIC_RELAXED);
+}
+
+/* drops the confirmed endpoints of core cpu */
+void mcapi_trans_remote_invalidate_internal(uint16_t cpu)
+{
+	__atomic_fetch_add(&mcapi_remote_gen[cpu % MCAPI_ROUTE_CPUS], 1, __ATOMIC_RELEASE);
+}
+
+/* routes <domain, node> to core cpu */
+static mcapi_boolean_t mcapi_trans_route_set_internal(mcapi_database* db, unsigned long domain,
+		unsigned long node, unsigned long cpu)
+{
+	int d;
+
+	if (domain > MCAPI_DOMAIN_MASK || node > MCAPI_NODE_MASK || cpu >= MCAPI_ROUTE_CPUS)
+		return MCAPI_FALSE;
+	d = mcapi_trans_route_domain_internal(db, domain, MCAPI_TRUE);
+	if (d < 0)
+		return MCAPI_FALSE;
+	MCAPI_DB_ROUTE(db, d, node).cpu = cpu + 1;
+	MCAPI_DB_CPU_ROUTE(db, cpu).domain_id = domain;
+	MCAPI_DB_CPU_ROUTE(db, cpu).node_id = node;
+	MCAPI_DB_CPU_ROUTE(db, cpu).valid = 1;
+	return MCAPI_TRUE;
+}
+
+/* routes <domain_id, node_id> to core cpu for all the processes, e.g. from
+   a static topology */
+mcapi_boolean_t mcapi_trans_route_set(mcapi_domain_t domain_id, mcapi_node_t node_id, mcapi_uint_t cpu)
+{
+	mcapi_boolean_t rc;
+
+	if (!c_db || !transport_sm_lock_db(c_db))
+		return MCAPI_FALSE;
+	rc = mcapi_trans_route_set_internal(c_db, domain_id, node_id, cpu);
+	transport_sm_unlock_db(c_db);
+	return rc;
+}
+
+/* Routes to the nodes of the other cores from MCAPI_ROUTES, a list of
+   domain:node=cpu separated by commas, for the process creating the
+   database. */
+static void mcapi_trans_routes_config_internal(mcapi_database* db)
+{
+	const char* e = getenv("MCAPI_ROUTES");
+	unsigned long domain, node, cpu;
+	char* end;
+
+	while (e && *e) {
+		domain = strtoul(e, &end, 0);
+		if (*end != ':')
+			break;
+		node = strtoul(end + 1, &end, 0);
+		if (*end != '=')
+			break;
+		cpu = strtoul(end + 1, &end, 0);
+		if ((*end && *end != ',') || !mcapi_trans_route_set_internal(db, domain, node, cpu))
+			break;
+		e = *end ? end + 1 : end;
 	}
+	if (e && *e)
+		mcapi_dprintf(1, "%s: MCAPI_ROUTES ignored from \"%s\"\n", __func__, e);
+}
+
+/****************** local nodes ******************************/
+mcapi_local_node* mcapi_trans_self_internal(void)
+{
+	mcapi_local_node* node = mcapi_node_self;
+
+	if (node && node->valid)
+		return node;
+	node = mcapi_node_default;
+	return node ? node : &mcapi_node_none;
+}
+
+endpoint_entry* mcapi_trans_local_endpoint_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	return &MCAPI_DB_ENDPOINT(c_db, l->dindex, l->nindex, index);
+}
 
-	/* if we are the first to attach, then initialize the segment to 0 */
-	if (dsbuf.shm_nattch == 1) {
-		memset(shm_addr,0,dsbuf.shm_segsz);
+static void mcapi_trans_endpoint_delete_internal(uint16_t dindex, uint16_t nindex, uint16_t index);
+static void mcapi_trans_endpoint_close_internal(uint16_t dindex, uint16_t nindex, uint16_t index, mcapi_boolean_t pool);
+
+/****************** session pool ******************************/
+/* Sessions of deleted endpoints stay open on their ports for the next
+   endpoint created on the same port, which then needs no CMD_SM_CREATE,
+   nor its delete a CMD_SM_SHUTDOWN. As MCAPI_PORT_ANY hands out the
+   lowest free port, a service creating and deleting reply endpoints keeps
+   getting the same few. The MCAPI_SESSION_POOL environment variable sizes
+   the pool (0, the default, turns it off); as many sessions are opened
+   ahead for the first MCAPI_PORT_ANY ports. A pooled port stays taken in
+   the port map, so that no other endpoint collides with the session, and
+   is recorded in the process's row of MCAPI_DB_POOLED: the ports of a
+   process that dies are reclaimed with its endpoints. MCAPI_PORT_ANY
+   hands out the pooled ones of the process first. */
+typedef struct {
+	uint16_t index;
+	uint16_t port;
+} mcapi_pooled_session;
+
+static mcapi_pooled_session mcapi_session_pool[MCAPI_SESSION_POOL_MAX];
+static int mcapi_session_pool_count;
+static int mcapi_session_pool_size;
+static pthread_mutex_t mcapi_session_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* records port as pooled by this process, or no longer; the database is
+   locked */
+static void mcapi_trans_session_pool_record_internal(uint16_t port, mcapi_boolean_t pooled)
+{
+	int i;
+
+	for (i = 0; i < MCAPI_SESSION_POOL_MAX; i++) {
+		if (MCAPI_DB_POOLED(c_db, mcapi_db_slot, i) == (pooled ? 0 : port + 1)) {
+			MCAPI_DB_POOLED(c_db, mcapi_db_slot, i) = pooled ? port + 1 : 0;
+			return;
+		}
 	}
-	return shm_addr;
 }
 
-/* shared memory management */
-mcapi_boolean_t transport_sm_create_shared_mem(void** addr,uint32_t shmkey,uint32_t size) 
+/* closes the pooled sessions and frees their ports */
+static void mcapi_trans_session_pool_drain_internal(void)
 {
-	uint32_t shmid = shmget(shmkey, size, 0666 | IPC_CREAT | IPC_EXCL); 
-	if (errno == EEXIST) {
-		shmid = shmget(shmkey, size, 0666 | IPC_CREAT); 
+	mcapi_pooled_session* p;
+
+	pthread_mutex_lock(&mcapi_session_pool_lock);
+	while (mcapi_session_pool_count) {
+		p = &mcapi_session_pool[--mcapi_session_pool_count];
+		sm_destroy_session(p->index);
+		transport_sm_lock_db(c_db);
+		mcapi_trans_session_pool_record_internal(p->port, MCAPI_FALSE);
+		mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(c_db), p->port);
+		transport_sm_unlock_db(c_db);
 	}
+	pthread_mutex_unlock(&mcapi_session_pool_lock);
+}
 
-	if (shmid == -1) {
-		return MCAPI_FALSE;
-	}  else {
-		*addr = sm_attach_shared_mem(shmid);
-		return MCAPI_TRUE;
+/* sizes the pool and fills it, for the first node of the process */
+static void mcapi_trans_session_pool_fill_internal(void)
+{
+	const char* e = getenv("MCAPI_SESSION_POOL");
+	int index, port;
+
+	mcapi_session_pool_size = e ? atoi(e) : 0;
+	if (mcapi_session_pool_size < 0)
+		mcapi_session_pool_size = 0;
+	if (mcapi_session_pool_size > MCAPI_SESSION_POOL_MAX)
+		mcapi_session_pool_size = MCAPI_SESSION_POOL_MAX;
+	pthread_mutex_lock(&mcapi_session_pool_lock);
+	while (mcapi_session_pool_count < mcapi_session_pool_size) {
+		transport_sm_lock_db(c_db);
+		port = mcapi_trans_port_take_internal(&MCAPI_DB_PORT_MAP(c_db), MCAPI_PORT_ANY);
+		if (port >= 0)
+			mcapi_trans_session_pool_record_internal(port, MCAPI_TRUE);
+		transport_sm_unlock_db(c_db);
+		if (port < 0)
+			break;
+		index = sm_create_session(port, SP_PACKET);
+		if (index < 0 || index >= mcapi_limits.endpoints) {
+			if (index >= 0)
+				sm_destroy_session(index);
+			transport_sm_lock_db(c_db);
+			mcapi_trans_session_pool_record_internal(port, MCAPI_FALSE);
+			mcapi_trans_port_put_internal(&MCAPI_DB_PORT_MAP(c_db), port);
+			transport_sm_unlock_db(c_db);
+			break;
+		}
+		mcapi_session_pool[mcapi_session_pool_count].index = index;
+		mcapi_session_pool[mcapi_session_pool_count].port = port;
+		mcapi_session_pool_count++;
 	}
+	pthread_mutex_unlock(&mcapi_session_pool_lock);
 }
 
-mcapi_boolean_t transport_sm_free_shared_mem(uint32_t shmid,void *shm_address)
+/* the pooled session on *port, or on the lowest pooled port that is not
+   virtual for MCAPI_PORT_ANY, then set in *port; the port goes from the
+   pool to the new endpoint, taken as it is. -1 if there is none. */
+static int mcapi_trans_session_claim_internal(mcapi_uint_t* port)
 {
-	int rval;
-	struct shmid_ds shmid_struct;
-	struct shmid_ds dsbuf;
+	mcapi_pooled_session* p;
+	int i, best = -1, index = -1;
 
-	/* detach the shared memory segment */
-	int rc = shmdt(shm_address);
-	if (rc==-1) {
-		mcapi_dprintf(1,"Warning: mrapi: sysvr4_free_shared_mem shmdt() failed\n");
-		return MCAPI_FALSE;
+	if (!mcapi_session_pool_count)
+		return -1;
+	pthread_mutex_lock(&mcapi_session_pool_lock);
+	for (i = 0; i < mcapi_session_pool_count; i++) {
+		p = &mcapi_session_pool[i];
+		if (*port != MCAPI_PORT_ANY ? p->port == *port :
+				!MCAPI_VPORT_IS(p->port) && (best < 0 || p->port < mcapi_session_pool[best].port))
+			best = i;
+	}
+	if (best >= 0) {
+		index = mcapi_session_pool[best].index;
+		*port = mcapi_session_pool[best].port;
+		mcapi_session_pool[best] = mcapi_session_pool[--mcapi_session_pool_count];
+		transport_sm_lock_db(c_db);
+		mcapi_trans_session_pool_record_internal(*port, MCAPI_FALSE);
+		transport_sm_unlock_db(c_db);
 	}
+	pthread_mutex_unlock(&mcapi_session_pool_lock);
+	return index;
+}
+
+/* whether this process pools a session on port */
+static mcapi_boolean_t mcapi_trans_session_pooled_internal(mcapi_uint_t port)
+{
+	mcapi_boolean_t pooled = MCAPI_FALSE;
+	int i;
 
-	rval = shmctl(shmid, IPC_STAT, &dsbuf);
-	if (rval != 0) {
-		shmdt(shm_addr);
+	if (!mcapi_session_pool_count)
 		return MCAPI_FALSE;
+	pthread_mutex_lock(&mcapi_session_pool_lock);
+	for (i = 0; i < mcapi_session_pool_count && !pooled; i++)
+		pooled = (mcapi_session_pool[i].port == port);
+	pthread_mutex_unlock(&mcapi_session_pool_lock);
+	return pooled;
+}
+
+/* a new session on port; returns its index */
+static int mcapi_trans_session_create_internal(uint16_t port)
+{
+	int index;
+
+	index = sm_create_session(port, SP_PACKET);
+	if ((index < 0 || index >= mcapi_limits.endpoints) && mcapi_session_pool_count) {
+		/* the pooled sessions may be what the driver ran out of */
+		if (index >= 0)
+			sm_destroy_session(index);
+		mcapi_trans_session_pool_drain_internal();
+		index = sm_create_session(port, SP_PACKET);
 	}
+	return index;
+}
 
-	/* if we are the first to attach, then initialize the segment to 0 */
-	if (dsbuf.shm_nattch == 0) {
-		/* delete the shared memory id */
-		rc = shmctl(shmid, IPC_RMID, &shmid_struct);
-		if (rc==-1)  {
-			mcapi_dprintf(1,"Warning: mrapi: sysvr4_free_shared_mem shmctl() failed\n");
-			return MCAPI_FALSE;
-		}
+/* pools the session of a deleted endpoint, with its port; false if it
+   is not, the caller closes it then */
+static mcapi_boolean_t mcapi_trans_session_put_internal(int index, uint16_t port)
+{
+	struct sm_session_status status;
+	mcapi_boolean_t pooled = MCAPI_FALSE;
 
+	/* messages for the deleted endpoint are dropped with its session */
+	if (!mcapi_session_pool_size || sm_get_session_status(index, &status) || status.n_avail)
+		return MCAPI_FALSE;
+	pthread_mutex_lock(&mcapi_session_pool_lock);
+	if (mcapi_session_pool_count < mcapi_session_pool_size) {
+		mcapi_session_pool[mcapi_session_pool_count].index = index;
+		mcapi_session_pool[mcapi_session_pool_count].port = port;
+		mcapi_session_pool_count++;
+		transport_sm_lock_db(c_db);
+		mcapi_trans_session_pool_record_internal(port, MCAPI_TRUE);
+		transport_sm_unlock_db(c_db);
+		pooled = MCAPI_TRUE;
 	}
-	return MCAPI_TRUE;
+	pthread_mutex_unlock(&mcapi_session_pool_lock);
+	return pooled;
+}
+
+/* makes <d, n> a node of this process, the one the calling thread works
+   as; mcapi_local_node_lock held and a free entry left */
+static void mcapi_trans_local_node_bind_internal(uint16_t d, uint16_t n,
+		mcapi_domain_t domain_id, mcapi_node_t node_id)
+{
+	mcapi_local_node* node = mcapi_local_nodes;
+
+	while (node->valid)
+		node++;
+	node->dindex = d;
+	node->nindex = n;
+	node->node_num = node_id;
+	node->domain_id = domain_id;
+	node->valid = MCAPI_TRUE;
+	mcapi_node_self = node;
+	if (!mcapi_node_default)
+		mcapi_node_default = node;
+	mcapi_local_node_count++;
+}
 
+/* Finalizes a node of this process: its endpoints are deleted and it is
+   removed from the database, unless both are kept for a warm restart.
+   mcapi_local_node_lock held. */
+static void mcapi_trans_local_node_remove_internal(mcapi_local_node* node)
+{
+	mcapi_database* mcapi_db = c_db;
+	int i;
+
+	/* virtual endpoints are this process's own, a restart can't keep them */
+	mcapi_trans_mux_remove_node_internal(node->dindex, node->nindex);
+	if (!mcapi_db_warm) {
+		for (i = 0; i < mcapi_limits.endpoints; i++) {
+			if (mcapi_ep_local[i].dindex == node->dindex && mcapi_ep_local[i].nindex == node->nindex &&
+					MCAPI_DB_ENDPOINT(mcapi_db, node->dindex, node->nindex, i).valid &&
+					MCAPI_DB_ENDPOINT_OWNER(mcapi_db, node->dindex, node->nindex, i) == mcapi_db_slot + 1)
+				mcapi_trans_endpoint_delete_internal(node->dindex, node->nindex, i);
+		}
+		transport_sm_lock_db(mcapi_db);
+		MCAPI_DB_ROUTE(mcapi_db, node->dindex, node->node_num).node_index = 0;
+		MCAPI_DB_NODE(mcapi_db, node->dindex, node->nindex).valid = MCAPI_FALSE;
+		if (!--MCAPI_DB_DOMAIN(mcapi_db, node->dindex).num_nodes)
+			MCAPI_DB_DOMAIN(mcapi_db, node->dindex).valid = MCAPI_FALSE;
+		transport_sm_unlock_db(mcapi_db);
+	}
+	node->valid = MCAPI_FALSE;
+	mcapi_local_node_count--;
+	if (mcapi_node_default == node) {
+		mcapi_node_default = NULL;
+		for (i = 0; i < MCAPI_LOCAL_NODES; i++) {
+			if (mcapi_local_nodes[i].valid) {
+				mcapi_node_default = &mcapi_local_nodes[i];
+				break;
+			}
+		}
+	}
 }
 
 mcapi_boolean_t mcapi_trans_set_node_num(mcapi_uint_t n)
@@ -215,7 +647,7 @@ mcapi_boolean_t mcapi_trans_set_node_num(mcapi_uint_t n)
 
 mcapi_boolean_t mcapi_trans_get_node_num(mcapi_uint_t* node)
 {
-	*node = c_db->domains[0].nodes[0].node_num;
+	*node = mcapi_trans_self_internal()->node_num;
 	return MCAPI_TRUE;
 }
 
@@ -227,8 +659,10 @@ mcapi_boolean_t mcapi_trans_get_domain_num(mcapi_domain_t* domain)
 
 	return mcapi_trans_whoami(&node,&n,domain,&d);
 #endif
-	if (c_db->domains[0].valid) {
-		*domain = c_db->domains[0].domain_id;
+	mcapi_local_node* self = mcapi_trans_self_internal();
+
+	if (MCAPI_DB_DOMAIN(c_db, self->dindex).valid) {
+		*domain = MCAPI_DB_DOMAIN(c_db, self->dindex).domain_id;
 		return MCAPI_TRUE;
 	} else
 		return MCAPI_FALSE;
@@ -236,209 +670,337 @@ mcapi_boolean_t mcapi_trans_get_domain_num(mcapi_domain_t* domain)
 
 mcapi_boolean_t mcapi_trans_get_port_num(mcapi_uint_t port_index, mcapi_uint_t *port_num)
 {
-	int rc = MCAPI_FALSE;
-	int i;
-	for (i = 0; i < c_db->domains[0].num_nodes ; i++) {
-		if (c_db->domains[0].nodes[i].node_d.endpoints[port_index].valid) {
-			*port_num = c_db->domains[0].nodes[i].node_d.endpoints[port_index].port_num;
-			rc = MCAPI_TRUE;
-		}
-	}
-	return rc;
+	if (port_index >= mcapi_limits.endpoints || !MCAPI_DB_LOCAL_ENDPOINT(port_index).valid)
+		return MCAPI_FALSE;
+	*port_num = MCAPI_DB_LOCAL_ENDPOINT(port_index).port_num;
+	return MCAPI_TRUE;
 }
 
-mcapi_uint16_t mcapi_trans_get_node_index(mcapi_uint_t node_num)
+/* index of a node of this processor in its domain, mcapi_limits.nodes
+   when it is not one */
+mcapi_uint16_t mcapi_trans_get_node_index(mcapi_domain_t domain_id, mcapi_uint_t node_num)
 {
   /* look up the node */
-  uint32_t domain_index = 0;
-  int i;
-  uint32_t node_index = MCA_MAX_NODES;
-  for (i = 0; i < c_db->domains[domain_index].num_nodes; i++) {
-    if (c_db->domains[domain_index].nodes[i].node_num == node_num) {
-      node_index = i;
-      break;
-    }
-  }
-  assert (node_index != MCA_MAX_NODES);
-  return node_index;
+  mcapi_route* route = mcapi_trans_route_internal(domain_id, node_num);
+
+  if (!route || !route->node_index)
+    return mcapi_limits.nodes;
+  return route->node_index - 1;
 }
 
-mcapi_uint16_t mcapi_trans_get_port_index(mcapi_uint_t node_num, mcapi_uint_t port_num)
+mcapi_uint16_t mcapi_trans_get_port_index(mcapi_domain_t domain_id, mcapi_uint_t node_num,
+		mcapi_uint_t port_num)
 {
 	/* look up the node port*/
+	mcapi_route* route = mcapi_trans_route_internal(domain_id, node_num);
+	uint32_t domain_index = MCAPI_DB_DOMAIN_ROUTE(c_db, domain_id) - 1;
+	uint32_t port_index = mcapi_limits.endpoints;
 	int i, j;
-	uint32_t domain_index = 0;
-	uint32_t port_index = MCAPI_MAX_ENDPOINTS;
-	for (i = 0; i < c_db->domains[domain_index].num_nodes; i++) {
-		if (c_db->domains[domain_index].nodes[i].node_num == node_num) { 
-			for (j = 0; j < c_db->domains[domain_index].nodes[i].node_d.num_endpoints; j++) {
-				mcapi_dprintf(1,"index %d %d\n", c_db->domains[domain_index].nodes[i].node_d.endpoints[j].port_num, port_num);
-				if ((c_db->domains[domain_index].nodes[i].node_d.endpoints[j].valid) && 
-						(c_db->domains[domain_index].nodes[i].node_d.endpoints[j].port_num == port_num)) {
-					/* return the handle */
-					port_index = j;
-					break;
-				}
-			}
+
+	/* only the nodes of this processor have endpoints in the database,
+	   and virtual endpoints have none */
+	if (!route || !route->node_index || port_num > MCAPI_PORT_MASK || MCAPI_VPORT_IS(port_num))
+		return port_index;
+	i = route->node_index - 1;
+	/* the indices are the driver's session indices, they need not be
+	   dense (other processes, warm restarts): the port map has them; read
+	   without locks, the entry says whether it is still the port's */
+	j = MCAPI_DB_PORT_MAP(c_db).index[port_num] - 1;
+	if (j >= 0 && j < mcapi_limits.endpoints &&
+			MCAPI_DB_ENDPOINT(c_db, domain_index, i, j).valid &&
+			MCAPI_DB_ENDPOINT(c_db, domain_index, i, j).port_num == port_num)
+		port_index = j;
+
+	return port_index;
+}
+
+
+
+
+/* Takes port_num in map, or the first free port from MCAPI_PORT_ANY_FIRST
+   on (then from 0) for MCAPI_PORT_ANY; returns the port, -1 when it is
+   taken or there is none left. The database is locked. */
+static int mcapi_trans_port_take_internal(mcapi_port_map* map, mcapi_uint_t port_num)
+{
+	const int groups = MCAPI_PORT_WORDS / 64;
+	uint64_t free_words = 0;
+	int g = 0, i, w;
+
+	if (port_num == MCAPI_PORT_ANY) {
+		for (i = 0; i < groups; i++) {
+			g = (MCAPI_PORT_ANY_FIRST / 64 / 64 + i) % groups;
+			/* the virtual ports are only had by asking for them */
+			if (g == MCAPI_VPORT_FIRST / 64 / 64)
+				continue;
+			free_words = ~map->full[g];
+			if (free_words)
+				break;
 		}
+		if (!free_words)
+			return -1;
+		w = g * 64 + __builtin_ctzll(free_words);
+		port_num = w * 64 + __builtin_ctzll(~map->used[w]);
+	} else if ((map->used[port_num / 64] >> (port_num % 64)) & 1) {
+		return -1;
 	}
+	w = port_num / 64;
+	map->used[w] |= 1ULL << (port_num % 64);
+	if (!~map->used[w])
+		map->full[w / 64] |= 1ULL << (w % 64);
+	return port_num;
+}
 
-	return port_index;
+/* gives port_num back to map; the database is locked */
+static void mcapi_trans_port_put_internal(mcapi_port_map* map, mcapi_uint_t port_num)
+{
+	map->used[port_num / 64] &= ~(1ULL << (port_num % 64));
+	map->full[port_num / 64 / 64] &= ~(1ULL << (port_num / 64 % 64));
 }
 
+/* gives the port of a database endpoint back to map; that of a carrier
+   takes the ports of its channels along, the virtual endpoints on them
+   can't outlive it. The database is locked. */
+static void mcapi_trans_port_put_entry_internal(mcapi_port_map* map, mcapi_uint_t port_num)
+{
+	int w;
 
+	if (!MCAPI_VPORT_IS(port_num)) {
+		mcapi_trans_port_put_internal(map, port_num);
+		return;
+	}
+	for (w = port_num / 64; w < (port_num + MCAPI_VPORT_CHANNELS) / 64; w++) {
+		map->used[w] = 0;
+		map->full[w / 64] &= ~(1ULL << (w % 64));
+	}
+}
 
+/* the database endpoint index on port_num is gone from map, unless the
+   port has moved on to another one; the database is locked */
+static void mcapi_trans_port_unindex_internal(mcapi_port_map* map, mcapi_uint_t port_num, int index)
+{
+	if (map->index[port_num] == index + 1)
+		map->index[port_num] = 0;
+}
 
 mcapi_boolean_t mcapi_trans_add_node (mcapi_domain_t domain_id, mcapi_uint_t node_id, const mcapi_node_attributes_t* node_attrs) 
 {
-	uint32_t domain_index = 0;
 	mcapi_boolean_t rc = MCAPI_TRUE;
 	mcapi_database* mcapi_db = c_db;
+	mcapi_route* route = NULL;
 	int d = 0;
 	int n = 0;
 	int i = 0;
 
 
 	/* lock the database */
+	if (!transport_sm_lock_db(mcapi_db))
+		return MCAPI_FALSE;
 
-	/* mcapi should have checked that the node doesn't already exist */
-
-	if (mcapi_db->domains[domain_index].num_nodes == MCA_MAX_NODES) {
+	/* first see if this domain already exists, else take the next index */
+	d = mcapi_trans_route_domain_internal(mcapi_db, domain_id, MCAPI_TRUE);
+	if (d < 0) {
+		/* we didn't find an available domain index */
+		mcapi_dprintf(1,"You have hit MCA_MAX_DOMAINS, either use less domains or reconfigure with more domains");
 		rc = MCAPI_FALSE;
-	}
-
-	if (rc) {
-		/* first see if this domain already exists */
-		for (d = 0; d < MCA_MAX_DOMAINS; d++) {
-			if (mcapi_db->domains[d].domain_id == domain_id) {
-				break;
-			}
-		}
-		if (d == MCA_MAX_DOMAINS) {
-			/* it didn't exist so find the first available entry */
-			for (d = 0; d < MCA_MAX_DOMAINS; d++) {
-				if (mcapi_db->domains[d].valid == MCAPI_FALSE) {
-					break;
-				}
-			}
-		}
-		if (d != MCA_MAX_DOMAINS) {
-
-			/* now find an available node index...*/
-			for (n = 0; n < MCA_MAX_NODES; n++) {
-				/* Even though initialized() is checked by mcapi, we have to check again here because 
-				   initialized() and initalize() are  not atomic at the top layer */
-				if ((mcapi_db->domains[d].nodes[n].valid )&& 
-						(mcapi_db->domains[d].nodes[n].node_num == node_id)) {
-					/* this node already exists for this domain */
-					rc = MCAPI_FALSE;
-					mcapi_dprintf(1,"This node (%d) already exists for this domain(%d)",node_id,domain_id);
-					break; 
-				}
-			}
-			if (n == MCA_MAX_NODES) {
-				/* it didn't exist so find the first available entry */
-				for (n = 0; n < MCA_MAX_NODES; n++) {
-					if (mcapi_db->domains[d].nodes[n].valid == MCAPI_FALSE)
-						break;
-				}
+	} else {
+		route = &MCAPI_DB_ROUTE(mcapi_db, d, node_id);
+		if (route->node_index) {
+			n = route->node_index - 1;
+			/* after a warm restart the node is still there, take it over */
+			if (mcapi_db_reused) {
+				mcapi_trans_local_node_bind_internal(d, n, domain_id, node_id);
+				MCAPI_DB_NODE(mcapi_db, d, n).pid = getpid();
+				MCAPI_DB_NODE(mcapi_db, d, n).tid = pthread_self();
+				transport_sm_unlock_db(mcapi_db);
+				return MCAPI_TRUE;
 			}
-		} else {
-			/* we didn't find an available domain index */
-			mcapi_dprintf(1,"You have hit MCA_MAX_DOMAINS, either use less domains or reconfigure with more domains");
+			/* Even though initialized() is checked by mcapi, we have to check again here because 
+			   initialized() and initalize() are  not atomic at the top layer */
 			rc = MCAPI_FALSE;
-		}
-
-		if (n == MCA_MAX_NODES) {
+			mcapi_dprintf(1,"This node (%d) already exists for this domain(%d)",node_id,domain_id);
+		} else if (MCAPI_DB_DOMAIN(mcapi_db, d).num_nodes == mcapi_limits.nodes) {
 			/* we didn't find an available node index */
 			mcapi_dprintf(1,"You have hit MCA_MCA_MAX_NODES, either use less nodes or reconfigure with more nodes.");
 			rc = MCAPI_FALSE;
+		} else {
+			/* find the first available entry */
+			for (n = 0; n < mcapi_limits.nodes; n++) {
+				if (MCAPI_DB_NODE(mcapi_db, d, n).valid == MCAPI_FALSE)
+					break;
+			}
 		}
 	}
 
 
 	if (rc) {
-		if (n < MCA_MAX_NODES) {
+		if (n < mcapi_limits.nodes) {
 			/* add the caller to the database*/
 			/* set the domain */
-			mcapi_db->domains[d].domain_id = domain_id;
-			mcapi_db->domains[d].valid = MCAPI_TRUE;
+			MCAPI_DB_DOMAIN(mcapi_db, d).domain_id = domain_id;
+			MCAPI_DB_DOMAIN(mcapi_db, d).valid = MCAPI_TRUE;
 			/* set the node */ 
-			mcapi_nindex = n;
-			mcapi_node_num = node_id;
-			mcapi_domain_id = domain_id;
-			mcapi_dindex = d;
-			mcapi_db->domains[d].nodes[n].valid = MCAPI_TRUE;
-			mcapi_db->domains[d].nodes[n].node_num = node_id;
-			mcapi_db->domains[d].num_nodes++;
+			mcapi_trans_local_node_bind_internal(d, n, domain_id, node_id);
+			MCAPI_DB_NODE(mcapi_db, d, n).valid = MCAPI_TRUE;
+			MCAPI_DB_NODE(mcapi_db, d, n).node_num = node_id;
+			MCAPI_DB_NODE(mcapi_db, d, n).pid = getpid();
+			MCAPI_DB_NODE(mcapi_db, d, n).tid = pthread_self();
+			MCAPI_DB_DOMAIN(mcapi_db, d).num_nodes++;
 			/* set the node attributes */
 			if (node_attrs != NULL) {
-				memcpy(&mcapi_db->domains[d].nodes[n].attributes,
+				memcpy(&MCAPI_DB_NODE(mcapi_db, d, n).attributes,
 						node_attrs,
 						sizeof(mcapi_node_attributes_t));
 			}
 			/* initialize the attribute size for the only attribute we support */
-			mcapi_db->domains[d].nodes[n].attributes.entries[MCAPI_NODE_ATTR_TYPE_REGULAR].bytes=
+			MCAPI_DB_NODE(mcapi_db, d, n).attributes.entries[MCAPI_NODE_ATTR_TYPE_REGULAR].bytes=
 				sizeof(mcapi_node_attr_type_t);
 
-			for (i = 0; i < MCAPI_MAX_ENDPOINTS; i++) {
-				/* zero out all the endpoints */
-				memset (&mcapi_db->domains[d].nodes[n].node_d.endpoints[i],0,sizeof(endpoint_entry));
+			for (i = 0; i < mcapi_limits.endpoints; i++) {
+				/* zero out all the endpoints, the ports of leftovers are free */
+				if (MCAPI_DB_ENDPOINT(mcapi_db, d, n, i).valid) {
+					mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(mcapi_db),
+						MCAPI_DB_ENDPOINT(mcapi_db, d, n, i).port_num);
+					mcapi_trans_port_unindex_internal(&MCAPI_DB_PORT_MAP(mcapi_db),
+						MCAPI_DB_ENDPOINT(mcapi_db, d, n, i).port_num, i);
+				}
+				memset (&MCAPI_DB_ENDPOINT(mcapi_db, d, n, i),0,sizeof(endpoint_entry));
 			}
-			mcapi_db->domains[d].nodes[n].node_d.num_endpoints = 1;
+			MCAPI_DB_NODE(mcapi_db, d, n).node_d.num_endpoints = 0;
+			/* reachable once the entry is complete */
+			route->node_index = n + 1;
 		} 
 	}
 	/* unlock the database */
+	transport_sm_unlock_db(mcapi_db);
 
 	return rc;
 }
 
-mcapi_boolean_t mcapi_trans_remove_request(int r) {
-
-	mcapi_boolean_t rc = MCAPI_FALSE;
+/* Request ids move between the shared free list and a small per thread
+   cache in batches, so that threads reserving and removing requests only
+   take the database lock once every MCAPI_REQUEST_CACHE / 2 calls. The
+   caches are capped by MCAPI_REQUEST_CACHE_SHARE so that ids idling in
+   them don't run the free list dry; a thread that gets no quota takes
+   and returns its ids one at a time. */
+static void mcapi_trans_request_cache_put_internal(request_cache* cache, int n)
+{
 	indexed_array_header *header = &c_db->request_reserves_header;
-	assert(mcapi_trans_valid_request_handle(&r));
-	if (header->curr_count < header->max_count) {
-		c_db->requests[r].valid = MCAPI_FALSE;
-		header->array[r].next_index = header->empty_head_index;
+	int r;
+
+	transport_sm_lock_db(c_db);
+	while (n-- && cache->count) {
+		r = cache->ids[--cache->count];
+		MCAPI_DB_REQUEST(c_db, r).owner = 0;
+		MCAPI_DB_RESERVE(c_db, r).next_index = header->empty_head_index;
 		header->empty_head_index = r;
 		header->curr_count--;
-		rc = MCAPI_TRUE;
 	}
-	return rc; // if rc=false, then there is no request available (array is empty)
+	transport_sm_unlock_db(c_db);
+}
+
+/* gives cache a quota if the caches stay within their share of the
+   requests; the database is locked */
+static void mcapi_trans_request_quota_internal(request_cache* cache)
+{
+	uint32_t held = 0;
+	int slot;
+
+	for (slot = 0; slot < MCAPI_DB_PROCESSES; slot++)
+		held += c_db->request_quotas[slot];
+	if ((held + MCAPI_REQUEST_CACHE) * MCAPI_REQUEST_CACHE_SHARE > c_db->limits.requests)
+		return;
+	cache->quota = MCAPI_REQUEST_CACHE;
+	c_db->request_quotas[mcapi_db_slot] += MCAPI_REQUEST_CACHE;
+}
+
+static void mcapi_trans_request_cache_release(void* arg)
+{
+	request_cache* cache = arg;
+
+	if (c_db && cache->generation == mcapi_req_generation) {
+		mcapi_trans_request_cache_put_internal(cache, cache->count);
+		transport_sm_lock_db(c_db);
+		c_db->request_quotas[mcapi_db_slot] -= cache->quota;
+		transport_sm_unlock_db(c_db);
+	}
+	cache->count = 0;
+	cache->quota = 0;
+}
+
+static void mcapi_trans_request_key_create(void)
+{
+	pthread_key_create(&mcapi_req_key, mcapi_trans_request_cache_release);
+}
+
+static request_cache* mcapi_trans_request_cache_internal(void)
+{
+	request_cache* cache = &mcapi_req_cache;
+
+	if (cache->generation != mcapi_req_generation) {
+		/* the ids belong to a request table that has been reset */
+		cache->count = 0;
+		cache->quota = 0;
+		cache->generation = mcapi_req_generation;
+		pthread_once(&mcapi_req_once, mcapi_trans_request_key_create);
+		/* hands the cached ids back when the thread exits */
+		pthread_setspecific(mcapi_req_key, cache);
+	}
+	return cache;
+}
+
+mcapi_boolean_t mcapi_trans_remove_request(int r) {
+
+	request_cache* cache = mcapi_trans_request_cache_internal();
+	assert(mcapi_trans_valid_request_handle(&r));
+	MCAPI_DB_REQUEST(c_db, r).valid = MCAPI_FALSE;
+	cache->ids[cache->count++] = r;
+	if (cache->count > cache->quota)
+		mcapi_trans_request_cache_put_internal(cache, cache->count - cache->quota / 2);
+	return MCAPI_TRUE;
 }
 
 mcapi_boolean_t mcapi_trans_reserve_request(int *r) {
 
-	mcapi_boolean_t rc = MCAPI_FALSE;
 	mcapi_database *mcapi_db = c_db;
-
+	request_cache* cache = mcapi_trans_request_cache_internal();
 	indexed_array_header *header = &mcapi_db->request_reserves_header;
 
-	if (header->empty_head_index != -1) {
-		*r = header->empty_head_index;
-		mcapi_db->requests[*r].valid = MCAPI_TRUE;
-		header->empty_head_index = header->array[header->empty_head_index].next_index;
-		header->curr_count++;
-		rc = MCAPI_TRUE;
+	while (!cache->count) {
+		transport_sm_lock_db(c_db);
+		if (!cache->quota)
+			mcapi_trans_request_quota_internal(cache);
+		while (cache->count < (cache->quota ? cache->quota / 2 : 1) &&
+				header->empty_head_index != -1) {
+			cache->ids[cache->count] = header->empty_head_index;
+			MCAPI_DB_REQUEST(c_db, cache->ids[cache->count++]).owner = mcapi_db_slot + 1;
+			header->empty_head_index = MCAPI_DB_RESERVE(c_db, header->empty_head_index).next_index;
+			header->curr_count++;
+		}
+		transport_sm_unlock_db(c_db);
+		/* out of requests: take back those of dead processes, if any */
+		if (!cache->count && !mcapi_trans_reclaim_internal(mcapi_db_fd, c_db, MCAPI_FALSE))
+			return MCAPI_FALSE;
 	}
-	return rc;
+	*r = cache->ids[--cache->count];
+	MCAPI_DB_REQUEST(mcapi_db, *r).valid = MCAPI_TRUE;
+	return MCAPI_TRUE;
 }
 
-void mcapi_trans_init_request_indexed_array() {
+/* builds the request free list of a database just laid out */
+void mcapi_trans_init_request_indexed_array(mcapi_database *mcapi_db) {
 	int i;
-	mcapi_database *mcapi_db = c_db;
+	uint32_t requests = mcapi_db->limits.requests;
 
 	mcapi_db->request_reserves_header.curr_count = 0;
-	mcapi_db->request_reserves_header.max_count = MCAPI_MAX_REQUESTS;
+	mcapi_db->request_reserves_header.max_count = requests;
 	mcapi_db->request_reserves_header.empty_head_index = 0;
 	mcapi_db->request_reserves_header.full_head_index = -1;
-	for (i = 0; i < MCAPI_MAX_REQUESTS; i++) {
-		mcapi_db->request_reserves_header.array[i].next_index = i + 1;
-		mcapi_db->request_reserves_header.array[i].prev_index = i - 1;
+	for (i = 0; i < requests; i++) {
+		MCAPI_DB_RESERVE(mcapi_db, i).next_index = i + 1;
+		MCAPI_DB_RESERVE(mcapi_db, i).prev_index = i - 1;
 	}
-	mcapi_db->request_reserves_header.array[MCAPI_MAX_REQUESTS - 1].next_index = -1;
-	mcapi_db->request_reserves_header.array[0].prev_index = -1;
+	MCAPI_DB_RESERVE(mcapi_db, requests - 1).next_index = -1;
+	MCAPI_DB_RESERVE(mcapi_db, 0).prev_index = -1;
 
 }
 
@@ -503,20 +1065,23 @@ void setup_request_internal (mcapi_endpoint_t local_ep, mcapi_endpoint_t remote_
 		return;
 	mcapi_database *mcapi_db = c_db;
 	int id = *request;
-	mcapi_db->requests[id].ep_endpoint = remote_ep;
-	mcapi_db->requests[id].handle= local_ep;
-	mcapi_db->requests[id].valid = MCAPI_TRUE;
-	mcapi_db->requests[id].size = size;
-	mcapi_db->requests[id].cancelled = MCAPI_FALSE;
-	mcapi_db->requests[id].type = type;
-	mcapi_db->requests[id].buffer = buffer;
-	mcapi_db->requests[id].payload = payload;
+	MCAPI_DB_REQUEST(mcapi_db, id).ep_endpoint = remote_ep;
+	MCAPI_DB_REQUEST(mcapi_db, id).handle= local_ep;
+	MCAPI_DB_REQUEST(mcapi_db, id).valid = MCAPI_TRUE;
+	MCAPI_DB_REQUEST(mcapi_db, id).size = size;
+	MCAPI_DB_REQUEST(mcapi_db, id).cancelled = MCAPI_FALSE;
+	MCAPI_DB_REQUEST(mcapi_db, id).type = type;
+	MCAPI_DB_REQUEST(mcapi_db, id).buffer = buffer;
+	MCAPI_DB_REQUEST(mcapi_db, id).payload = payload;
+	MCAPI_DB_REQUEST(mcapi_db, id).credit = MCAPI_FALSE;
+	MCAPI_DB_REQUEST(mcapi_db, id).backlogged = MCAPI_FALSE;
+	MCAPI_DB_REQUEST(mcapi_db, id).status = MCAPI_SUCCESS;
 }
 
 mcapi_boolean_t mcapi_trans_decode_request_handle(mcapi_request_t* request,uint16_t* r) 
 {
 	*r = *request;
-	if (*r < MCAPI_MAX_REQUESTS && c_db->requests[*r].valid == MCAPI_TRUE) {
+	if (*r < mcapi_limits.requests && MCAPI_DB_REQUEST(c_db, *r).valid == MCAPI_TRUE) {
 		return MCAPI_TRUE;
 	}
 	return MCAPI_FALSE;
@@ -533,7 +1098,10 @@ mcapi_boolean_t mcapi_trans_valid_node(mcapi_uint_t node_num)
 /* checks to see if the port_num is a valid port_num for this system */
 mcapi_boolean_t mcapi_trans_valid_port(mcapi_uint_t port_num)
 {
-  return MCAPI_TRUE;
+  /* channel 0 of a carrier is its session's port */
+  if (MCAPI_VPORT_IS(port_num) && !MCAPI_VPORT_CHANNEL(port_num))
+    return MCAPI_FALSE;
+  return (port_num == MCAPI_PORT_ANY || port_num <= MCAPI_PORT_MASK);
 }
 
 
@@ -541,20 +1109,21 @@ mcapi_boolean_t mcapi_trans_valid_port(mcapi_uint_t port_num)
 /* checks if the endpoint handle refers to a valid endpoint */
 mcapi_boolean_t mcapi_trans_valid_endpoint (mcapi_endpoint_t endpoint)
 {
-	uint32_t domain_index = 0;
 	uint16_t d,n,e;
 	int index;
 	int rc = MCAPI_FALSE;
 
 	if (mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e)) {
-		if (n != MASTER_NODE_NUM)
-			return MCAPI_FALSE;
-		index = mcapi_trans_get_port_index(n, e);
-		if (index >= MCAPI_MAX_ENDPOINTS) {
+		if (MCAPI_VPORT_IS(e))
+			return mcapi_trans_mux_carrier_internal(d, n, e) != NULL;
+		/* an endpoint of a node of this processor, in any domain */
+		index = mcapi_trans_get_port_index(d, n, e);
+		if (index >= mcapi_limits.endpoints) {
 			return MCAPI_FALSE;
 		}
 
-		rc = c_db->domains[domain_index].nodes[0].node_d.endpoints[index].valid;
+		rc = MCAPI_DB_ENDPOINT(c_db, MCAPI_DB_DOMAIN_ROUTE(c_db, d) - 1,
+			mcapi_trans_route_internal(d, n)->node_index - 1, index).valid;
 		mcapi_dprintf(3,"mcapi_trans_valid_endpoint endpoint=0x%llx (database indices: n=%d,e=%d) rc=%d\n",(unsigned long long)endpoint,n,e,rc);
 	}
 
@@ -575,12 +1144,12 @@ mcapi_boolean_t mcapi_trans_endpoint_channel_isopen (mcapi_endpoint_t endpoint)
 	uint16_t d,n,e;
 	int index;
 	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
-	index = mcapi_trans_get_port_index(n, e);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(d, n, e);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;
 	}
 
-	return c_db->domains[0].nodes[0].node_d.endpoints[index].open;
+	return MCAPI_DB_LOCAL_ENDPOINT(index).open;
 }
 
 
@@ -638,18 +1207,17 @@ mcapi_boolean_t mcapi_trans_channel_connected  (mcapi_endpoint_t endpoint)
 	uint16_t d,n,e;
 	int index;
 	int ret;
-	uint32_t domain_index = 0;
 	struct sm_session_status status;
 
 
 	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
 
-	index = mcapi_trans_get_port_index(n, e);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(d, n, e);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;
 	}
 
-	rc = c_db->domains[domain_index].nodes[0].node_d.endpoints[index].connected;
+	rc = MCAPI_DB_LOCAL_ENDPOINT(index).connected;
 
 	if (rc)
 		return rc;
@@ -661,8 +1229,8 @@ mcapi_boolean_t mcapi_trans_channel_connected  (mcapi_endpoint_t endpoint)
 
 		if (status.flags == MCAPI_TRUE) {
 			/* update ep status */
-			c_db->domains[0].nodes[0].node_d.endpoints[index].connected = MCAPI_TRUE;
-			c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.recv_endpt = status.remote_ep;
+			MCAPI_DB_LOCAL_ENDPOINT(index).connected = MCAPI_TRUE;
+			MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt = status.remote_ep;
 
 			return MCAPI_TRUE;
 		} else
@@ -721,28 +1289,31 @@ mcapi_boolean_t mcapi_trans_valid_sclchan_recv_handle( mcapi_sclchan_recv_hndl_t
 
 mcapi_boolean_t mcapi_trans_initialized (mcapi_domain_t domain_id, mcapi_node_t node_id)
 {
-  int i;
-  uint32_t domain_index = 0;
-  mcapi_boolean_t rc = MCAPI_FALSE;
+  mcapi_route* route;
 
   if (c_db == NULL)
-  	return rc;
-    
-    for (i = 0; i < MCA_MAX_NODES; i++) {
-      if ((c_db->domains[domain_index].nodes[i].valid) && (c_db->domains[domain_index].nodes[i].node_num == node_id)) {
-        rc = MCAPI_TRUE;
-        break;
-     }
-    return rc;
-  }
-
-  printf("%s\n", __func__); 
-  return MCAPI_FALSE;
+  	return MCAPI_FALSE;
+
+  route = mcapi_trans_route_internal(domain_id, node_id);
+  return (route && route->node_index) ? MCAPI_TRUE : MCAPI_FALSE;
 }
 
+/* endpoints of the calling thread's node */
 mcapi_uint32_t mcapi_trans_num_endpoints()
 {
-  return 0;
+  mcapi_local_node* self = mcapi_trans_self_internal();
+
+  return MCAPI_DB_NODE(c_db, self->dindex, self->nindex).node_d.num_endpoints;
+}
+
+mcapi_uint32_t mcapi_trans_max_endpoints()
+{
+  return mcapi_limits.endpoints;
+}
+
+mcapi_uint32_t mcapi_trans_max_queue_elements()
+{
+  return mcapi_limits.queue_elements;
 }
 
 mcapi_boolean_t mcapi_trans_valid_priority(mcapi_priority_t priority)
@@ -756,17 +1327,16 @@ mcapi_boolean_t mcapi_trans_connected(mcapi_endpoint_t endpoint)
 	int index;
 	int rc;
 	int ret;
-	uint32_t domain_index = 0;
 	struct sm_session_status status;
 
 	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
 
-	index = mcapi_trans_get_port_index(n, e);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(d, n, e);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;
 	}
 
-	rc = c_db->domains[domain_index].nodes[0].node_d.endpoints[index].connected;
+	rc = MCAPI_DB_LOCAL_ENDPOINT(index).connected;
 
 	if (rc)
 		return rc;
@@ -821,112 +1391,690 @@ mcapi_boolean_t mcapi_trans_valid_size_param (size_t* size)
 
 
 /****************** initialization *************************/
-mcapi_boolean_t mcapi_trans_initialize_() 
+#define MCAPI_DB_ALIGN(x) (((x) + MCAPI_CACHE_LINE - 1) & ~(size_t)(MCAPI_CACHE_LINE - 1))
+#define MCAPI_DB_PAGE 4096
+
+/* lays out a database for *l, filling in the header of db when given;
+   returns the size of the segment */
+static size_t mcapi_trans_db_layout_internal(const mcapi_db_limits* l, mcapi_database* db)
 {
-	int i;
-	char *p;
-	mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-	int semkey = ftok(SEMKEYPATH,SEMKEYID);
-	int shmkey = 0;
-	mcapi_boolean_t rc = MCAPI_TRUE;
+	size_t per_domain = (size_t)l->nodes * l->domains;
+	size_t domains, nodes, endpoints, buffers, requests, reserves, owners, size;
+	size_t domain_routes, routes, cpu_routes, port_map, pooled;
+
+	domains = MCAPI_DB_ALIGN(sizeof(mcapi_database));
+	nodes = domains + MCAPI_DB_ALIGN(l->domains * sizeof(domain_entry));
+	endpoints = nodes + MCAPI_DB_ALIGN(per_domain * sizeof(node_entry));
+	requests = endpoints + MCAPI_DB_ALIGN(per_domain * l->endpoints * sizeof(endpoint_entry));
+	reserves = requests + MCAPI_DB_ALIGN(l->requests * sizeof(mcapi_request_data));
+	owners = reserves + MCAPI_DB_ALIGN(l->requests * sizeof(indexed_array_node));
+	domain_routes = owners + MCAPI_DB_ALIGN(per_domain * l->endpoints * sizeof(uint16_t));
+	routes = domain_routes + MCAPI_DB_ALIGN((MCAPI_DOMAIN_MASK + 1) * sizeof(uint8_t));
+	cpu_routes = routes + MCAPI_DB_ALIGN((size_t)l->domains * MCAPI_ROUTE_NODES * sizeof(mcapi_route));
+	port_map = cpu_routes + MCAPI_DB_ALIGN(MCAPI_ROUTE_CPUS * sizeof(mcapi_cpu_route));
+	pooled = port_map + MCAPI_DB_ALIGN(sizeof(mcapi_port_map));
+	/* page aligned so that the metadata shares no page with them */
+	buffers = (pooled + MCAPI_DB_PROCESSES * MCAPI_SESSION_POOL_MAX * sizeof(uint16_t) +
+		MCAPI_DB_PAGE - 1) &
+		~(size_t)(MCAPI_DB_PAGE - 1);
+	size = buffers + l->buffers * sizeof(buffer_entry);
+	if (db) {
+		db->magic = MAGIC_NUM;
+		db->version = MCAPI_DB_VERSION;
+		db->limits = *l;
+		db->domains_off = domains;
+		db->nodes_off = nodes;
+		db->endpoints_off = endpoints;
+		db->buffers_off = buffers;
+		db->requests_off = requests;
+		db->reserves_off = reserves;
+		db->endpoint_owners_off = owners;
+		db->domain_routes_off = domain_routes;
+		db->routes_off = routes;
+		db->cpu_routes_off = cpu_routes;
+		db->port_map_off = port_map;
+		db->pooled_off = pooled;
+		db->size = size;
+	}
+	return size;
+}
 
-	if (!sem_id) {
-		/* create the semaphore (it may already exist) */
-		sem_id =  transport_sm_create_semaphore(semkey);
-		if (sem_id == -1) {
-			mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-			return MCAPI_FALSE;
-		}
+/* pages of [off, off + len) of the database that are resident */
+static size_t mcapi_trans_db_resident_internal(size_t off, size_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t start = off & ~(size_t)(page - 1);
+	size_t pages = (off + len - start + page - 1) / page;
+	unsigned char vec[256];
+	size_t i, n, resident = 0;
+
+	while (pages) {
+		n = (pages < sizeof(vec)) ? pages : sizeof(vec);
+		if (mincore((char*)c_db + start, n * page, vec))
+			return 0;
+		for (i = 0; i < n; i++)
+			resident += vec[i] & 1;
+		start += n * page;
+		pages -= n;
 	}
+	return resident;
+}
 
-	/* lock the database */
-	transport_sm_lock_semaphore(sem_id);
+static void mcapi_trans_limit_internal(uint32_t* value, const char* env,
+		const mcapi_node_attributes_t* node_attrs, mcapi_uint_t attribute_num, uint32_t max)
+{
+	const char* e = getenv(env);
+	mcapi_uint_t v = 0;
+
+	if (e)
+		v = strtoul(e, NULL, 0);
+	/* a node attribute wins over the environment */
+	if (node_attrs && node_attrs->entries[attribute_num].valid)
+		memcpy(&v, &node_attrs->entries[attribute_num].attribute_d, sizeof(v));
+	if (v)
+		*value = (v < max) ? v : max;
+}
 
-	if (c_db == NULL) {
-		/* create the shared memory (it may already exist) */
-		shmkey = ftok(SEMKEYPATH,SEMKEYID);
-		transport_sm_create_shared_mem(&shm_addr,shmkey,sizeof(mcapi_database));
+/* the capacities a database created by this process gets */
+static void mcapi_trans_limits_internal(mcapi_db_limits* l, const mcapi_node_attributes_t* node_attrs)
+{
+	l->domains = MCA_MAX_DOMAINS;
+	l->nodes = MCA_MAX_NODES;
+	l->endpoints = MCAPI_MAX_ENDPOINTS;
+	l->buffers = MCAPI_MAX_BUFFERS;
+	l->queue_elements = MCAPI_MAX_QUEUE_ELEMENTS;
+	mcapi_trans_limit_internal(&l->domains, "MCA_MAX_DOMAINS", node_attrs, MCAPI_NODE_ATTR_MAX_DOMAINS, MCAPI_DOMAIN_MASK);
+	mcapi_trans_limit_internal(&l->nodes, "MCA_MAX_NODES", node_attrs, MCAPI_NODE_ATTR_MAX_NODES, MCAPI_ROUTE_NODES);
+	/* port indices are 16 bit and MCAPI_MAX_ENDPOINTS is the "none" of them */
+	mcapi_trans_limit_internal(&l->endpoints, "MCAPI_MAX_ENDPOINTS", node_attrs, MCAPI_NODE_ATTR_MAX_ENDPOINTS, 0xfffe);
+	mcapi_trans_limit_internal(&l->buffers, "MCAPI_MAX_BUFFERS", node_attrs, MCAPI_NODE_ATTR_MAX_BUFFERS, 0x10000);
+	mcapi_trans_limit_internal(&l->queue_elements, "MCAPI_MAX_QUEUE_ELEMENTS", node_attrs,
+		MCAPI_NODE_ATTR_MAX_QUEUE_ELEMENTS, 0xffff);
+	l->requests = l->buffers;
+}
 
-		if (!shm_addr) {
-			mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-			rc = MCAPI_FALSE;
-		}
+/* locks (type F_WRLCK/F_RDLCK) or unlocks (F_UNLCK) one of the lock bytes
+   of the database file; returns 0 on success */
+static int mcapi_trans_db_lock_internal(int fd, off_t byte, short type, mcapi_boolean_t wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = byte;
+	fl.l_len = 1;
+	return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
 
-		c_db = shm_addr; 
-		mcapi_dprintf(1, "%s %d db addr %08x size %x\n", __func__, __LINE__, c_db, sizeof(mcapi_database));
+/* Opens the file backing the database, on the hugetlbfs mount named by
+   MCAPI_HUGETLB_DIR if there is one (fewer TLB misses on the database),
+   as POSIX shared memory otherwise. *page is the page size it is
+   mapped with. */
+static int mcapi_trans_db_open_internal(size_t* page)
+{
+	const char* name = getenv("MCAPI_SHM_NAME");
+	const char* dir = getenv("MCAPI_HUGETLB_DIR");
+	struct statfs fs;
+
+	if (!name || name[0] != '/')
+		name = MCAPI_SHM_NAME;
+	*page = sysconf(_SC_PAGESIZE);
+	mcapi_db_hugetlb = MCAPI_FALSE;
+	if (dir) {
+		if (!statfs(dir, &fs) && fs.f_type == HUGETLBFS_MAGIC) {
+			snprintf(mcapi_db_path, sizeof(mcapi_db_path), "%s%s", dir, name);
+			*page = fs.f_bsize;
+			mcapi_db_hugetlb = MCAPI_TRUE;
+			return open(mcapi_db_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+		}
+		mcapi_dprintf(1, "%s: %s is no hugetlbfs mount, using small pages\n", __func__, dir);
+	}
+	snprintf(mcapi_db_path, sizeof(mcapi_db_path), "%s", name);
+	return shm_open(mcapi_db_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+}
+
+static void mcapi_trans_db_unlink_internal(void)
+{
+	if (mcapi_db_hugetlb)
+		unlink(mcapi_db_path);
+	else
+		shm_unlink(mcapi_db_path);
+}
+
+/* takes a free process slot; returns it, or -1 if all are taken */
+static int mcapi_trans_slot_take_internal(int fd)
+{
+	int slot;
+
+	for (slot = 0; slot < MCAPI_DB_PROCESSES; slot++)
+		if (!mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_PROCESS + slot, F_WRLCK, MCAPI_FALSE))
+			return slot;
+	return -1;
+}
+
+/* Whether owner (a process slot + 1) belongs to a process that is gone:
+   nobody holds the lock of its slot. known caches the answers of one pass,
+   MCAPI_DB_PROCESSES entries, 0 when not asked yet. */
+static mcapi_boolean_t mcapi_trans_owner_dead_internal(int fd, uint16_t owner, uint8_t* known)
+{
+	struct flock fl;
+
+	/* our own lock does not show, the kernel only reports conflicts */
+	if (!owner || owner > MCAPI_DB_PROCESSES || owner == mcapi_db_slot + 1)
+		return MCAPI_FALSE;
+	if (!known[owner - 1]) {
+		memset(&fl, 0, sizeof(fl));
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = MCAPI_DB_LOCK_PROCESS + owner - 1;
+		fl.l_len = 1;
+		if (fcntl(fd, F_OFD_GETLK, &fl))
+			return MCAPI_FALSE;
+		known[owner - 1] = (fl.l_type == F_UNLCK) ? 2 : 1;
+	}
+	return known[owner - 1] == 2;
+}
+
+/* Returns the requests and endpoints processes that died held, one check
+   per slot. In warm restart mode the endpoints are only disowned (owner 0)
+   for the restarted process to take over, as it may get the same slot.
+   Holds the attach lock so that no slot of a dead
+   process is taken again meanwhile; attach_locked when the caller has it
+   already. Returns how much was reclaimed. */
+static int mcapi_trans_reclaim_internal(int fd, mcapi_database* db, mcapi_boolean_t attach_locked)
+{
+	indexed_array_header *header = &db->request_reserves_header;
+	uint8_t known[MCAPI_DB_PROCESSES];
+	uint16_t* pooled;
+	int r, d, n, e, i, requests = 0, endpoints = 0, ports = 0;
+
+	if (!attach_locked && mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_ATTACH, F_WRLCK, MCAPI_TRUE))
+		return 0;
+	memset(known, 0, sizeof(known));
+	transport_sm_lock_db(db);
+	for (r = 0; r < db->limits.requests; r++) {
+		if (!mcapi_trans_owner_dead_internal(fd, MCAPI_DB_REQUEST(db, r).owner, known))
+			continue;
+		MCAPI_DB_REQUEST(db, r).owner = 0;
+		MCAPI_DB_REQUEST(db, r).valid = MCAPI_FALSE;
+		MCAPI_DB_RESERVE(db, r).next_index = header->empty_head_index;
+		header->empty_head_index = r;
+		header->curr_count--;
+		requests++;
+	}
+	for (d = 0; d < db->limits.domains; d++) {
+		for (n = 0; n < db->limits.nodes; n++) {
+			for (e = 0; e < db->limits.endpoints; e++) {
+				if (!MCAPI_DB_ENDPOINT(db, d, n, e).valid ||
+						!mcapi_trans_owner_dead_internal(fd, MCAPI_DB_ENDPOINT_OWNER(db, d, n, e), known))
+					continue;
+				MCAPI_DB_ENDPOINT_OWNER(db, d, n, e) = 0;
+				if (mcapi_db_warm)
+					continue;
+				mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(db),
+					MCAPI_DB_ENDPOINT(db, d, n, e).port_num);
+				mcapi_trans_port_unindex_internal(&MCAPI_DB_PORT_MAP(db),
+					MCAPI_DB_ENDPOINT(db, d, n, e).port_num, e);
+				memset(&MCAPI_DB_ENDPOINT(db, d, n, e), 0, sizeof(endpoint_entry));
+				MCAPI_DB_NODE(db, d, n).node_d.num_endpoints--;
+				endpoints++;
+			}
+		}
+	}
+	/* the sessions a dead process pooled are gone with its descriptor,
+	   the request quota of its threads with them */
+	for (r = 0; r < MCAPI_DB_PROCESSES; r++) {
+		if (db->request_quotas[r] && mcapi_trans_owner_dead_internal(fd, r + 1, known))
+			db->request_quotas[r] = 0;
+		for (i = 0; i < MCAPI_SESSION_POOL_MAX; i++) {
+			pooled = &MCAPI_DB_POOLED(db, r, i);
+			if (!*pooled || !mcapi_trans_owner_dead_internal(fd, r + 1, known))
+				continue;
+			mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(db), *pooled - 1);
+			*pooled = 0;
+			ports++;
+		}
+	}
+	transport_sm_unlock_db(db);
+	if (!attach_locked)
+		mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_ATTACH, F_UNLCK, MCAPI_FALSE);
+	if (requests || endpoints || ports)
+		mcapi_dprintf(1, "%s: %d requests, %d endpoints, %d pooled ports of dead processes reclaimed\n",
+			__func__, requests, endpoints, ports);
+	return requests + endpoints + ports;
+}
+
+/* Attach the database, creating it for *limits if there is none. An
+   existing database keeps the capacities it was created with, *limits is
+   updated to them.
+
+   The first process to attach (re)sizes the file from scratch, so the
+   kernel hands out zeroed pages as they are first touched instead of the
+   segment being cleared up front; that also discards whatever a run that
+   did not finalize left behind. In warm restart mode it keeps a database
+   of the current version instead, see mcapi_trans_reattach_internal(). */
+static mcapi_database* mcapi_trans_db_attach_internal(mcapi_db_limits* limits)
+{
+	size_t size = mcapi_trans_db_layout_internal(limits, NULL);
+	size_t page, map;
+	mcapi_boolean_t first, reuse = MCAPI_FALSE;
+	mcapi_database* db;
+	mcapi_database header;
+	struct stat st;
+	int fd;
+
+	for (;;) {
+		fd = mcapi_trans_db_open_internal(&page);
+		if (fd < 0)
+			return NULL;
+		if (mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_ATTACH, F_WRLCK, MCAPI_TRUE) ||
+				fstat(fd, &st)) {
+			close(fd);
+			return NULL;
+		}
+		/* the last user removed it while we were waiting for the lock */
+		if (st.st_nlink)
+			break;
+		close(fd);
+	}
+	/* nobody else has it mapped when the user byte can be write locked */
+	first = !mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_USER, F_WRLCK, MCAPI_FALSE);
+	if (first && mcapi_db_warm && st.st_size >= sizeof(header) &&
+			pread(fd, &header, sizeof(header), 0) == sizeof(header)) {
+		reuse = header.magic == MAGIC_NUM && header.version == MCAPI_DB_VERSION &&
+			header.size && header.size <= st.st_size;
+		if (!reuse)
+			mcapi_dprintf(1, "%s: database version %x, not %x, starting cold\n", __func__,
+				header.version, MCAPI_DB_VERSION);
+	}
+	if (first && !reuse) {
+		map = (size + page - 1) & ~(page - 1);
+		if (ftruncate(fd, 0) || ftruncate(fd, map))
+			goto fail;
+	} else {
+		map = st.st_size;
+		if (map < sizeof(mcapi_database))
+			goto fail;
+	}
+	db = mmap(NULL, map, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (db == MAP_FAILED)
+		goto fail;
+	/* transparent huge pages for the shared memory, where they are enabled */
+	if (!mcapi_db_hugetlb)
+		madvise(db, map, MADV_HUGEPAGE);
+	if (first && !reuse) {
+		if (!transport_sm_init_db_lock(db)) {
+			munmap(db, map);
+			goto fail;
+		}
+		mcapi_trans_db_layout_internal(limits, db);
+	} else if (db->magic != MAGIC_NUM || db->version != MCAPI_DB_VERSION ||
+			!db->size || db->size > map) {
+		/* laid out by an incompatible version of the library */
+		munmap(db, map);
+		errno = EPROTO;
+		goto fail;
+	}
+	if (first && !reuse) {
+		mcapi_trans_init_request_indexed_array(db);
+		mcapi_trans_routes_config_internal(db);
+	} else
+		mcapi_trans_reclaim_internal(fd, db, MCAPI_TRUE);
+	mcapi_db_slot = mcapi_trans_slot_take_internal(fd);
+	if (mcapi_db_slot < 0) {
+		munmap(db, map);
+		errno = EUSERS;
+		goto fail;
+	}
+	/* whatever an earlier user of the slot left is no thread's quota */
+	transport_sm_lock_db(db);
+	db->request_quotas[mcapi_db_slot] = 0;
+	transport_sm_unlock_db(db);
+	/* held until mcapi_trans_finalize(), or until the process dies */
+	if (mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_USER, F_RDLCK, MCAPI_TRUE)) {
+		munmap(db, map);
+		goto fail;
+	}
+	mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_ATTACH, F_UNLCK, MCAPI_FALSE);
+	*limits = db->limits;
+	mcapi_db_fd = fd;
+	mcapi_db_map_size = map;
+	mcapi_db_reused = reuse;
+	return db;
+
+fail:
+	mcapi_dprintf(1, "%s: %s: %s\n", __func__, mcapi_db_path, strerror(errno));
+	close(fd);
+	return NULL;
+}
+
+mcapi_boolean_t mcapi_trans_initialize_(const mcapi_node_attributes_t* node_attrs) 
+{
+	mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
+	mcapi_db_limits limits;
+	mcapi_database* db;
+	uint32_t warm = 0;
+
+	pthread_mutex_lock(&mcapi_db_attach_lock);
+	if (c_db == NULL) {
+		/* create the shared memory (it may already exist) */
+		mcapi_trans_limits_internal(&limits, node_attrs);
+		mcapi_trans_limit_internal(&warm, "MCAPI_WARM_RESTART", node_attrs,
+			MCAPI_NODE_ATTR_WARM_RESTART, 1);
+		mcapi_db_warm = warm ? MCAPI_TRUE : MCAPI_FALSE;
+		db = mcapi_trans_db_attach_internal(&limits);
+
+		if (!db) {
+			mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
+			pthread_mutex_unlock(&mcapi_db_attach_lock);
+			return MCAPI_FALSE;
+		}
+
+		c_db = db; 
+		mcapi_limits = limits;
+		mcapi_dprintf(1, "%s %d db %s%s addr %08x size %x endpoints %u buffers %u\n", __func__, __LINE__,
+			mcapi_db_path, mcapi_db_hugetlb ? " (huge pages)" : "",
+			c_db, c_db->size, mcapi_limits.endpoints, mcapi_limits.buffers);
+		mcapi_dprintf(1, "%s %d db resident pages %u\n", __func__, __LINE__,
+			(unsigned)mcapi_trans_db_resident_internal(0, c_db->size));
 
 	}
-	transport_sm_unlock_semaphore(sem_id);
-	mcapi_trans_init_request_indexed_array();
+	pthread_mutex_unlock(&mcapi_db_attach_lock);
+	/* drop what the threads have cached from an earlier attach */
+	mcapi_req_generation++;
 	mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-	return rc;
+	return MCAPI_TRUE;
+}
+
+/* calloc() for the cache line aligned per endpoint arrays */
+static void* mcapi_trans_calloc_aligned_internal(size_t n, size_t size)
+{
+	void* p;
+
+	if (posix_memalign(&p, MCAPI_CACHE_LINE, n * size))
+		return NULL;
+	memset(p, 0, n * size);
+	return p;
+}
+
+/* size the per process endpoint state for the database just attached */
+static mcapi_boolean_t mcapi_trans_local_init_internal(void)
+{
+	pthread_mutexattr_t attr;
+	int i;
+
+	if (mcapi_ep_local_count == mcapi_limits.endpoints)
+		return MCAPI_TRUE;
+	free(mcapi_ep_local);
+	free(mcapi_ep_lock);
+	mcapi_ep_local = mcapi_trans_calloc_aligned_internal(mcapi_limits.endpoints, sizeof(endpoint_local));
+	mcapi_ep_lock = mcapi_trans_calloc_aligned_internal(mcapi_limits.endpoints, sizeof(endpoint_lock));
+	if (!mcapi_ep_local || !mcapi_ep_lock) {
+		mcapi_ep_local_count = 0;
+		return MCAPI_FALSE;
+	}
+	/* recursive, a credit callback may send on its endpoint */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	for (i = 0; i < mcapi_limits.endpoints; i++) {
+		pthread_mutex_init(&mcapi_ep_lock[i].lock, &attr);
+		pthread_cond_init(&mcapi_ep_lock[i].rx_cond, NULL);
+	}
+	pthread_mutexattr_destroy(&attr);
+	mcapi_ep_local_count = mcapi_limits.endpoints;
+	return MCAPI_TRUE;
+}
+
+/* Warm restart: the endpoints of this node survived in the reused
+   database. Sessions the driver still has are kept as they are; the others
+   are created again for the same port, so peers addressing the port reach
+   it again, and connected channels are reconnected. Only the endpoint
+   indices may change, the handles are made of the port numbers. */
+static void mcapi_trans_reattach_internal(void)
+{
+	mcapi_local_node* self = mcapi_trans_self_internal();
+	uint16_t d = self->dindex, n = self->nindex;
+	uint64_t start = mcapi_trans_now_us();
+	struct sm_session_status status;
+	uint8_t known[MCAPI_DB_PROCESSES];
+	endpoint_entry* lost;
+	endpoint_entry e;
+	uint16_t rd, rn, re;
+	uint32_t type;
+	int i, index, nlost = 0, kept = 0;
+
+	lost = calloc(mcapi_limits.endpoints, sizeof(*lost));
+	if (!lost)
+		return;
+	memset(known, 0, sizeof(known));
+	/* another restarted process must not take the same endpoints */
+	mcapi_trans_db_lock_internal(mcapi_db_fd, MCAPI_DB_LOCK_ATTACH, F_WRLCK, MCAPI_TRUE);
+	for (i = 0; i < mcapi_limits.endpoints; i++) {
+		/* only those a dead process left behind, disowned when we attached */
+		if (!MCAPI_DB_ENDPOINT(c_db, d, n, i).valid || (MCAPI_DB_ENDPOINT_OWNER(c_db, d, n, i) &&
+				!mcapi_trans_owner_dead_internal(mcapi_db_fd, MCAPI_DB_ENDPOINT_OWNER(c_db, d, n, i), known)))
+			continue;
+		MCAPI_DB_ENDPOINT_OWNER(c_db, d, n, i) = mcapi_db_slot + 1;
+		mcapi_ep_local[i].dindex = d;
+		mcapi_ep_local[i].nindex = n;
+		if (MCAPI_VPORT_IS(MCAPI_DB_ENDPOINT(c_db, d, n, i).port_num)) {
+			/* a carrier, its virtual endpoints died with the process */
+			mcapi_trans_endpoint_delete_internal(d, n, i);
+			continue;
+		}
+		if (!sm_get_session_status(i, &status)) {
+			kept++;
+			continue;
+		}
+		/* cleared first, the driver may hand out its index to another one */
+		lost[nlost++] = MCAPI_DB_ENDPOINT(c_db, d, n, i);
+		mcapi_trans_port_unindex_internal(&MCAPI_DB_PORT_MAP(c_db), MCAPI_DB_ENDPOINT(c_db, d, n, i).port_num, i);
+		memset(&MCAPI_DB_ENDPOINT(c_db, d, n, i), 0, sizeof(endpoint_entry));
+		MCAPI_DB_ENDPOINT_OWNER(c_db, d, n, i) = 0;
+	}
+	for (i = 0; i < nlost; i++) {
+		e = lost[i];
+		index = sm_create_session(e.port_num, SP_PACKET);
+		if (index < 0 || index >= mcapi_limits.endpoints ||
+				MCAPI_DB_ENDPOINT(c_db, d, n, index).valid) {
+			mcapi_dprintf(1, "%s: port %u lost\n", __func__, e.port_num);
+			if (index >= 0)
+				sm_destroy_session(index);
+			transport_sm_lock_db(c_db);
+			mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(c_db), e.port_num);
+			transport_sm_unlock_db(c_db);
+			__sync_fetch_and_sub(&MCAPI_DB_NODE(c_db, d, n).node_d.num_endpoints, 1);
+			continue;
+		}
+		type = (e.recv_queue.channel_type == MCAPI_PKT_CHAN) ? SP_SESSION_PACKET : SP_SESSION_SCALAR;
+		if (e.connected && (!mcapi_trans_decode_handle_internal(e.recv_queue.recv_endpt, &rd, &rn, &re) ||
+				sm_connect_session(index, re, mcapi_trans_route_cpu_internal(rd, rn), type))) {
+			mcapi_dprintf(1, "%s: port %u not reconnected\n", __func__, e.port_num);
+			e.connected = MCAPI_FALSE;
+		}
+		MCAPI_DB_ENDPOINT(c_db, d, n, index) = e;
+		MCAPI_DB_ENDPOINT_OWNER(c_db, d, n, index) = mcapi_db_slot + 1;
+		MCAPI_DB_PORT_MAP(c_db).index[e.port_num] = index + 1;
+		mcapi_ep_local[index].dindex = d;
+		mcapi_ep_local[index].nindex = n;
+	}
+	mcapi_trans_db_lock_internal(mcapi_db_fd, MCAPI_DB_LOCK_ATTACH, F_UNLCK, MCAPI_FALSE);
+	free(lost);
+	mcapi_dprintf(1, "%s: %d endpoints kept, %d created again in %llu us\n", __func__,
+		kept, nlost, (unsigned long long)(mcapi_trans_now_us() - start));
 }
 
 /* initialize the transport layer */
 mcapi_boolean_t mcapi_trans_initialize(mca_domain_t domain_id,mcapi_node_t node_num,const mcapi_node_attributes_t* node_attrs)
 {
-	sm_dev_initialize();
+	mcapi_boolean_t rc = MCAPI_FALSE;
+	int first;
+
+	pthread_mutex_lock(&mcapi_local_node_lock);
+	first = !mcapi_local_node_count;
+	if (mcapi_local_node_count == MCAPI_LOCAL_NODES) {
+		pthread_mutex_unlock(&mcapi_local_node_lock);
+		return MCAPI_FALSE;
+	}
+	/* the nodes of a process share its device descriptor */
+	if (first)
+		sm_dev_initialize();
 	mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-	if (mcapi_trans_initialize_()) {
-		mcapi_trans_add_node(domain_id, node_num, node_attrs);
-		return MCAPI_TRUE;
+	if (mcapi_trans_initialize_(node_attrs) && mcapi_trans_local_init_internal()) {
+		/* the first node of a process may work as the default one when its
+		   id is taken already, further ones are nodes of their own */
+		if (mcapi_trans_add_node(domain_id, node_num, node_attrs) || first) {
+			if (mcapi_db_warm)
+				mcapi_trans_reattach_internal();
+			if (first)
+				mcapi_trans_session_pool_fill_internal();
+			rc = MCAPI_TRUE;
+		}
 	}
-	return MCAPI_FALSE;
+	pthread_mutex_unlock(&mcapi_local_node_lock);
+	return rc;
 }
 
 
 
 /****************** tear down ******************************/
-void mcapi_trans_finalize()
+mcapi_boolean_t mcapi_trans_finalize()
 {
+	mcapi_local_node* self;
+	int fd, i;
+
+	pthread_mutex_lock(&mcapi_local_node_lock);
+	self = mcapi_trans_self_internal();
+	if (c_db && self != &mcapi_node_none) {
+		/* finalizes the node of the calling thread, the process stays
+		   attached while it hosts others */
+		mcapi_trans_local_node_remove_internal(self);
+		if (mcapi_local_node_count) {
+			pthread_mutex_unlock(&mcapi_local_node_lock);
+			return MCAPI_TRUE;
+		}
+	}
+	/* the next device may know other endpoints */
+	for (i = 0; i < MCAPI_ROUTE_CPUS; i++)
+		mcapi_trans_remote_invalidate_internal(i);
+	mcapi_trans_coalesce_stop_internal();
+	mcapi_trans_session_pool_drain_internal();
+	mcapi_trans_shared_free_internal();
 	sm_dev_finalize();
-	void *shm_addr = c_db;
-	uint32_t shmkey = ftok(SEMKEYPATH,SEMKEYID);
-	uint32_t shmid = shmget(shmkey, sizeof(mcapi_database), 0666); 
-	if (shmid == -1) {
-		mcapi_dprintf(1, "%s %d\n", __func__, __LINE__);
-		return;
+	pthread_mutex_lock(&mcapi_db_attach_lock);
+	if (!c_db) {
+		pthread_mutex_unlock(&mcapi_db_attach_lock);
+		pthread_mutex_unlock(&mcapi_local_node_lock);
+		return MCAPI_TRUE;
 	}
-	transport_sm_free_shared_mem(shmid,shm_addr);
+	fd = mcapi_db_fd;
+	mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_ATTACH, F_WRLCK, MCAPI_TRUE);
+	munmap(c_db, mcapi_db_map_size);
+	c_db = NULL;
+	mcapi_db_fd = -1;
+	mcapi_db_slot = -1;
+	/* the last one out removes the segment, unless it is kept for a warm restart */
+	if (!mcapi_db_warm && !mcapi_trans_db_lock_internal(fd, MCAPI_DB_LOCK_USER, F_WRLCK, MCAPI_FALSE))
+		mcapi_trans_db_unlink_internal();
+	/* drops the locks too */
+	close(fd);
+	pthread_mutex_unlock(&mcapi_db_attach_lock);
+	pthread_mutex_unlock(&mcapi_local_node_lock);
+	return MCAPI_TRUE;
 }
 
 
 /****************** endpoints ******************************/
-/* create endpoint <node_num,port_num> and return it's handle */
-mcapi_boolean_t mcapi_trans_endpoint_create(mcapi_endpoint_t *endpoint,  mcapi_uint_t port_num,mcapi_boolean_t anonymous)
+/* Opens a session on port_num, taken already, and publishes it as an
+   endpoint of the node self; returns the session index, -1 on failure. */
+/* the endpoint on port_num for self, on the pooled session index or a new
+   one when it is -1 */
+static int mcapi_trans_endpoint_open_internal(mcapi_local_node* self, mcapi_uint_t port_num,
+		mcapi_boolean_t anonymous, int index)
 {
-	mcapi_uint_t node_num;
-	uint32_t node_index;
-	uint32_t domain_index = 0;
+	uint32_t node_index = self->nindex;
+	uint32_t domain_index = self->dindex;
 	mcapi_database *mcapi_db = c_db;
-	int endpoint_index = sm_create_session(port_num, SP_PACKET);
-	assert(endpoint_index >= 0);
-	if (endpoint_index < 0) {
-		return MCAPI_FALSE;
-	}
-	assert (mcapi_trans_get_node_num(&node_num));
-	node_index = mcapi_trans_get_node_index(node_num);
+	int endpoint_index;
 
+	endpoint_index = (index >= 0) ? index : mcapi_trans_session_create_internal(port_num);
+	if (endpoint_index < 0 || endpoint_index >= mcapi_limits.endpoints) {
+		/* the driver has more sessions than the database has room for */
+		if (endpoint_index >= 0)
+			sm_destroy_session(endpoint_index);
+		return -1;
+	}
 	mcapi_dprintf(1," node index %d ep index %d\n", node_index, endpoint_index);
 
-	assert(mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].valid == MCAPI_FALSE);
-
-	/* initialize the endpoint entry*/  
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].valid = MCAPI_TRUE;
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].port_num = port_num;
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].open = MCAPI_FALSE;
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].anonymous = anonymous;
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.endpoints[endpoint_index].num_attributes = 0;
-
-	mcapi_db->domains[domain_index].nodes[node_index].node_d.num_endpoints++; 
+	if (MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).valid) {
+		/* the driver handed out the session again, so the process that had
+		   it is gone: take its entry back before using it */
+		mcapi_trans_reclaim_internal(mcapi_db_fd, mcapi_db, MCAPI_FALSE);
+		if (MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).valid) {
+			sm_destroy_session(endpoint_index);
+			return -1;
+		}
+	}
 
+	pthread_mutex_lock(&mcapi_ep_lock[endpoint_index].lock);
+	memset(&mcapi_ep_local[endpoint_index], 0, sizeof(endpoint_local));
+	mcapi_ep_local[endpoint_index].dindex = domain_index;
+	mcapi_ep_local[endpoint_index].nindex = node_index;
+	pthread_mutex_unlock(&mcapi_ep_lock[endpoint_index].lock);
+
+	/* initialize the endpoint entry*/
+	MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).port_num = port_num;
+	MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).open = MCAPI_FALSE;
+	MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).anonymous = anonymous;
+	/* the entry is looked up without locks, publish it once it is complete;
+	   each endpoint has its own entry (the session index), only the
+	   count is shared */
+	MCAPI_DB_ENDPOINT_OWNER(mcapi_db, domain_index, node_index, endpoint_index) = mcapi_db_slot + 1;
+	MCAPI_DB_PORT_MAP(mcapi_db).index[port_num] = endpoint_index + 1;
+	__sync_synchronize();
+	MCAPI_DB_ENDPOINT(mcapi_db, domain_index, node_index, endpoint_index).valid = MCAPI_TRUE;
+
+	__sync_fetch_and_add(&MCAPI_DB_NODE(mcapi_db, domain_index, node_index).node_d.num_endpoints, 1);
+	return endpoint_index;
+}
 
-	*endpoint = mcapi_trans_encode_handle_internal(0, node_num, port_num);
+/* create endpoint <node_num,port_num> and return it's handle */
+mcapi_boolean_t mcapi_trans_endpoint_create(mcapi_endpoint_t *endpoint,  mcapi_uint_t port_num,mcapi_boolean_t anonymous)
+{
+	mcapi_local_node* self = mcapi_trans_self_internal();
+	mcapi_database *mcapi_db = c_db;
+	mcapi_port_map* map = &MCAPI_DB_PORT_MAP(mcapi_db);
+	int port, index;
+
+	/* the port is the node's from here on, a second endpoint on it, of
+	   any node of the processor, fails; a pooled one is taken already */
+	index = mcapi_trans_session_claim_internal(&port_num);
+	if (index < 0) {
+		if (!transport_sm_lock_db(mcapi_db))
+			return MCAPI_FALSE;
+		port = mcapi_trans_port_take_internal(map, port_num);
+		transport_sm_unlock_db(mcapi_db);
+		if (port < 0)
+			return MCAPI_FALSE;
+		port_num = port;
+	}
+	/* what the last endpoint on the port sent says nothing of this one */
+	__sync_fetch_and_and(&map->framed[port_num / 64], ~(1ULL << (port_num % 64)));
+
+	if (MCAPI_VPORT_IS(port_num) ? !mcapi_trans_mux_create_internal(self, port_num) :
+			mcapi_trans_endpoint_open_internal(self, port_num, anonymous, index) < 0) {
+		transport_sm_lock_db(mcapi_db);
+		mcapi_trans_port_put_internal(map, port_num);
+		transport_sm_unlock_db(mcapi_db);
+		return MCAPI_FALSE;
+	}
+	*endpoint = mcapi_trans_encode_handle_internal(self->domain_id, self->node_num, port_num);
 	return MCAPI_TRUE;
 }
 
-mcapi_boolean_t mcapi_trans_get_endpoint_internal (mcapi_endpoint_t *e, mcapi_uint_t node_num, 
-		mcapi_uint_t port_num)
+mcapi_boolean_t mcapi_trans_get_endpoint_internal (mcapi_endpoint_t *e, mcapi_domain_t domain_num,
+		mcapi_uint_t node_num, mcapi_uint_t port_num)
 {
 	int rc = MCAPI_FALSE;
 
@@ -935,7 +2083,7 @@ mcapi_boolean_t mcapi_trans_get_endpoint_internal (mcapi_endpoint_t *e, mcapi_ui
 	mcapi_dprintf(2," mcapi_trans_get_endpoint_internal node_num=%d, port_num=%d\n",
 			node_num,port_num);
 
-	*e = mcapi_trans_encode_handle_internal (0, node_num, port_num);
+	*e = mcapi_trans_encode_handle_internal (domain_num, node_num, port_num);
 
 	rc = MCAPI_TRUE;
 	return rc;
@@ -948,11 +2096,12 @@ void mcapi_trans_endpoint_get_i(mcapi_endpoint_t* endpoint, mcapi_domain_t domai
 	int ret;
 	int id;
 	int index;
+	uint16_t cpu;
 	mcapi_database* mcapi_db = c_db;
-	index = mcapi_trans_get_port_index(node_num, port_num);
+	index = mcapi_trans_get_port_index(domain_num, node_num, port_num);
 	/* local endpoint */
-	if (index != MCAPI_MAX_ENDPOINTS) {
-		if (mcapi_trans_get_endpoint_internal(endpoint, node_num, port_num))
+	if (index != mcapi_limits.endpoints || mcapi_trans_mux_exists_internal(domain_num, node_num, port_num)) {
+		if (mcapi_trans_get_endpoint_internal(endpoint, domain_num, node_num, port_num))
 			*mcapi_status = MCAPI_SUCCESS;
 		else
 			*mcapi_status = MCAPI_ERR_PARAMETER;
@@ -965,180 +2114,2353 @@ void mcapi_trans_endpoint_get_i(mcapi_endpoint_t* endpoint, mcapi_domain_t domai
 	*request = id;
 	mcapi_dprintf(1,"node_num:%d, port_num:%d, id:%d\n", node_num, port_num, id);
 
-	ret = sm_get_remote_ep(port_num, node_num, 0, 0);
+	cpu = mcapi_trans_route_cpu_internal(domain_num, node_num);
+	if (mcapi_trans_remote_cached_internal(domain_num, node_num, port_num, cpu, endpoint)) {
+		MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_TRUE;
+		*mcapi_status = MCAPI_SUCCESS;
+		setup_request_internal(0, 0, request, (char *)endpoint, 0, 0, GET_ENDPT);
+		return;
+	}
+	/* a virtual endpoint is known once its carrier is */
+	ret = sm_get_remote_ep(MCAPI_VPORT_SESSION(port_num), cpu, 0, 0);
 	if (ret) {
 		if (errno == EAGAIN) {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_PENDING;
 		} else {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_ERR_TRANSMISSION;
 		}
 	} else {
-		mcapi_db->requests[*request].completed = MCAPI_TRUE;
-		if (mcapi_trans_get_endpoint_internal(endpoint, node_num, port_num))
+		MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_TRUE;
+		if (mcapi_trans_get_endpoint_internal(endpoint, domain_num, node_num, port_num)) {
+			mcapi_trans_remote_confirm_internal(*endpoint, cpu);
 			*mcapi_status = MCAPI_SUCCESS;
-		else
+		} else
 			*mcapi_status = MCAPI_ERR_PARAMETER;
 	}
-	mcapi_db->requests[*request].ep_node_num = node_num;
-	mcapi_db->requests[*request].ep_port_num = port_num;
-	mcapi_db->requests[*request].ep_domain_num = domain_num;
+	MCAPI_DB_REQUEST(mcapi_db, *request).ep_node_num = node_num;
+	MCAPI_DB_REQUEST(mcapi_db, *request).ep_port_num = port_num;
+	MCAPI_DB_REQUEST(mcapi_db, *request).ep_domain_num = domain_num;
 	setup_request_internal(0, 0, request, (char *)endpoint, 0, 0, GET_ENDPT);
 }
 
-/* blocking get endpoint for the given <node_num,port_num> and return it's handle */
-mcapi_boolean_t mcapi_trans_endpoint_get(mcapi_endpoint_t *endpoint,mcapi_domain_t domain_num, mcapi_node_t node_num, mcapi_port_t port_num, mcapi_status_t* mcapi_status, int timeout)
+/* blocking get endpoint for the given <node_num,port_num> and return it's handle */
+mcapi_boolean_t mcapi_trans_endpoint_get(mcapi_endpoint_t *endpoint,mcapi_domain_t domain_num, mcapi_node_t node_num, mcapi_port_t port_num, mcapi_status_t* mcapi_status, int timeout)
+{
+	int ret;
+	int index;
+	uint16_t cpu;
+
+	index = mcapi_trans_get_port_index(domain_num, node_num, port_num);
+	/* local endpoint */
+	if (index != mcapi_limits.endpoints || mcapi_trans_mux_exists_internal(domain_num, node_num, port_num)) {
+		if (mcapi_trans_get_endpoint_internal(endpoint, domain_num, node_num, port_num))
+			*mcapi_status = MCAPI_SUCCESS;
+		else
+			*mcapi_status = MCAPI_ERR_PARAMETER;
+		return MCAPI_TRUE;
+	}
+	cpu = mcapi_trans_route_cpu_internal(domain_num, node_num);
+	if (mcapi_trans_remote_cached_internal(domain_num, node_num, port_num, cpu, endpoint)) {
+		*mcapi_status = MCAPI_SUCCESS;
+		return MCAPI_TRUE;
+	}
+	ret = sm_get_remote_ep(MCAPI_VPORT_SESSION(port_num), cpu, timeout, 1);
+	if (ret) {
+		if (errno == ETIMEDOUT)
+			*mcapi_status = MCAPI_TIMEOUT;
+		else
+			*mcapi_status = MCAPI_ERR_GENERAL;
+		return MCAPI_FALSE;
+	} else {
+		if (mcapi_trans_get_endpoint_internal(endpoint, domain_num, node_num, port_num)) {
+			mcapi_trans_remote_confirm_internal(*endpoint, cpu);
+			*mcapi_status = MCAPI_SUCCESS;
+		} else
+			*mcapi_status = MCAPI_ERR_PARAMETER;
+	    return MCAPI_TRUE;
+	}
+}
+
+/* Gets number endpoints at once. All the remote ones are asked for
+   before any is waited for, then the pending requests are tested in
+   turns until each has completed or timeout has passed: the slowest
+   peer bounds the time taken, not the sum of them. statuses[i] is the
+   outcome of entry i; returns the number of endpoints got. */
+mcapi_uint_t mcapi_trans_endpoint_get_many(mcapi_uint_t number, const mcapi_domain_t* domain_ids,
+		const mcapi_node_t* node_ids, const mcapi_port_t* port_ids, mcapi_endpoint_t* endpoints,
+		mcapi_status_t* statuses, mcapi_timeout_t timeout)
+{
+	mcapi_request_t* requests = malloc(number * sizeof(mcapi_request_t));
+	useconds_t backoff = MCAPI_GET_POLL_US;
+	uint64_t start = mcapi_trans_now_us();
+	mcapi_uint_t i, pending = 0, got = 0;
+
+	if (!requests) {
+		for (i = 0; i < number; i++)
+			statuses[i] = MCAPI_ERR_MEM_LIMIT;
+		return 0;
+	}
+	for (i = 0; i < number; i++) {
+		statuses[i] = MCAPI_SUCCESS;
+		/* get_i leaves it out of range when it takes no request: local
+		   (virtual) endpoints and MCAPI_ERR_REQUEST_LIMIT */
+		requests[i] = mcapi_limits.requests;
+		mcapi_trans_endpoint_get_i(&endpoints[i], domain_ids[i], node_ids[i], port_ids[i],
+			&requests[i], &statuses[i]);
+		if (requests[i] >= mcapi_limits.requests)
+			continue;
+		if (statuses[i] == MCAPI_PENDING)
+			pending++;
+		else
+			mcapi_trans_remove_request(requests[i]);
+	}
+	while (pending) {
+		for (i = 0; i < number; i++) {
+			if (statuses[i] != MCAPI_PENDING)
+				continue;
+			mcapi_trans_test_i(&requests[i], NULL, &statuses[i]);
+			if (statuses[i] != MCAPI_PENDING) {
+				mcapi_trans_remove_request(requests[i]);
+				pending--;
+			}
+		}
+		if (pending && !mcapi_trans_backoff_internal(start, timeout, &backoff))
+			break;
+	}
+	for (i = 0; i < number; i++) {
+		if (statuses[i] == MCAPI_PENDING) {
+			mcapi_trans_remove_request(requests[i]);
+			statuses[i] = MCAPI_TIMEOUT;
+		}
+		got += (statuses[i] == MCAPI_SUCCESS);
+	}
+	free(requests);
+	return got;
+}
+
+/* checks if port_num is taken on this processor, by the calling thread's
+   node or another one: the driver has a single session per port. A port
+   this process pools a session on is free for it. */
+mcapi_boolean_t mcapi_trans_endpoint_exists(mcapi_uint_t port_num)
+{
+	if (port_num > MCAPI_PORT_MASK)
+		return MCAPI_FALSE;
+	return ((MCAPI_DB_PORT_MAP(c_db).used[port_num / 64] >> (port_num % 64)) & 1) &&
+		!mcapi_trans_session_pooled_internal(port_num);
+}
+
+/* delete the given endpoint */
+void mcapi_trans_endpoint_delete( mcapi_endpoint_t endpoint)
+{
+	uint16_t d,n,e;
+	uint16_t dindex, nindex, index;
+	mux_carrier* c;
+	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
+
+	if (MCAPI_VPORT_IS(e)) {
+		c = mcapi_trans_mux_carrier_internal(d, n, e);
+		if (c)
+			mcapi_trans_mux_delete_internal(c, e);
+		return;
+	}
+	nindex = mcapi_trans_get_node_index(d, n);
+	if (nindex ==mcapi_limits.nodes)
+		return;
+	dindex = MCAPI_DB_DOMAIN_ROUTE(c_db, d) - 1;
+	index = mcapi_trans_get_port_index(d, n, e);
+	if (index >= mcapi_limits.endpoints) {
+		return;
+	}
+	mcapi_trans_endpoint_delete_internal(dindex, nindex, index);
+}
+
+static void mcapi_trans_endpoint_delete_internal(uint16_t dindex, uint16_t nindex, uint16_t index)
+{
+	mcapi_trans_endpoint_close_internal(dindex, nindex, index, MCAPI_TRUE);
+}
+
+/* the delete of an endpoint; its session is pooled if pool, else shut down,
+   which wakes a receiver blocked in the driver: it is when one is */
+static void mcapi_trans_endpoint_close_internal(uint16_t dindex, uint16_t nindex, uint16_t index, mcapi_boolean_t pool)
+{
+	uint16_t port_num = MCAPI_DB_ENDPOINT(c_db, dindex, nindex, index).port_num;
+	mcapi_boolean_t reading;
+
+	transport_sm_lock_db(c_db);
+	__sync_fetch_and_sub(&MCAPI_DB_NODE(c_db, dindex, nindex).node_d.num_endpoints, 1);
+	mcapi_trans_port_unindex_internal(&MCAPI_DB_PORT_MAP(c_db), port_num, index);
+	memset (&MCAPI_DB_ENDPOINT(c_db, dindex, nindex, index),0,sizeof(endpoint_entry));
+	MCAPI_DB_ENDPOINT_OWNER(c_db, dindex, nindex, index) = 0;
+	transport_sm_unlock_db(c_db);
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	mcapi_trans_coalesce_free_internal(index);
+	mcapi_trans_backlog_free_internal(index);
+	free(mcapi_ep_local[index].ring);
+	/* blocked workers and receivers leave with MCAPI_ERR_ENDP_INVALID */
+	reading = mcapi_trans_dispatch_close_internal(mcapi_ep_local[index].dispatch) ||
+		mcapi_ep_local[index].rx_blocked;
+	memset(&mcapi_ep_local[index], 0, sizeof(endpoint_local));
+	pthread_cond_broadcast(&mcapi_ep_lock[index].rx_cond);
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	if (reading)
+		pool = MCAPI_FALSE;
+
+	/* a pooled session keeps its port */
+	if (pool && mcapi_trans_session_put_internal(index, port_num))
+		return;
+	sm_destroy_session(index);
+	transport_sm_lock_db(c_db);
+	mcapi_trans_port_put_entry_internal(&MCAPI_DB_PORT_MAP(c_db), port_num);
+	transport_sm_unlock_db(c_db);
+}
+
+
+
+/* index of the local endpoint state of an attribute, mcapi_limits.endpoints
+   if there is none; only MCAPI_ENDP_ATTR_MEMORY_TYPE is kept, the others
+   are accepted and ignored */
+static int mcapi_trans_endpoint_attribute_internal(mcapi_endpoint_t endpoint, mcapi_uint_t attribute_num,
+		size_t attribute_size, mcapi_status_t* mcapi_status)
+{
+	uint16_t d,n,e;
+	int index = mcapi_limits.endpoints;
+
+	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
+	if (attribute_num >= MCAPI_ENDP_ATTR_END) {
+		*mcapi_status = MCAPI_ERR_ATTR_NUM;
+	} else if (attribute_num != MCAPI_ENDP_ATTR_MEMORY_TYPE) {
+		*mcapi_status = MCAPI_SUCCESS;
+	} else if (attribute_size != sizeof(mcapi_endp_attr_memory_type_t)) {
+		*mcapi_status = MCAPI_ERR_ATTR_SIZE;
+	} else if (MCAPI_VPORT_IS(e)) {
+		/* fan-outs of virtual endpoints are sent as plain messages */
+		*mcapi_status = MCAPI_ERR_ATTR_NOTSUPPORTED;
+	} else {
+		index = mcapi_trans_get_port_index(d, n, e);
+		*mcapi_status = (index < mcapi_limits.endpoints) ? MCAPI_SUCCESS : MCAPI_ERR_ENDP_REMOTE;
+	}
+	return index;
+}
+
+/* get the attribute for the given endpoint and attribute_num */
+void mcapi_trans_endpoint_get_attribute( mcapi_endpoint_t endpoint, mcapi_uint_t attribute_num, void* attribute, size_t attribute_size,
+		mcapi_status_t* mcapi_status)
+{
+	int index = mcapi_trans_endpoint_attribute_internal(endpoint, attribute_num, attribute_size, mcapi_status);
+
+	if (index >= mcapi_limits.endpoints)
+		return;
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	*(mcapi_endp_attr_memory_type_t*)attribute = mcapi_ep_local[index].memory_type;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+
+/* set the given attribute on the given endpoint */
+void mcapi_trans_endpoint_set_attribute( mcapi_endpoint_t endpoint, mcapi_uint_t attribute_num, const void* attribute, size_t attribute_size,
+		mcapi_status_t* mcapi_status)
+{
+	int index = mcapi_trans_endpoint_attribute_internal(endpoint, attribute_num, attribute_size, mcapi_status);
+	mcapi_endp_attr_memory_type_t type;
+
+	if (index >= mcapi_limits.endpoints)
+		return;
+	type = *(const mcapi_endp_attr_memory_type_t*)attribute;
+	if ((type & 0xffff) > MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY) {
+		*mcapi_status = MCAPI_ERR_ATTR_VALUE;
+		return;
+	}
+	if ((type & 0xffff) == MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY && !sm_have_cached_buf()) {
+		/* the driver has no cacheable buffers to stage fan-outs in */
+		*mcapi_status = MCAPI_ERR_ATTR_NOTSUPPORTED;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	mcapi_ep_local[index].memory_type = type;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+mcapi_boolean_t mcapi_trans_node_set_attribute(
+		mcapi_node_attributes_t* mcapi_node_attributes,
+		mcapi_uint_t attribute_num,
+		const void* attribute,
+		size_t attribute_size,
+		mcapi_status_t* mcapi_status
+		){
+	mcapi_boolean_t rc = MCAPI_FALSE;
+
+	if (attribute_num >= MCAPI_NODE_ATTR_END) {
+		/* the node type and the database capacities are supported */
+		*mcapi_status = MCAPI_ERR_ATTR_NOTSUPPORTED;
+	} else if (attribute_size != sizeof(mcapi_uint_t) ) {
+		/* mcapi_node_attr_type_t is an mcapi_uint_t too */
+		*mcapi_status = MCAPI_ERR_ATTR_SIZE;
+	} else {
+		rc = MCAPI_TRUE;
+		/* copy the attribute into the attributes data structure */
+		memcpy(&mcapi_node_attributes->entries[attribute_num].attribute_d,
+				attribute,
+				attribute_size);
+		mcapi_node_attributes->entries[attribute_num].valid = MCAPI_TRUE;
+		mcapi_node_attributes->entries[attribute_num].bytes = attribute_size;
+	}
+	return rc;
+}
+
+mcapi_boolean_t mcapi_trans_node_get_attribute(
+		mcapi_domain_t domain_id,
+		mcapi_node_t node_id,
+		mcapi_uint_t attribute_num,
+		void* attribute,
+		size_t attribute_size,
+		mcapi_status_t* mcapi_status) {
+	mcapi_boolean_t rc = MCAPI_FALSE;
+	mcapi_route* route = mcapi_trans_route_internal(domain_id, node_id);
+	uint32_t d,n;
+	size_t size;
+	mcapi_database *mcapi_db = c_db;
+
+	// look up the <domain,node>
+	if (!route || !MCAPI_DB_DOMAIN(mcapi_db, MCAPI_DB_DOMAIN_ROUTE(mcapi_db, domain_id) - 1).valid) {
+		*mcapi_status = MCAPI_ERR_DOMAIN_INVALID;
+	} else if (!route->node_index) {
+		*mcapi_status = MCAPI_ERR_NODE_INVALID;
+	} else {
+		d = MCAPI_DB_DOMAIN_ROUTE(mcapi_db, domain_id) - 1;
+		n = route->node_index - 1;
+		size = MCAPI_DB_NODE(mcapi_db, d, n).attributes.entries[attribute_num].bytes;
+		if (size != attribute_size) {
+			*mcapi_status = MCAPI_ERR_ATTR_SIZE;
+		} else {
+			memcpy(attribute,
+					&MCAPI_DB_NODE(mcapi_db, d, n).attributes.entries[attribute_num].attribute_d,
+					size);
+			rc = MCAPI_TRUE;
+		}
+	}
+	return rc;
+}
+
+mcapi_boolean_t mcapi_trans_node_init_attributes(
+		mcapi_node_attributes_t* mcapi_node_attributes,
+		mcapi_status_t* mcapi_status
+		) {
+	mcapi_boolean_t rc = MCAPI_TRUE;
+	/* default values are all 0 */
+	memset(mcapi_node_attributes,0,sizeof(*mcapi_node_attributes));
+	return rc;
+}
+
+
+
+/****************** flow control ****************************/
+/* Each send endpoint holds a number of credits, one per message it may post
+   without asking the transport first.  The window is its share of the free
+   slot count of the node (sm_node_status.nfree split between the endpoints
+   of the node), consumed by every send, given back once the send completes
+   locally (when a blocking send returns, when the request of a non-blocking
+   one is tested or waited for) and re-read once it runs dry. */
+static uint64_t mcapi_trans_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sleep for the next step of an exponential backoff started at start,
+   returns MCAPI_FALSE instead once timeout (msecs) has passed */
+static mcapi_boolean_t mcapi_trans_backoff_internal(uint64_t start, mcapi_timeout_t timeout, useconds_t* backoff)
+{
+	if (timeout != MCAPI_TIMEOUT_INFINITE &&
+		mcapi_trans_now_us() - start >= (uint64_t)timeout * 1000)
+		return MCAPI_FALSE;
+	usleep(*backoff);
+	if (*backoff < MCAPI_BACKOFF_MAX_US)
+		*backoff *= 2;
+	return MCAPI_TRUE;
+}
+
+static void mcapi_trans_credit_set_internal(int index, mcapi_uint_t credits)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_boolean_t starved = (l->credits == 0);
+
+	l->credits = credits;
+	if (starved && credits && l->credit_cb)
+		l->credit_cb(l->credit_endpoint, credits, l->credit_cb_context);
+}
+
+static void mcapi_trans_credit_refresh_internal(int index)
+{
+	uint32_t nfree, endpoints;
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	l->credit_refreshed = mcapi_trans_now_us();
+	if (sm_get_node_status(mcapi_trans_self_internal()->node_num, NULL, NULL, &nfree)) {
+		/* no slot accounting in the driver, let every send through */
+		l->credit_unknown = MCAPI_TRUE;
+		return;
+	}
+	l->credit_unknown = MCAPI_FALSE;
+	/* the slots are the node's: windows of nfree each would promise them
+	   to every endpoint at once; one at least while there are any, so
+	   that no endpoint is locked out */
+	endpoints = mcapi_trans_num_endpoints();
+	if (endpoints > 1 && nfree > endpoints)
+		nfree /= endpoints;
+	else if (endpoints > 1 && nfree)
+		nfree = 1;
+	l->credit_limit = nfree;
+	mcapi_trans_credit_set_internal(index, nfree);
+}
+
+/* re-read the window if it is empty, rate limited so that senders polling
+   an exhausted endpoint don't turn into a stream of ioctls */
+static mcapi_uint_t mcapi_trans_credit_get_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	if (l->credits == 0 && (!l->credit_refreshed ||
+		mcapi_trans_now_us() - l->credit_refreshed >= MCAPI_CREDIT_REFRESH_US))
+		mcapi_trans_credit_refresh_internal(index);
+	return l->credits;
+}
+
+/* takes a credit if the window has one */
+static mcapi_boolean_t mcapi_trans_credit_hold_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	if (!mcapi_trans_credit_get_internal(index))
+		return MCAPI_FALSE;
+	l->credits--;
+	return MCAPI_TRUE;
+}
+
+/* whether a send may go out: with a credit (*held), or without slot
+   accounting */
+static mcapi_boolean_t mcapi_trans_credit_take_internal(int index, mcapi_boolean_t* held)
+{
+	*held = mcapi_trans_credit_hold_internal(index);
+	return *held || mcapi_ep_local[index].credit_unknown;
+}
+
+/* holds a credit for a send that may fail without one; an empty window
+   is re-read right away, it may only be out of date */
+static mcapi_boolean_t mcapi_trans_credit_take_now_internal(int index)
+{
+	if (!mcapi_ep_local[index].credits)
+		mcapi_trans_credit_refresh_internal(index);
+	return mcapi_trans_credit_hold_internal(index);
+}
+
+/* gives back a credit held by a send that has completed */
+static void mcapi_trans_credit_put_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	if (l->credits < l->credit_limit)
+		mcapi_trans_credit_set_internal(index, l->credits + 1);
+}
+
+static void mcapi_trans_credit_return_internal(int id)
+{
+	uint16_t sd,sn,se;
+	int index;
+
+	if (!MCAPI_DB_REQUEST(c_db, id).credit)
+		return;
+	MCAPI_DB_REQUEST(c_db, id).credit = MCAPI_FALSE;
+	assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(c_db, id).handle,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index < mcapi_limits.endpoints)
+		mcapi_trans_credit_put_internal(index);
+}
+
+mcapi_uint_t mcapi_trans_msg_credits_available(mcapi_endpoint_t send_endpoint, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+	mcapi_uint_t credits;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return MCAPI_NULL;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	credits = mcapi_trans_credit_get_internal(index);
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	*mcapi_status = MCAPI_SUCCESS;
+	return credits;
+}
+
+mcapi_uint_t mcapi_trans_msg_credits_wait(mcapi_endpoint_t send_endpoint, mcapi_timeout_t timeout, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+	mcapi_uint_t credits;
+	mcapi_boolean_t unknown;
+	uint64_t start = mcapi_trans_now_us();
+	useconds_t backoff = MCAPI_CREDIT_REFRESH_US;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return MCAPI_NULL;
+	}
+
+	/* the driver has no wait for free slots, so back off exponentially
+	   between reads of the free slot count */
+	for (;;) {
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		credits = mcapi_trans_credit_get_internal(index);
+		unknown = mcapi_ep_local[index].credit_unknown;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		if (credits || unknown)
+			break;
+		if (!mcapi_trans_backoff_internal(start, timeout, &backoff)) {
+			*mcapi_status = MCAPI_TIMEOUT;
+			return MCAPI_NULL;
+		}
+	}
+	*mcapi_status = MCAPI_SUCCESS;
+	return credits;
+}
+
+void mcapi_trans_msg_credits_notify(mcapi_endpoint_t send_endpoint, mcapi_credit_callback_t callback, void* context, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	mcapi_ep_local[index].credit_endpoint = send_endpoint;
+	mcapi_ep_local[index].credit_cb_context = context;
+	mcapi_ep_local[index].credit_cb = callback;
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+/****************** send backlog ****************************/
+/* With a backlog, mcapi_msg_send_i() copies a message the transport has no
+   room for into a bounded per endpoint queue instead of failing, and leaves
+   its request pending.  The queue is pushed out in order by the next calls
+   that touch the endpoint (sends, mcapi_test(), mcapi_wait() and
+   mcapi_msg_send_flush()), and each request completes when its message has
+   actually been handed to the transport. */
+static mcapi_boolean_t mcapi_trans_backlog_push_internal(int index, mcapi_endpoint_t receive_endpoint,
+		char* buffer, size_t size, int id)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	backlog_entry* b;
+
+	if (l->backlog_count == l->backlog_depth)
+		return MCAPI_FALSE;
+	b = &l->backlog[(l->backlog_head + l->backlog_count) % l->backlog_depth];
+	b->receive_endpoint = receive_endpoint;
+	b->request = id;
+	b->size = size;
+	memcpy(b->data, buffer, size);
+	l->backlog_count++;
+	if (id == MCAPI_NO_REQUEST)
+		return MCAPI_TRUE;
+	MCAPI_DB_REQUEST(c_db, id).backlogged = MCAPI_TRUE;
+	MCAPI_DB_REQUEST(c_db, id).completed = MCAPI_FALSE;
+	return MCAPI_TRUE;
+}
+
+static void mcapi_trans_backlog_drain_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_request_data* r;
+	mcapi_request_data dummy;
+	backlog_entry* b;
+	uint16_t rd,rn,re;
+	uint32_t payload;
+	mcapi_boolean_t held;
+
+	while (l->backlog_count && mcapi_trans_credit_take_internal(index, &held)) {
+		b = &l->backlog[l->backlog_head];
+		r = (b->request == MCAPI_NO_REQUEST) ? &dummy : &MCAPI_DB_REQUEST(c_db, b->request);
+		assert(mcapi_trans_decode_handle_internal(b->receive_endpoint,&rd,&rn,&re));
+		if (sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), b->data, b->size, &payload, 0)) {
+			mcapi_trans_credit_set_internal(index, 0);
+			if (errno == EAGAIN)
+				break;
+			/* the message can't be sent at all, fail its request */
+			r->status = MCAPI_ERR_TRANSMISSION;
+			r->credit = MCAPI_FALSE;
+		} else {
+			r->status = MCAPI_SUCCESS;
+			r->payload = payload;
+			r->credit = held;
+			/* a batch has no request to give its credit back */
+			if (held && r == &dummy)
+				mcapi_trans_credit_put_internal(index);
+		}
+		r->backlogged = MCAPI_FALSE;
+		r->completed = MCAPI_TRUE;
+		l->backlog_head = (l->backlog_head + 1) % l->backlog_depth;
+		l->backlog_count--;
+	}
+}
+
+/* drain the backlog of an endpoint until it is empty (or the request id
+   has left it, if id >= 0) */
+static mcapi_boolean_t mcapi_trans_backlog_flush_internal(int index, int id, mcapi_timeout_t timeout)
+{
+	uint64_t start = mcapi_trans_now_us();
+	useconds_t backoff = MCAPI_CREDIT_REFRESH_US;
+	mcapi_boolean_t ok;
+
+	for (;;) {
+		mcapi_trans_backlog_drain_internal(index);
+		if (id >= 0 ? !MCAPI_DB_REQUEST(c_db, id).backlogged : !mcapi_ep_local[index].backlog_count)
+			return MCAPI_TRUE;
+		/* called with the endpoint locked, let the others in while waiting */
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		ok = mcapi_trans_backoff_internal(start, timeout, &backoff);
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		if (!ok)
+			return MCAPI_FALSE;
+	}
+}
+
+/* throw away whatever is still queued, e.g. when the endpoint is deleted */
+static void mcapi_trans_backlog_free_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_request_t id;
+
+	for (; l->backlog_count; l->backlog_count--) {
+		id = l->backlog[l->backlog_head].request;
+		if (id != MCAPI_NO_REQUEST) {
+			MCAPI_DB_REQUEST(c_db, id).backlogged = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(c_db, id).cancelled = MCAPI_TRUE;
+		}
+		l->backlog_head = (l->backlog_head + 1) % l->backlog_depth;
+	}
+	free(l->backlog);
+	l->backlog = NULL;
+	l->backlog_depth = 0;
+	l->backlog_head = 0;
+}
+
+void mcapi_trans_msg_send_backlog(mcapi_endpoint_t send_endpoint, mcapi_uint_t depth, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+	endpoint_local* l;
+	backlog_entry* backlog = NULL;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	l = &mcapi_ep_local[index];
+	if (l->backlog_count) {
+		/* resizing would reorder or drop queued messages */
+		*mcapi_status = MCAPI_PENDING;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
+	if (depth) {
+		backlog = malloc(depth * sizeof(backlog_entry));
+		if (!backlog) {
+			*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+	}
+	mcapi_trans_backlog_free_internal(index);
+	l->backlog = backlog;
+	l->backlog_depth = depth;
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+void mcapi_trans_msg_send_flush(mcapi_endpoint_t send_endpoint, mcapi_timeout_t timeout, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	if (mcapi_trans_backlog_flush_internal(index, -1, timeout))
+		*mcapi_status = MCAPI_SUCCESS;
+	else
+		*mcapi_status = MCAPI_TIMEOUT;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+/****************** coalescing ****************************/
+/* A coalescing send endpoint packs small messages for the same receiver into
+   one framed packet (see mcapi_frame.h) and hands the batch to the transport
+   once it reaches the current batch size, once its oldest message is older
+   than the deadline, or on mcapi_msg_coalesce_flush().  The batch size adapts
+   to the load: it doubles (up to the configured maximum) when a batch fills
+   up before the deadline, and drops to what had accumulated when the
+   deadline expires first.  The deadline is checked by the library calls made
+   on the endpoint and, for endpoints nobody uses meanwhile, by a drainer
+   thread the process starts with its first coalescing endpoint.  The
+   messages of a batch have been
+   reported sent, so a batch the transport refuses outside of an explicit
+   flush is kept (co_failed); the next send or flush on the endpoint tries
+   it once more and reports MCAPI_ERR_TRANSMISSION if it is refused again. */
+typedef enum {
+	COALESCE_FULL,
+	COALESCE_DEADLINE,
+	COALESCE_BEFORE,	/* ahead of another send or a receive */
+	COALESCE_EXPLICIT
+} coalesce_reason;
+
+static void mcapi_trans_coalesce_reset_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	l->co_len = sizeof(mcapi_frame_header);
+	l->co_count = 0;
+}
+
+/* returns MCAPI_SUCCESS when the batch is gone, MCAPI_ERR_MEM_LIMIT when
+   the transport had no room (the batch is kept) and MCAPI_ERR_TRANSMISSION
+   when it refused it: the batch is dropped on an explicit flush, whose
+   caller reports the error, and kept otherwise */
+static mcapi_status_t mcapi_trans_coalesce_flush_internal(int index, int blocking, coalesce_reason why)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_frame_header* h = (mcapi_frame_header*)l->co_buf;
+	mcapi_status_t status = MCAPI_SUCCESS;
+	uint16_t rd,rn,re;
+	uint32_t payload;
+	size_t len = l->co_len;
+	size_t min = sizeof(mcapi_frame_header) + MCAPI_FRAME_RECORD_SPACE(1);
+	mcapi_boolean_t held;
+
+	if (!l->co_count)
+		return MCAPI_SUCCESS;
+	h->magic = MCAPI_FRAME_MAGIC;
+	h->count = l->co_count;
+	assert(mcapi_trans_decode_handle_internal(l->co_dest,&rd,&rn,&re));
+
+	if (blocking) {
+		if (l->backlog_count)
+			mcapi_trans_backlog_flush_internal(index, -1, MCAPI_TIMEOUT_INFINITE);
+		/* the batch has left (or failed) once the send returns */
+		held = mcapi_trans_credit_hold_internal(index);
+		if (sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), l->co_buf, l->co_len, NULL, 1))
+			status = MCAPI_ERR_TRANSMISSION;
+		if (held)
+			mcapi_trans_credit_put_internal(index);
+	} else {
+		if (l->backlog)
+			mcapi_trans_backlog_drain_internal(index);
+		if (l->backlog_count || !mcapi_trans_credit_take_internal(index, &held))
+			status = MCAPI_ERR_MEM_LIMIT;
+		else if (sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), l->co_buf, l->co_len, &payload, 0)) {
+			mcapi_trans_credit_set_internal(index, 0);
+			status = (errno == EAGAIN) ? MCAPI_ERR_MEM_LIMIT : MCAPI_ERR_TRANSMISSION;
+		} else if (held) {
+			/* posted, and no request to wait for */
+			mcapi_trans_credit_put_internal(index);
+		}
+		/* a batch can wait in the backlog like any other message */
+		if (status == MCAPI_ERR_MEM_LIMIT && l->backlog &&
+			mcapi_trans_backlog_push_internal(index, l->co_dest, l->co_buf, l->co_len, MCAPI_NO_REQUEST))
+			status = MCAPI_SUCCESS;
+	}
+	if (status == MCAPI_ERR_MEM_LIMIT)
+		return status;
+	if (status == MCAPI_ERR_TRANSMISSION && why != COALESCE_EXPLICIT) {
+		l->co_failed = MCAPI_TRUE;
+		return status;
+	}
+
+	l->co_failed = MCAPI_FALSE;
+	mcapi_trans_coalesce_reset_internal(index);
+	if (why == COALESCE_FULL)
+		l->co_target = (l->co_target * 2 < l->co_max) ? l->co_target * 2 : l->co_max;
+	else if (why == COALESCE_DEADLINE)
+		l->co_target = (len > min) ? len : min;
+	return status;
+}
+
+/* send the batch of an endpoint if its oldest message has waited too long */
+static void mcapi_trans_coalesce_poll_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	if (l->co_count && mcapi_trans_now_us() - l->co_first >= l->co_deadline)
+		mcapi_trans_coalesce_flush_internal(index, 0, COALESCE_DEADLINE);
+}
+
+/* The drainer sleeps until the oldest batch of the process is due, or
+   until a batch is started that is due before; a batch the transport had
+   no room for is tried again every MCAPI_BACKOFF_MAX_US. One that was
+   refused is left to the next call on its endpoint, which reports it. */
+static pthread_t mcapi_coalesce_thread;
+static pthread_mutex_t mcapi_coalesce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mcapi_coalesce_cond = PTHREAD_COND_INITIALIZER;
+static mcapi_boolean_t mcapi_coalesce_running;
+static mcapi_boolean_t mcapi_coalesce_stop;
+static mcapi_boolean_t mcapi_coalesce_kick;
+static uint64_t mcapi_coalesce_wake;	/* usecs it sleeps until, 0 if it may miss a batch */
+
+static void* mcapi_trans_coalesce_drainer(void* arg)
+{
+	endpoint_local* l;
+	struct timespec ts;
+	uint64_t now, due, next;
+	uint32_t i;
+
+	pthread_mutex_lock(&mcapi_coalesce_lock);
+	while (!mcapi_coalesce_stop) {
+		mcapi_coalesce_kick = MCAPI_FALSE;
+		mcapi_coalesce_wake = 0;
+		pthread_mutex_unlock(&mcapi_coalesce_lock);
+		next = 0;
+		for (i = 0; i < mcapi_ep_local_count; i++) {
+			l = &mcapi_ep_local[i];
+			/* a look without the lock, only to skip the others */
+			if (!l->co_buf)
+				continue;
+			pthread_mutex_lock(&mcapi_ep_lock[i].lock);
+			if (l->co_buf && !l->co_failed) {
+				mcapi_trans_coalesce_poll_internal(i);
+				now = mcapi_trans_now_us();
+				due = l->co_first + l->co_deadline;
+				if (l->co_count && due <= now)
+					due = now + MCAPI_BACKOFF_MAX_US;
+				if (l->co_count && !l->co_failed && (!next || due < next))
+					next = due;
+			}
+			pthread_mutex_unlock(&mcapi_ep_lock[i].lock);
+		}
+		pthread_mutex_lock(&mcapi_coalesce_lock);
+		if (mcapi_coalesce_kick || mcapi_coalesce_stop)
+			continue;
+		mcapi_coalesce_wake = next;
+		if (!next) {
+			pthread_cond_wait(&mcapi_coalesce_cond, &mcapi_coalesce_lock);
+			continue;
+		}
+		now = mcapi_trans_now_us();
+		if (next <= now)
+			continue;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += (next - now) / 1000000;
+		ts.tv_nsec += (next - now) % 1000000 * 1000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&mcapi_coalesce_cond, &mcapi_coalesce_lock, &ts);
+	}
+	pthread_mutex_unlock(&mcapi_coalesce_lock);
+	return NULL;
+}
+
+/* starts the drainer unless it runs; MCAPI_FALSE if it can't */
+static mcapi_boolean_t mcapi_trans_coalesce_start_internal(void)
+{
+	pthread_mutex_lock(&mcapi_coalesce_lock);
+	if (!mcapi_coalesce_running) {
+		mcapi_coalesce_stop = MCAPI_FALSE;
+		mcapi_coalesce_running = !pthread_create(&mcapi_coalesce_thread, NULL,
+			mcapi_trans_coalesce_drainer, NULL);
+	}
+	pthread_mutex_unlock(&mcapi_coalesce_lock);
+	return mcapi_coalesce_running;
+}
+
+/* a batch was started that is due at due (usecs) */
+static void mcapi_trans_coalesce_kick_internal(uint64_t due)
+{
+	pthread_mutex_lock(&mcapi_coalesce_lock);
+	if (!mcapi_coalesce_wake || due < mcapi_coalesce_wake) {
+		mcapi_coalesce_kick = MCAPI_TRUE;
+		pthread_cond_signal(&mcapi_coalesce_cond);
+	}
+	pthread_mutex_unlock(&mcapi_coalesce_lock);
+}
+
+/* stops the drainer, with the last node of the process */
+static void mcapi_trans_coalesce_stop_internal(void)
+{
+	pthread_mutex_lock(&mcapi_coalesce_lock);
+	if (!mcapi_coalesce_running) {
+		pthread_mutex_unlock(&mcapi_coalesce_lock);
+		return;
+	}
+	mcapi_coalesce_stop = MCAPI_TRUE;
+	pthread_cond_signal(&mcapi_coalesce_cond);
+	pthread_mutex_unlock(&mcapi_coalesce_lock);
+	pthread_join(mcapi_coalesce_thread, NULL);
+	mcapi_coalesce_running = MCAPI_FALSE;
+}
+
+/* same for the endpoint behind a request */
+static void mcapi_trans_coalesce_poll_request_internal(int id)
+{
+	uint16_t d,n,e;
+	int index;
+
+	if (MCAPI_DB_REQUEST(c_db, id).type != SEND && MCAPI_DB_REQUEST(c_db, id).type != RECV)
+		return;
+	assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(c_db, id).handle,&d,&n,&e));
+	index = mcapi_trans_get_port_index(d, n, e);
+	if (index < mcapi_limits.endpoints && mcapi_ep_local[index].co_buf)
+		mcapi_trans_coalesce_poll_internal(index);
+}
+
+/* Add a message to the batch of a coalescing endpoint.  Returns
+   MCAPI_SUCCESS when the message has been taken (its send is complete),
+   MCAPI_PENDING when it is too large to be coalesced and has to be sent on
+   its own (the batch has been flushed so that the order is kept), or the
+   error of a flush that was needed to make room. */
+static mcapi_status_t mcapi_trans_coalesce_add_internal(int index, mcapi_endpoint_t receive_endpoint,
+		char* buffer, size_t size, int blocking)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_frame_record* r;
+	mcapi_status_t status;
+	size_t space = MCAPI_FRAME_RECORD_SPACE(size);
+	mcapi_boolean_t fits = (sizeof(mcapi_frame_header) + space <= l->co_max);
+
+	mcapi_trans_coalesce_poll_internal(index);
+	if (l->co_count && (l->co_failed || !fits || l->co_dest != receive_endpoint ||
+			l->co_len + space > l->co_max)) {
+		status = mcapi_trans_coalesce_flush_internal(index, blocking, COALESCE_EXPLICIT);
+		if (status != MCAPI_SUCCESS)
+			return (blocking || status == MCAPI_ERR_TRANSMISSION) ? MCAPI_ERR_TRANSMISSION : MCAPI_ERR_MEM_LIMIT;
+	}
+	if (!fits)
+		return MCAPI_PENDING;
+
+	r = (mcapi_frame_record*)(l->co_buf + l->co_len);
+	r->size = size;
+	r->reserved = 0;
+	memcpy(r + 1, buffer, size);
+	if (!l->co_count) {
+		l->co_first = mcapi_trans_now_us();
+		mcapi_trans_coalesce_kick_internal(l->co_first + l->co_deadline);
+	}
+	l->co_len += space;
+	l->co_count++;
+	l->co_dest = receive_endpoint;
+	/* the message is ours now, a batch that can't leave yet is retried
+	   by the next call on the endpoint, which reports a failure */
+	if (l->co_len >= l->co_target)
+		mcapi_trans_coalesce_flush_internal(index, blocking, COALESCE_FULL);
+	return MCAPI_SUCCESS;
+}
+
+static void mcapi_trans_coalesce_free_internal(int index)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	if (l->co_buf)
+		mcapi_trans_coalesce_flush_internal(index, 0, COALESCE_EXPLICIT);
+	free(l->co_buf);
+	l->co_buf = NULL;
+	l->co_count = 0;
+	free(l->rx_packet);
+	l->rx_packet = NULL;
+	l->rx_left = 0;
+	l->unpack = MCAPI_FALSE;
+}
+
+void mcapi_trans_msg_coalesce(mcapi_endpoint_t send_endpoint, size_t max_bytes, mcapi_uint_t deadline_us, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+	endpoint_local* l;
+	char* buf = NULL;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	l = &mcapi_ep_local[index];
+	if (l->co_buf &&
+		mcapi_trans_coalesce_flush_internal(index, 1, COALESCE_EXPLICIT) != MCAPI_SUCCESS) {
+		*mcapi_status = MCAPI_ERR_TRANSMISSION;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
+	if (max_bytes) {
+		buf = mcapi_trans_coalesce_start_internal() ? malloc(max_bytes) : NULL;
+		if (!buf) {
+			*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+	}
+	/* set for good: frames sent before coalescing is turned off may
+	   still be queued at the receivers */
+	if (max_bytes)
+		__sync_fetch_and_or(&MCAPI_DB_PORT_MAP(c_db).framed[se / 64], 1ULL << (se % 64));
+	free(l->co_buf);
+	l->co_buf = buf;
+	l->co_max = max_bytes;
+	l->co_target = max_bytes;
+	l->co_deadline = deadline_us;
+	mcapi_trans_coalesce_reset_internal(index);
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+void mcapi_trans_msg_coalesce_flush(mcapi_endpoint_t send_endpoint, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	int index;
+
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	if (!mcapi_ep_local[index].co_buf)
+		*mcapi_status = MCAPI_SUCCESS;
+	else if (mcapi_trans_coalesce_flush_internal(index, 1, COALESCE_EXPLICIT) == MCAPI_SUCCESS)
+		*mcapi_status = MCAPI_SUCCESS;
+	else
+		*mcapi_status = MCAPI_ERR_TRANSMISSION;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+/* Receive side: an endpoint that accepts coalesced packets receives into
+   rx_packet and hands the records of a frame out one message at a time.
+   Packets that are not frames are passed through whole. */
+static mcapi_boolean_t mcapi_trans_unpack_next_internal(int index, char* buffer, size_t buffer_size, uint32_t* len)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	const void* payload;
+	size_t size;
+
+	if (!l->rx_left)
+		return MCAPI_FALSE;
+	if (!mcapi_frame_next(l->rx_packet, l->rx_len, &l->rx_off, &payload, &size)) {
+		/* malformed, drop the rest */
+		l->rx_left = 0;
+		return MCAPI_FALSE;
+	}
+	l->rx_left--;
+	memcpy(buffer, payload, (size < buffer_size) ? size : buffer_size);
+	*len = size;
+	return MCAPI_TRUE;
+}
+
+/* Tells whether packets from port se of core sn may be frames: only the
+   endpoints of this processor coalesce, and those that did are marked in
+   the port map. Any other packet is a plain message, whatever its first
+   bytes are. */
+static mcapi_boolean_t mcapi_trans_framed_sender_internal(uint16_t se, uint16_t sn)
+{
+	return sn == MASTER_NODE_NUM &&
+		((MCAPI_DB_PORT_MAP(c_db).framed[se / 64] >> (se % 64)) & 1);
+}
+
+/* rx_packet holds a new packet from rx_se/rx_sn, hand out its first message */
+static void mcapi_trans_unpack_packet_internal(int index, char* buffer, size_t buffer_size, uint32_t* len)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	l->rx_off = 0;
+	l->rx_left = mcapi_trans_framed_sender_internal(l->rx_se, l->rx_sn) ?
+		mcapi_frame_count(l->rx_packet, l->rx_len) : 0;
+	if (mcapi_trans_unpack_next_internal(index, buffer, buffer_size, len))
+		return;
+	l->rx_left = 0;
+	memcpy(buffer, l->rx_packet, (l->rx_len < buffer_size) ? l->rx_len : buffer_size);
+	*len = l->rx_len;
+}
+
+void mcapi_trans_msg_coalesce_accept(mcapi_endpoint_t receive_endpoint, mcapi_boolean_t enable, mcapi_status_t* mcapi_status)
+{
+	uint16_t rd,rn,re;
+	int index;
+	endpoint_local* l;
+
+	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	l = &mcapi_ep_local[index];
+	if (!enable && l->rx_left) {
+		/* messages of the last packet would be lost */
+		*mcapi_status = MCAPI_PENDING;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
+	if (enable && !l->rx_packet) {
+		l->rx_packet = malloc(MCAPI_MAX_MSG_SIZE);
+		if (!l->rx_packet) {
+			*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+		l->rx_left = 0;
+	}
+	l->unpack = enable;
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+/****************** receive prefetch ****************************/
+/* With a prefetch ring, a receive that finds the local state empty reads
+   the number of queued packets first and, if there are any, pulls up to
+   the ring depth of them in one batch (sm_recv_packets()).  Later receives
+   are served from the ring without going to the driver, and a
+   non-blocking receive on an empty session costs one status read. */
+static mcapi_boolean_t mcapi_trans_recv_buffered_internal(int index)
+{
+	return mcapi_ep_local[index].unpack || mcapi_ep_local[index].ring;
+}
+
+/* fill the (empty) ring with up to n packets */
+static void mcapi_trans_prefetch_fill_internal(int index, uint32_t n)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	struct sm_recv_desc desc[MCAPI_MAX_QUEUE_ELEMENTS];
+	uint32_t i, chunk, total = 0;
+	int got;
+
+	if (n > l->ring_depth)
+		n = l->ring_depth;
+	/* the ring can be deeper than desc when the queue limit was raised */
+	while (total < n) {
+		chunk = (n - total < MCAPI_MAX_QUEUE_ELEMENTS) ? n - total : MCAPI_MAX_QUEUE_ELEMENTS;
+		for (i = 0; i < chunk; i++) {
+			desc[i].buf = l->ring[total + i].data;
+			desc[i].len = MCAPI_MAX_MSG_SIZE;
+		}
+		got = sm_recv_packets(index, desc, chunk);
+		for (i = 0; i < got; i++) {
+			l->ring[total + i].len = desc[i].len;
+			l->ring[total + i].se = desc[i].src_ep;
+			l->ring[total + i].sn = desc[i].src_cpu;
+		}
+		if (got <= 0)
+			break;
+		total += got;
+		if (got < chunk)
+			break;
+	}
+	l->ring_head = 0;
+	l->ring_count = total;
+}
+
+/* serve a receive from what this process already holds for the endpoint */
+static mcapi_boolean_t mcapi_trans_recv_local_internal(int index, uint16_t* se, uint16_t* sn,
+		char* buffer, size_t buffer_size, uint32_t* len)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	prefetch_entry* e;
+
+	if (!mcapi_trans_unpack_next_internal(index, buffer, buffer_size, len)) {
+		if (!l->ring_count)
+			return MCAPI_FALSE;
+		e = &l->ring[l->ring_head];
+		l->ring_head = (l->ring_head + 1) % l->ring_depth;
+		l->ring_count--;
+		if (l->unpack) {
+			memcpy(l->rx_packet, e->data, e->len);
+			l->rx_len = e->len;
+			l->rx_se = e->se;
+			l->rx_sn = e->sn;
+			mcapi_trans_unpack_packet_internal(index, buffer, buffer_size, len);
+		} else {
+			memcpy(buffer, e->data, (e->len < buffer_size) ? e->len : buffer_size);
+			*len = e->len;
+			*se = e->se;
+			*sn = e->sn;
+			return MCAPI_TRUE;
+		}
+	}
+	*se = l->rx_se;
+	*sn = l->rx_sn;
+	return MCAPI_TRUE;
+}
+
+/* sm_recv_packet() for endpoints with unpacking or a prefetch ring */
+static int mcapi_trans_recv_internal(int index, uint16_t* se, uint16_t* sn,
+		char* buffer, size_t buffer_size, uint32_t* len, int blocking)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	struct sm_session_status status;
+	int ret;
+
+	if (mcapi_trans_recv_local_internal(index, se, sn, buffer, buffer_size, len))
+		return 0;
+	if (l->rx_blocked) {
+		/* the next message is the blocked receiver's */
+		errno = EAGAIN;
+		return -1;
+	}
+	if (l->ring && !sm_get_session_status(index, &status)) {
+		if (status.n_avail)
+			mcapi_trans_prefetch_fill_internal(index, status.n_avail);
+		if (mcapi_trans_recv_local_internal(index, se, sn, buffer, buffer_size, len))
+			return 0;
+		if (!blocking) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if (!l->unpack) {
+		*len = buffer_size;
+		return sm_recv_packet(index, se, sn, buffer, len, blocking);
+	}
+	l->rx_len = MCAPI_MAX_MSG_SIZE;
+	ret = sm_recv_packet(index, &l->rx_se, &l->rx_sn, l->rx_packet, &l->rx_len, blocking);
+	if (ret)
+		return ret;
+	mcapi_trans_unpack_packet_internal(index, buffer, buffer_size, len);
+	*se = l->rx_se;
+	*sn = l->rx_sn;
+	return 0;
+}
+
+/* A blocking mcapi_trans_recv_internal(), called with the endpoint's lock
+   and dropping it while the driver is waited on, so that the endpoint's
+   other operations don't queue up behind an idle receiver. One receiver
+   waits in the driver at a time, the others on rx_cond. Nothing is
+   buffered meanwhile (see rx_blocked), so what it gets is the next
+   message; it is unpacked once the lock is back. */
+static int mcapi_trans_recv_wait_internal(int index, uint16_t* se, uint16_t* sn,
+		char* buffer, size_t buffer_size, uint32_t* len)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	char packet[MCAPI_MAX_MSG_SIZE];
+	uint32_t plen = MCAPI_MAX_MSG_SIZE;
+	int ret, err;
+
+	while ((ret = mcapi_trans_recv_internal(index, se, sn, buffer, buffer_size, len, 0)) &&
+			errno == EAGAIN && l->rx_blocked)
+		pthread_cond_wait(&mcapi_ep_lock[index].rx_cond, &mcapi_ep_lock[index].lock);
+	if (!ret || errno != EAGAIN)
+		return ret;
+	if (!MCAPI_DB_LOCAL_ENDPOINT(index).valid) {
+		/* deleted while waiting */
+		errno = EINVAL;
+		return -1;
+	}
+	l->rx_blocked = MCAPI_TRUE;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	ret = sm_recv_packet(index, se, sn, packet, &plen, 1);
+	err = errno;
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	l->rx_blocked = MCAPI_FALSE;
+	pthread_cond_broadcast(&mcapi_ep_lock[index].rx_cond);
+	if (ret) {
+		errno = err;
+		return ret;
+	}
+	if (plen > MCAPI_MAX_MSG_SIZE)
+		plen = MCAPI_MAX_MSG_SIZE;
+	if (l->unpack) {
+		memcpy(l->rx_packet, packet, plen);
+		l->rx_len = plen;
+		l->rx_se = *se;
+		l->rx_sn = *sn;
+		mcapi_trans_unpack_packet_internal(index, buffer, buffer_size, len);
+	} else {
+		memcpy(buffer, packet, (plen < buffer_size) ? plen : buffer_size);
+		*len = plen;
+	}
+	return 0;
+}
+
+/* completes a pending receive request of such an endpoint, like
+   sm_wait_nonblocking() does for the others */
+static int mcapi_trans_recv_request_internal(int index, int id, uint16_t re, uint16_t cpu,
+		mcapi_timeout_t timeout, int blocking)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	mcapi_request_data* r = &MCAPI_DB_REQUEST(c_db, id);
+	uint16_t se,sn;
+	uint32_t len;
+	int ret;
+
+	ret = mcapi_trans_recv_internal(index, &se, &sn, r->buffer, r->size, &len, 0);
+	if (ret && errno == EAGAIN && blocking) {
+		if (!l->unpack) {
+			len = r->size;
+			ret = sm_wait_nonblocking(index, re, cpu, r->buffer, &len, RECV, 0, timeout, 1);
+		} else {
+			l->rx_len = MCAPI_MAX_MSG_SIZE;
+			ret = sm_wait_recv_packet(index, re, cpu, &l->rx_se, &l->rx_sn,
+					l->rx_packet, &l->rx_len, timeout);
+			if (!ret)
+				mcapi_trans_unpack_packet_internal(index, r->buffer, r->size, &len);
+		}
+	}
+	if (ret)
+		return ret;
+	r->size = len;
+	return 0;
+}
+
+void mcapi_trans_msg_recv_prefetch(mcapi_endpoint_t receive_endpoint, mcapi_uint_t depth, mcapi_status_t* mcapi_status)
+{
+	uint16_t rd,rn,re;
+	int index;
+	endpoint_local* l;
+	prefetch_entry* ring = NULL;
+
+	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	l = &mcapi_ep_local[index];
+	if (l->ring_count) {
+		/* the prefetched messages would be lost */
+		*mcapi_status = MCAPI_PENDING;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
+	if (depth) {
+		ring = malloc(depth * sizeof(prefetch_entry));
+		if (!ring) {
+			*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+	}
+	free(l->ring);
+	l->ring = ring;
+	l->ring_depth = depth;
+	l->ring_head = 0;
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+/****************** receive dispatch ****************************/
+/* Workers of a dispatching endpoint never block in the driver together:
+   the first one that finds its queue empty becomes the reader, receives a
+   batch (blocking only for the first message) and sorts it into the worker
+   queues, while the others sleep on the condition of their own queue and
+   are woken one per message. With a routing key every worker has a queue
+   and a message goes to queue key % workers, otherwise all share one. */
+
+static dispatch_queue* mcapi_trans_dispatch_queue_internal(dispatch_state* d, mcapi_uint_t worker)
+{
+	return &d->queue[worker % d->queues];
+}
+
+/* free slots of the fullest queue: a batch can be sorted in whatever the keys */
+static int mcapi_trans_dispatch_room_internal(dispatch_state* d)
+{
+	int i, room = MCAPI_DISPATCH_DEPTH;
+
+	for (i = 0; i < d->queues; i++) {
+		if (MCAPI_DISPATCH_DEPTH - d->queue[i].count < room)
+			room = MCAPI_DISPATCH_DEPTH - d->queue[i].count;
+	}
+	return room;
+}
+
+/* receive up to room messages into d->stage, called without d->lock */
+static int mcapi_trans_dispatch_read_internal(int index, dispatch_state* d, int room)
+{
+	mcapi_boolean_t buffered;
+	prefetch_entry* e;
+	uint32_t len;
+	int n, ret = 0;
+
+	/* the unpack and prefetch state is used under the lock, which is
+	   dropped for the wait for the first message like mcapi_msg_recv()
+	   does; a plain endpoint is read without it */
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	buffered = mcapi_trans_recv_buffered_internal(index);
+	if (!buffered)
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	for (n = 0; n < room && !ret; n++) {
+		e = &d->stage[n];
+		len = MCAPI_MAX_MSG_SIZE;
+		if (!buffered)
+			ret = sm_recv_packet(index, &e->se, &e->sn, e->data, &len, n == 0);
+		else if (n == 0)
+			ret = mcapi_trans_recv_wait_internal(index, &e->se, &e->sn, e->data, MCAPI_MAX_MSG_SIZE, &len);
+		else
+			ret = mcapi_trans_recv_internal(index, &e->se, &e->sn, e->data, MCAPI_MAX_MSG_SIZE, &len, 0);
+		e->len = len;
+	}
+	if (buffered)
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	/* n counts the failed attempt too */
+	if (ret)
+		n--;
+	return n ? n : -1;
+}
+
+static void mcapi_trans_dispatch_route_internal(dispatch_state* d, int n)
+{
+	dispatch_queue* q;
+	uint32_t key;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		key = 0;
+		if (d->key_offset != MCAPI_DISPATCH_NO_KEY &&
+				d->key_offset + sizeof(key) <= d->stage[i].len)
+			memcpy(&key, d->stage[i].data + d->key_offset, sizeof(key));
+		q = mcapi_trans_dispatch_queue_internal(d, key);
+		q->q[(q->head + q->count) % MCAPI_DISPATCH_DEPTH] = d->stage[i];
+		q->count++;
+		if (q->waiting)
+			pthread_cond_signal(&q->cond);
+	}
+}
+
+/* with nobody reading, wake one worker that has nothing queued to read */
+static void mcapi_trans_dispatch_kick_internal(dispatch_state* d)
+{
+	int i;
+
+	if (d->reading)
+		return;
+	for (i = 0; i < d->queues; i++) {
+		if (d->queue[i].waiting && !d->queue[i].count) {
+			pthread_cond_signal(&d->queue[i].cond);
+			return;
+		}
+	}
+}
+
+/* d was taken from the endpoint with its lock held and d->users counted */
+static int mcapi_trans_dispatch_recv_internal(int index, dispatch_state* d, mcapi_uint_t worker,
+		uint16_t* se, uint16_t* sn, char* buffer, size_t buffer_size, uint32_t* len)
+{
+	dispatch_queue* q = mcapi_trans_dispatch_queue_internal(d, worker);
+	mcapi_boolean_t last;
+	prefetch_entry* e;
+	int n, room, err = 0;
+
+	pthread_mutex_lock(&d->lock);
+	while (!q->count && !d->dead) {
+		room = mcapi_trans_dispatch_room_internal(d);
+		if (d->reading || !room) {
+			q->waiting++;
+			pthread_cond_wait(&q->cond, &d->lock);
+			q->waiting--;
+			continue;
+		}
+		d->reading = MCAPI_TRUE;
+		pthread_mutex_unlock(&d->lock);
+		n = mcapi_trans_dispatch_read_internal(index, d, room);
+		err = errno;
+		pthread_mutex_lock(&d->lock);
+		d->reading = MCAPI_FALSE;
+		if (n < 0)
+			break;
+		if (!d->dead)
+			mcapi_trans_dispatch_route_internal(d, n);
+	}
+	if (d->dead) {
+		/* the endpoint is gone, with what was queued for it */
+		err = EINVAL;
+	} else if (q->count) {
+		e = &q->q[q->head];
+		memcpy(buffer, e->data, (e->len < buffer_size) ? e->len : buffer_size);
+		*len = e->len;
+		*se = e->se;
+		*sn = e->sn;
+		q->head = (q->head + 1) % MCAPI_DISPATCH_DEPTH;
+		q->count--;
+		err = 0;
+	}
+	/* hand the reading over before leaving */
+	mcapi_trans_dispatch_kick_internal(d);
+	d->users--;
+	last = d->dead && !d->users;
+	pthread_mutex_unlock(&d->lock);
+	if (last)
+		mcapi_trans_dispatch_destroy_internal(d);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static mcapi_uint_t mcapi_trans_dispatch_count_internal(dispatch_state* d)
+{
+	mcapi_uint_t n = 0;
+	int i;
+
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->queues; i++)
+		n += d->queue[i].count;
+	pthread_mutex_unlock(&d->lock);
+	return n;
+}
+
+static void mcapi_trans_dispatch_destroy_internal(dispatch_state* d)
+{
+	int i;
+
+	for (i = 0; i < d->queues; i++)
+		pthread_cond_destroy(&d->queue[i].cond);
+	pthread_mutex_destroy(&d->lock);
+	free(d);
+}
+
+/* false if workers are still using d */
+static mcapi_boolean_t mcapi_trans_dispatch_free_internal(dispatch_state* d)
+{
+	int i;
+
+	if (!d)
+		return MCAPI_TRUE;
+	pthread_mutex_lock(&d->lock);
+	for (i = 0; i < d->queues; i++) {
+		if (d->users || d->queue[i].count) {
+			pthread_mutex_unlock(&d->lock);
+			return MCAPI_FALSE;
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+	mcapi_trans_dispatch_destroy_internal(d);
+	return MCAPI_TRUE;
+}
+
+/* the endpoint of d is deleted: its workers are woken to leave with an
+   error, and the last one frees d; true if one of them is receiving
+   from the endpoint's session */
+static mcapi_boolean_t mcapi_trans_dispatch_close_internal(dispatch_state* d)
+{
+	mcapi_boolean_t reading, used;
+	int i;
+
+	if (!d)
+		return MCAPI_FALSE;
+	pthread_mutex_lock(&d->lock);
+	reading = d->reading;
+	used = (d->users != 0);
+	d->dead = MCAPI_TRUE;
+	for (i = 0; i < d->queues; i++)
+		pthread_cond_broadcast(&d->queue[i].cond);
+	pthread_mutex_unlock(&d->lock);
+	if (!used)
+		mcapi_trans_dispatch_destroy_internal(d);
+	return reading;
+}
+
+void mcapi_trans_msg_recv_dispatch(mcapi_endpoint_t receive_endpoint, mcapi_uint_t workers, size_t key_offset, mcapi_status_t* mcapi_status)
+{
+	uint16_t rd,rn,re;
+	int index, i;
+	uint16_t queues;
+	dispatch_state* d = NULL;
+
+	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+	if (workers) {
+		queues = (key_offset == MCAPI_DISPATCH_NO_KEY) ? 1 : workers;
+		d = calloc(1, sizeof(dispatch_state) + queues * sizeof(dispatch_queue));
+		if (!d) {
+			*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			return;
+		}
+		pthread_mutex_init(&d->lock, NULL);
+		for (i = 0; i < queues; i++)
+			pthread_cond_init(&d->queue[i].cond, NULL);
+		d->queues = queues;
+		d->key_offset = key_offset;
+	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	if (!mcapi_trans_dispatch_free_internal(mcapi_ep_local[index].dispatch)) {
+		/* queued messages would be lost, blocked workers left hanging */
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		mcapi_trans_dispatch_free_internal(d);
+		*mcapi_status = MCAPI_PENDING;
+		return;
+	}
+	mcapi_ep_local[index].dispatch = d;
+	*mcapi_status = MCAPI_SUCCESS;
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+}
+
+
+/****************** virtual endpoints ****************************/
+/* An endpoint created on a virtual port (MCAPI_VPORT_FIRST and up) has no
+   session of its own: the first one of a carrier opens the session on the
+   carrier's port, for the node that created it, and the last one closes
+   it. The messages for the carrier are sorted into the queues of its
+   endpoints by the channel in their header, which indexes chan[]. */
+
+/* the carrier of the virtual endpoint on port of node <d, n> in this
+   process, NULL if there is none */
+static mux_carrier* mcapi_trans_mux_carrier_internal(uint16_t d, uint16_t n, uint16_t port)
+{
+	mux_carrier* c = &mcapi_mux_carriers[MCAPI_VPORT_CARRIER(port)];
+	mcapi_route* route = mcapi_trans_route_internal(d, n);
+
+	if (!c->refs || !c->chan[MCAPI_VPORT_CHANNEL(port)] || !route ||
+			route->node_index != c->nindex + 1 || MCAPI_DB_DOMAIN_ROUTE(c_db, d) != c->dindex + 1)
+		return NULL;
+	return c;
+}
+
+/* a virtual endpoint on port of a node of this processor, of any process */
+static mcapi_boolean_t mcapi_trans_mux_exists_internal(mcapi_domain_t d, mcapi_uint_t n, mcapi_uint_t port)
+{
+	uint16_t nindex = mcapi_trans_get_node_index(d, n);
+
+	if (!MCAPI_VPORT_IS(port) || nindex == mcapi_limits.nodes)
+		return MCAPI_FALSE;
+	return (MCAPI_DB_PORT_MAP(c_db).used[port / 64] >>
+		(port % 64)) & 1;
+}
+
+/* creates the virtual endpoint on port, taken already, for the node self */
+static mcapi_boolean_t mcapi_trans_mux_create_internal(mcapi_local_node* self, uint16_t port)
+{
+	mux_carrier* c = &mcapi_mux_carriers[MCAPI_VPORT_CARRIER(port)];
+	mcapi_port_map* map = &MCAPI_DB_PORT_MAP(c_db);
+	mcapi_uint_t session_port = MCAPI_VPORT_SESSION(port);
+	mux_queue* q;
+	int index, taken;
+
+	q = calloc(1, sizeof(*q));
+	if (!q)
+		return MCAPI_FALSE;
+	pthread_cond_init(&q->cond, NULL);
+	pthread_mutex_lock(&c->lock);
+	/* the reader of a closed session has to be out of it first */
+	while (c->closing)
+		pthread_cond_wait(&c->idle, &c->lock);
+	if (c->refs && (c->dindex != self->dindex || c->nindex != self->nindex))
+		goto fail;
+	if (!c->refs) {
+		/* the carrier's port keeps other processes from opening it too */
+		index = mcapi_trans_session_claim_internal(&session_port);
+		if (index < 0) {
+			transport_sm_lock_db(c_db);
+			taken = mcapi_trans_port_take_internal(map, session_port);
+			transport_sm_unlock_db(c_db);
+			if (taken < 0)
+				goto fail;
+		}
+		index = mcapi_trans_endpoint_open_internal(self, session_port, MCAPI_FALSE, index);
+		if (index < 0) {
+			transport_sm_lock_db(c_db);
+			mcapi_trans_port_put_internal(map, session_port);
+			transport_sm_unlock_db(c_db);
+			goto fail;
+		}
+		c->index = index;
+		c->dindex = self->dindex;
+		c->nindex = self->nindex;
+	}
+	c->chan[MCAPI_VPORT_CHANNEL(port)] = q;
+	c->refs++;
+	pthread_mutex_unlock(&c->lock);
+	return MCAPI_TRUE;
+
+fail:
+	pthread_mutex_unlock(&c->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q);
+	return MCAPI_FALSE;
+}
+
+/* with nobody reading, wake a receiver to read; c->lock held */
+static void mcapi_trans_mux_kick_internal(mux_carrier* c)
+{
+	int i;
+
+	if (c->reading || c->full)
+		return;
+	for (i = 0; i < MCAPI_VPORT_CHANNELS / 64; i++) {
+		if (c->waiters[i]) {
+			pthread_cond_signal(&c->chan[i * 64 + __builtin_ctzll(c->waiters[i])]->cond);
+			return;
+		}
+	}
+}
+
+/* deletes the virtual endpoint on port, the carrier's session with the last one */
+static void mcapi_trans_mux_delete_internal(mux_carrier* c, uint16_t port)
+{
+	unsigned ch = MCAPI_VPORT_CHANNEL(port);
+	mux_queue* q;
+
+	pthread_mutex_lock(&c->lock);
+	q = c->chan[ch];
+	if (!q) {
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	/* messages still queued are dropped */
+	c->chan[ch] = NULL;
+	c->waiters[ch / 64] &= ~(1ULL << (ch % 64));
+	if (q->count == MCAPI_MUX_DEPTH)
+		c->full--;
+	transport_sm_lock_db(c_db);
+	mcapi_trans_port_put_internal(&MCAPI_DB_PORT_MAP(c_db), port);
+	transport_sm_unlock_db(c_db);
+	if (!--c->refs) {
+		/* a receiver reading with the lock dropped is woken by the
+		   shutdown, and clears closing once it is out of the driver */
+		c->closing = c->reading;
+		mcapi_trans_endpoint_close_internal(c->dindex, c->nindex, c->index, !c->reading);
+	} else {
+		mcapi_trans_mux_kick_internal(c);
+	}
+	/* receivers blocked on the queue leave with an error, the last one
+	   frees it */
+	q->dead = MCAPI_TRUE;
+	if (q->waiting) {
+		pthread_cond_broadcast(&q->cond);
+		q = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+	if (q) {
+		pthread_cond_destroy(&q->cond);
+		free(q);
+	}
+}
+
+/* deletes the virtual endpoints of a node */
+static void mcapi_trans_mux_remove_node_internal(uint16_t dindex, uint16_t nindex)
+{
+	mux_carrier* c;
+	int i, ch;
+
+	for (i = 0; i < MCAPI_VPORT_CARRIERS; i++) {
+		c = &mcapi_mux_carriers[i];
+		for (ch = 1; ch < MCAPI_VPORT_CHANNELS && c->refs &&
+				c->dindex == dindex && c->nindex == nindex; ch++) {
+			if (c->chan[ch])
+				mcapi_trans_mux_delete_internal(c, MCAPI_VPORT(i, ch));
+		}
+	}
+}
+
+/* sorts the packet in c->stage into the queue of its channel; c->lock held */
+static void mcapi_trans_mux_route_internal(mux_carrier* c)
+{
+	prefetch_entry* s = &c->stage;
+	unsigned dst, src;
+	size_t off = mcapi_mux_parse(s->data, s->len, &dst, &src);
+	mux_queue* q = off ? c->chan[dst] : NULL;
+	prefetch_entry* e;
+
+	if (!q) {
+		mcapi_dprintf(1, "%s: message for no virtual endpoint dropped\n", __func__);
+		return;
+	}
+	e = &q->q[(q->head + q->count) % MCAPI_MUX_DEPTH];
+	e->len = s->len - off;
+	memcpy(e->data, s->data + off, e->len);
+	/* a virtual sender is a channel of the carrier it sent from */
+	e->se = MCAPI_VPORT_IS(s->se) ? MCAPI_VPORT(MCAPI_VPORT_CARRIER(s->se), src) : s->se;
+	e->sn = s->sn;
+	if (++q->count == MCAPI_MUX_DEPTH)
+		c->full++;
+	if (q->waiting)
+		pthread_cond_signal(&q->cond);
+}
+
+/* reads a packet from the carrier's session and sorts it, c->lock held
+   but dropped while the driver is asked */
+static int mcapi_trans_mux_read_internal(mux_carrier* c, int blocking)
+{
+	uint32_t len = MCAPI_MAX_MSG_SIZE;
+	int ret, err;
+
+	c->reading = MCAPI_TRUE;
+	pthread_mutex_unlock(&c->lock);
+	ret = sm_recv_packet(c->index, &c->stage.se, &c->stage.sn, c->stage.data, &len, blocking);
+	err = errno;
+	pthread_mutex_lock(&c->lock);
+	c->reading = MCAPI_FALSE;
+	if (c->closing) {
+		/* its endpoints are gone, and the session with them */
+		c->closing = MCAPI_FALSE;
+		pthread_cond_broadcast(&c->idle);
+		errno = EINVAL;
+		return -1;
+	}
+	if (ret) {
+		errno = err;
+		return ret;
+	}
+	c->stage.len = (len < MCAPI_MAX_MSG_SIZE) ? len : MCAPI_MAX_MSG_SIZE;
+	mcapi_trans_mux_route_internal(c);
+	return 0;
+}
+
+/* sm_recv_packet() for the virtual endpoint on port of node <d, n> */
+static int mcapi_trans_mux_recv_internal(uint16_t d, uint16_t n, uint16_t port, uint16_t* se, uint16_t* sn,
+		char* buffer, size_t buffer_size, uint32_t* len, int blocking)
+{
+	mux_carrier* c = mcapi_trans_mux_carrier_internal(d, n, port);
+	unsigned ch = MCAPI_VPORT_CHANNEL(port);
+	prefetch_entry* e;
+	mux_queue* q;
+	int err = 0;
+
+	if (!c) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_mutex_lock(&c->lock);
+	while ((q = c->chan[ch]) && !q->count) {
+		if (c->reading || c->full) {
+			if (!blocking) {
+				err = EAGAIN;
+				break;
+			}
+			if (!q->waiting++)
+				c->waiters[ch / 64] |= 1ULL << (ch % 64);
+			pthread_cond_wait(&q->cond, &c->lock);
+			if (q->dead) {
+				/* deleted meanwhile, and no longer in waiters */
+				if (!--q->waiting) {
+					pthread_cond_destroy(&q->cond);
+					free(q);
+				}
+				q = NULL;
+				break;
+			}
+			if (!--q->waiting)
+				c->waiters[ch / 64] &= ~(1ULL << (ch % 64));
+			continue;
+		}
+		if (mcapi_trans_mux_read_internal(c, blocking)) {
+			err = errno;
+			/* it may have been deleted while the lock was dropped */
+			q = c->chan[ch];
+			break;
+		}
+	}
+	if (q && q->count) {
+		e = &q->q[q->head];
+		memcpy(buffer, e->data, (e->len < buffer_size) ? e->len : buffer_size);
+		*len = e->len;
+		*se = e->se;
+		*sn = e->sn;
+		if (q->count-- == MCAPI_MUX_DEPTH)
+			c->full--;
+		q->head = (q->head + 1) % MCAPI_MUX_DEPTH;
+		err = 0;
+	} else if (!q) {
+		err = EINVAL;
+	}
+	/* hand the reading over before leaving */
+	mcapi_trans_mux_kick_internal(c);
+	pthread_mutex_unlock(&c->lock);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* completes a pending receive request of a virtual endpoint; a driver
+   wait can't be bounded by a timeout, so a bounded one polls */
+static int mcapi_trans_mux_recv_request_internal(int id, mcapi_timeout_t timeout, int blocking)
+{
+	mcapi_request_data* r = &MCAPI_DB_REQUEST(c_db, id);
+	uint64_t start = mcapi_trans_now_us();
+	useconds_t backoff = MCAPI_GET_POLL_US;
+	uint16_t d, n, port, se, sn;
+	uint32_t len;
+	int ret;
+
+	mcapi_trans_decode_handle_internal(r->handle, &d, &n, &port);
+	if (blocking && timeout == MCAPI_TIMEOUT_INFINITE)
+		ret = mcapi_trans_mux_recv_internal(d, n, port, &se, &sn, r->buffer, r->size, &len, 1);
+	else {
+		while ((ret = mcapi_trans_mux_recv_internal(d, n, port, &se, &sn, r->buffer, r->size, &len, 0)) &&
+				errno == EAGAIN && blocking) {
+			if (!mcapi_trans_backoff_internal(start, timeout, &backoff)) {
+				errno = ETIMEDOUT;
+				break;
+			}
+		}
+	}
+	if (ret)
+		return ret;
+	r->size = len;
+	r->ep_endpoint = mcapi_trans_sender_handle_internal(sn, se);
+	return 0;
+}
+
+/* messages queued for the virtual endpoint on port of node <d, n>, after
+   sorting in what the carrier's session has */
+static mcapi_uint_t mcapi_trans_mux_available_internal(uint16_t d, uint16_t n, uint16_t port,
+		mcapi_status_t* mcapi_status)
+{
+	mux_carrier* c = mcapi_trans_mux_carrier_internal(d, n, port);
+	mcapi_uint_t avail = 0;
+	mux_queue* q;
+
+	if (!c) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return MCAPI_NULL;
+	}
+	pthread_mutex_lock(&c->lock);
+	while (!c->reading && !c->full && !mcapi_trans_mux_read_internal(c, 0))
+		;
+	q = c->chan[MCAPI_VPORT_CHANNEL(port)];
+	if (q)
+		avail = q->count;
+	mcapi_trans_mux_kick_internal(c);
+	pthread_mutex_unlock(&c->lock);
+	*mcapi_status = q ? MCAPI_SUCCESS : MCAPI_ERR_ENDP_INVALID;
+	return avail;
+}
+
+/* Sends a message from or to a virtual endpoint: it goes to the session
+   of the receiver's carrier with a mcapi_mux_header, from the session of
+   the sender or of its carrier. Only virtual endpoints receive such
+   messages, a plain one would take the header for part of the message. */
+static mcapi_status_t mcapi_trans_mux_send_internal(mcapi_endpoint_t send_endpoint,
+		mcapi_endpoint_t receive_endpoint, const char* buffer, size_t buffer_size, int blocking)
 {
-	int ret;
+	char packet[MCAPI_MAX_MSG_SIZE];
+	mcapi_mux_header* h = (mcapi_mux_header*)packet;
+	uint16_t sd,sn,se;
+	uint16_t rd,rn,re;
+	mux_carrier* c;
 	int index;
+	uint32_t payload;
 
-	index = mcapi_trans_get_port_index(node_num, port_num);
-	/* local endpoint */
-	if (index != MCAPI_MAX_ENDPOINTS) {
-		if (mcapi_trans_get_endpoint_internal(endpoint, node_num, port_num))
-			*mcapi_status = MCAPI_SUCCESS;
-		else
-			*mcapi_status = MCAPI_ERR_PARAMETER;
-		return MCAPI_TRUE;
-	}
-	ret = sm_get_remote_ep(port_num, node_num, timeout, 1);
-	if (ret) {
-		if (errno == ETIMEDOUT)
-			*mcapi_status = MCAPI_TIMEOUT;
-		else
-			*mcapi_status = MCAPI_ERR_GENERAL;
-		return MCAPI_FALSE;
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	if (!MCAPI_VPORT_IS(re))
+		return MCAPI_ERR_ENDP_INVALID;
+	if (buffer_size > sizeof(packet) - sizeof(*h))
+		return MCAPI_ERR_MSG_LIMIT;
+	if (MCAPI_VPORT_IS(se)) {
+		c = mcapi_trans_mux_carrier_internal(sd, sn, se);
+		if (!c)
+			return MCAPI_ERR_ENDP_INVALID;
+		index = c->index;
 	} else {
-		if (mcapi_trans_get_endpoint_internal(endpoint, node_num, port_num))
-			*mcapi_status = MCAPI_SUCCESS;
-		else
-			*mcapi_status = MCAPI_ERR_PARAMETER;
-	    return MCAPI_TRUE;
+		index = mcapi_trans_get_port_index(sd, sn, se);
+		if (index >= mcapi_limits.endpoints)
+			return MCAPI_ERR_ENDP_INVALID;
 	}
+	h->magic = MCAPI_MUX_MAGIC;
+	h->dst = MCAPI_VPORT_CHANNEL(re);
+	h->src = MCAPI_VPORT_IS(se) ? MCAPI_VPORT_CHANNEL(se) : 0;
+	memcpy(packet + sizeof(*h), buffer, buffer_size);
+	if (!sm_send_packet(index, MCAPI_VPORT_SESSION(re), mcapi_trans_route_cpu_internal(rd, rn),
+			packet, sizeof(*h) + buffer_size, &payload, blocking))
+		return MCAPI_SUCCESS;
+	if (errno == EAGAIN)
+		return MCAPI_ERR_MEM_LIMIT;
+	if (errno == ETIMEDOUT)
+		return MCAPI_TIMEOUT;
+	return MCAPI_ERR_TRANSMISSION;
 }
 
-mcapi_boolean_t mcapi_trans_endpoint_exists(mcapi_uint_t port_num)
+
+/****************** send combining ****************************/
+/* Blocking sends of all threads sharing an endpoint are pushed on a lock free
+   list. Whichever thread finds the endpoint idle becomes the combiner and
+   hands every queued message to the transport in sm_send_packets() batches,
+   the others sleep on a futex until their slot is marked done. Taking the
+   whole list with one exchange means pushes never see a recycled head (no
+   ABA). */
+
+/* send_slot.done: queued, queued with its sender asleep, sent */
+#define SLOT_QUEUED 0
+#define SLOT_SLEEPING 1
+#define SLOT_DONE 2
+
+static void mcapi_trans_combine_run_internal(int index)
 {
-	return MCAPI_FALSE;
+	endpoint_local* l = &mcapi_ep_local[index];
+	struct sm_send_desc desc[MCAPI_COMBINE_BATCH];
+	send_slot* batch[MCAPI_COMBINE_BATCH];
+	send_slot *list, *fifo, *next;
+	int n, i;
+
+	while ((list = __sync_lock_test_and_set(&l->combine_head, NULL)) != NULL) {
+		/* the list is newest first, submit in arrival order */
+		for (fifo = NULL; list; list = next) {
+			next = list->next;
+			list->next = fifo;
+			fifo = list;
+		}
+		while (fifo) {
+			for (n = 0; fifo && n < MCAPI_COMBINE_BATCH; fifo = fifo->next, n++) {
+				batch[n] = fifo;
+				desc[n] = fifo->desc;
+			}
+			sm_send_packets(index, desc, n, 1);
+			/* a slot lives on its sender's stack: don't touch it once
+			   done, waking only needs the address */
+			for (i = 0; i < n; i++) {
+				batch[i]->desc.err = desc[i].err;
+				if (__sync_lock_test_and_set(&batch[i]->done, SLOT_DONE) == SLOT_SLEEPING)
+					syscall(SYS_futex, &batch[i]->done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+			}
+		}
+	}
 }
 
-/* delete the given endpoint */
-void mcapi_trans_endpoint_delete( mcapi_endpoint_t endpoint)
+/* combines as long as there are queued sends and nobody else does; a slot
+   pushed while the last combiner was on its way out is seen either by it
+   or by the slot's sender, who finds the endpoint idle */
+static void mcapi_trans_combine_internal(int index)
 {
-	uint16_t d,n,e;
-	uint16_t nindex, index;
-	assert(mcapi_trans_decode_handle_internal(endpoint,&d,&n,&e));
-
-	nindex = mcapi_trans_get_node_index(n);
-	if (nindex ==MCA_MAX_NODES)
-		return;
-	index = mcapi_trans_get_port_index(n, e);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
-		return;
+	endpoint_local* l = &mcapi_ep_local[index];
+
+	while (__sync_lock_test_and_set(&l->combining, 1) == 0) {
+		mcapi_trans_combine_run_internal(index);
+		__sync_lock_release(&l->combining);
+		__sync_synchronize();
+		if (!l->combine_head)
+			break;
 	}
-	memset (&c_db->domains[0].nodes[nindex].node_d.endpoints[index],0,sizeof(endpoint_entry));
+}
 
-	sm_destroy_session(index);
+/* blocking sends of the count slots through the endpoint's combiner, in
+   order; returns once all are done, each with its desc.err */
+static void mcapi_trans_combine_push_internal(int index, send_slot* slots, int count)
+{
+	endpoint_local* l = &mcapi_ep_local[index];
+	send_slot* head;
+	int i;
+
+	/* the list is newest first: chain the slots last to first */
+	for (i = 0; i < count; i++) {
+		slots[i].desc.err = 0;
+		slots[i].done = SLOT_QUEUED;
+		if (i)
+			slots[i].next = &slots[i - 1];
+	}
+	do {
+		head = l->combine_head;
+		slots[0].next = head;
+	} while (!__sync_bool_compare_and_swap(&l->combine_head, head, &slots[count - 1]));
+
+	/* the combiner may have finished just before our push, so whoever
+	   still waits tries to take over before going to sleep */
+	for (i = 0; i < count; i++) {
+		while (slots[i].done != SLOT_DONE) {
+			mcapi_trans_combine_internal(index);
+			if (__sync_bool_compare_and_swap(&slots[i].done, SLOT_QUEUED, SLOT_SLEEPING) ||
+					slots[i].done == SLOT_SLEEPING)
+				syscall(SYS_futex, &slots[i].done, FUTEX_WAIT_PRIVATE, SLOT_SLEEPING, NULL, NULL, 0);
+		}
+	}
+	__sync_synchronize();
 }
 
+/* blocking send through the endpoint's combiner, returns 0 or -1 with errno */
+static int mcapi_trans_combine_send_internal(int index, uint16_t re, uint16_t cpu,
+		char* buffer, size_t buffer_size)
+{
+	send_slot slot;
+
+	slot.desc.buf = buffer;
+	slot.desc.len = buffer_size;
+	slot.desc.dst_ep = re;
+	slot.desc.dst_cpu = cpu;
+	mcapi_trans_combine_push_internal(index, &slot, 1);
+	if (slot.desc.err) {
+		errno = slot.desc.err;
+		return -1;
+	}
+	return 0;
+}
 
+/****************** shared buffers ****************************/
+/* Buffers of mcapi_buffer_alloc(), per process. Uncached ones are used as
+   they are; cached ones go through the CPU caches and are handed between
+   the cores with mcapi_buffer_sync_for_device()/_cpu(). */
+typedef struct {
+	char* base;		/* NULL when the entry is free */
+	uint32_t size;
+	uint32_t paddr;
+	mcapi_boolean_t cached;
+} mcapi_shared_alloc;
+
+static mcapi_shared_alloc mcapi_buffers[MCAPI_BUFFERS_MAX];
+static pthread_mutex_t mcapi_buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void* mcapi_trans_shared_request_internal(mcapi_boolean_t cached, uint32_t size, uint32_t* paddr)
+{
+	return cached ? sm_request_cached_buf(size, paddr) : sm_request_uncached_buf(size, paddr);
+}
 
-/* get the attribute for the given endpoint and attribute_num */
-void mcapi_trans_endpoint_get_attribute( mcapi_endpoint_t endpoint, mcapi_uint_t attribute_num, void* attribute, size_t attribute_size)
+static inline void mcapi_trans_shared_release_internal(mcapi_boolean_t cached, void* base, uint32_t size, uint32_t paddr)
 {
+	if (cached)
+		sm_release_cached_buf(base, size, paddr);
+	else
+		sm_release_uncached_buf(base, size, paddr);
 }
 
+void mcapi_trans_buffer_alloc(size_t size, mcapi_boolean_t cached, void** buffer, mcapi_uint_t* paddr,
+		mcapi_status_t* mcapi_status)
+{
+	mcapi_shared_alloc* a = NULL;
+	int i;
 
+	if (cached && !sm_have_cached_buf()) {
+		*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+		return;
+	}
+	pthread_mutex_lock(&mcapi_buffers_lock);
+	for (i = 0; i < MCAPI_BUFFERS_MAX && !a; i++) {
+		if (!mcapi_buffers[i].base)
+			a = &mcapi_buffers[i];
+	}
+	if (a)
+		a->base = mcapi_trans_shared_request_internal(cached, size, &a->paddr);
+	if (!a || !a->base) {
+		pthread_mutex_unlock(&mcapi_buffers_lock);
+		*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+		return;
+	}
+	a->size = size;
+	a->cached = cached;
+	*buffer = a->base;
+	*paddr = a->paddr;
+	pthread_mutex_unlock(&mcapi_buffers_lock);
+	*mcapi_status = MCAPI_SUCCESS;
+}
 
-/* set the given attribute on the given endpoint */
-void mcapi_trans_endpoint_set_attribute( mcapi_endpoint_t endpoint, mcapi_uint_t attribute_num, const void* attribute, size_t attribute_size)
+/* the buffer holding [p, p + size), NULL if none; the buffers should
+   already be locked */
+static mcapi_shared_alloc* mcapi_trans_buffer_find_internal(const char* p, size_t size)
 {
+	int i;
+
+	for (i = 0; i < MCAPI_BUFFERS_MAX; i++) {
+		if (mcapi_buffers[i].base && p >= mcapi_buffers[i].base &&
+				p + size <= mcapi_buffers[i].base + mcapi_buffers[i].size)
+			return &mcapi_buffers[i];
+	}
+	return NULL;
 }
 
-mcapi_boolean_t mcapi_trans_node_set_attribute(
-		mcapi_node_attributes_t* mcapi_node_attributes,
-		mcapi_uint_t attribute_num,
-		const void* attribute,
-		size_t attribute_size,
-		mcapi_status_t* mcapi_status
-		){
-	mcapi_boolean_t rc = MCAPI_FALSE;
+void mcapi_trans_buffer_free(void* buffer, mcapi_status_t* mcapi_status)
+{
+	mcapi_shared_alloc* a;
 
-	if (attribute_num != MCAPI_NODE_ATTR_TYPE_REGULAR) {
-		/* only the node_attr_type attribute is currently supported */
-		*mcapi_status = MCAPI_ERR_ATTR_NOTSUPPORTED;
-	} else if (attribute_size != sizeof(mcapi_node_attr_type_t) ) {
-		*mcapi_status = MCAPI_ERR_ATTR_SIZE;
+	pthread_mutex_lock(&mcapi_buffers_lock);
+	a = mcapi_trans_buffer_find_internal(buffer, 0);
+	if (!a || a->base != buffer) {
+		*mcapi_status = MCAPI_ERR_PARAMETER;
 	} else {
-		rc = MCAPI_TRUE;
-		/* copy the attribute into the attributes data structure */
-		memcpy(&mcapi_node_attributes->entries[attribute_num].attribute_d,
-				attribute,
-				attribute_size);
+		mcapi_trans_shared_release_internal(a->cached, a->base, a->size, a->paddr);
+		a->base = NULL;
+		*mcapi_status = MCAPI_SUCCESS;
 	}
-	return rc;
+	pthread_mutex_unlock(&mcapi_buffers_lock);
 }
 
-mcapi_boolean_t mcapi_trans_node_get_attribute(
-		mcapi_domain_t domain_id,
-		mcapi_node_t node_id,
-		mcapi_uint_t attribute_num,
-		void* attribute,
-		size_t attribute_size,
-		mcapi_status_t* mcapi_status) {
-	mcapi_boolean_t rc = MCAPI_FALSE;
-	mcapi_boolean_t found_node = MCAPI_FALSE;
-	mcapi_boolean_t found_domain = MCAPI_FALSE;
-	uint32_t d,n;
-	size_t size;
-	mcapi_database *mcapi_db = c_db;
+void mcapi_trans_buffer_sync(void* buffer, size_t size, mcapi_boolean_t for_device, mcapi_status_t* mcapi_status)
+{
+	mcapi_shared_alloc* a;
+	uint32_t paddr;
+	int ret = 0;
+
+	pthread_mutex_lock(&mcapi_buffers_lock);
+	a = mcapi_trans_buffer_find_internal(buffer, size);
+	if (!a) {
+		pthread_mutex_unlock(&mcapi_buffers_lock);
+		*mcapi_status = MCAPI_ERR_PARAMETER;
+		return;
+	}
+	paddr = a->paddr + ((char*)buffer - a->base);
+	/* the buffer may be freed once the lock is dropped, that is the
+	   caller's race; an uncached one needs nothing */
+	if (a->cached) {
+		pthread_mutex_unlock(&mcapi_buffers_lock);
+		ret = for_device ? sm_sync_for_device(buffer, size, paddr) : sm_sync_for_cpu(buffer, size, paddr);
+	} else {
+		pthread_mutex_unlock(&mcapi_buffers_lock);
+	}
+	*mcapi_status = ret ? MCAPI_ERR_GENERAL : MCAPI_SUCCESS;
+}
 
-	// look for the <domain,node>
-	for (d = 0; ((d < MCA_MAX_DOMAINS) && (found_domain == MCAPI_FALSE)); d++) {
-		if (mcapi_db->domains[d].domain_id == domain_id) {
-			found_domain = MCAPI_TRUE;
-			for (n = 0; ((n < MCA_MAX_NODES) &&  (found_node == MCAPI_FALSE)); n++) {
-				if (mcapi_db->domains[d].nodes[n].node_num == node_id) { 
-					found_node = MCAPI_TRUE;
-					if (!mcapi_db->domains[d].valid) {
-						*mcapi_status = MCAPI_ERR_DOMAIN_INVALID;
-					} else if (!mcapi_db->domains[d].nodes[n].valid) {
-						*mcapi_status = MCAPI_ERR_NODE_INVALID;
-					} else {
-						size = mcapi_db->domains[d].nodes[n].attributes.entries[attribute_num].bytes;
-						if (size != attribute_size) {
-							*mcapi_status = MCAPI_ERR_ATTR_SIZE;
-						} else {
-							memcpy(attribute,
-									&mcapi_db->domains[d].nodes[n].attributes.entries[attribute_num].attribute_d,
-									size);
-							rc = MCAPI_TRUE;
-						}
-					}
-				}
-			}
+/****************** fan-out ****************************/
+/* mcapi_msg_send_multi() stages a payload for receivers on other cores once
+   in shared memory and sends each of them a mcapi_shared_ref to it (see
+   mcapi_frame.h), so the transport copies a few bytes per receiver rather
+   than the payload. It does so only when asked to with MCAPI_MULTI_SHARED,
+   as a receiver that does not decode references would take one for the
+   payload. There is a staging area of MCAPI_SHARED_SLOTS slots per
+   memory type, one driver buffer requested with the first fan-out of a send
+   endpoint of that type (see MCAPI_ENDP_ATTR_MEMORY_TYPE): uncached, or
+   cached and synced per slot. A slot is free again once every receiver has
+   set its done byte, which is checked when a slot is needed; a receiver
+   may read it until then, so it is never taken back before. A cached
+   slot is written back once staged and invalidated before its done bytes
+   are read; it is not checked while filling, as the invalidate would drop
+   what the sender has not written back yet. Receivers on
+   this processor, and all of them when no slot is free, get the payload as
+   a plain message. */
+typedef struct {
+	pthread_mutex_t lock;
+	mcapi_boolean_t cached;
+	char* base;		/* NULL until the first fan-out */
+	uint32_t paddr;
+	uint32_t busy;		/* slots in use */
+	uint32_t filling;	/* busy slots whose fan-out is still being sent */
+	uint16_t lost[MCAPI_SHARED_SLOTS];	/* done bytes of references that were not sent */
+	mcapi_boolean_t failed;	/* the driver had no buffer */
+} mcapi_shared_pool;
+
+static mcapi_shared_pool mcapi_shared_pools[2] = {
+	{ .lock = PTHREAD_MUTEX_INITIALIZER },
+	{ .lock = PTHREAD_MUTEX_INITIALIZER, .cached = MCAPI_TRUE },
+};
+
+static inline mcapi_shared_buffer* mcapi_trans_shared_slot_internal(mcapi_shared_pool* pool, int slot)
+{
+	return (mcapi_shared_buffer*)(pool->base + slot * MCAPI_SHARED_SLOT_SIZE);
+}
+
+/* makes len bytes of slot from offset visible to the other cores, or
+   theirs to this one; nothing to do for an uncached pool */
+static inline void mcapi_trans_shared_sync_internal(mcapi_shared_pool* pool, int slot,
+		size_t offset, size_t len, mcapi_boolean_t for_device)
+{
+	char* p = (char*)mcapi_trans_shared_slot_internal(pool, slot) + offset;
+	uint32_t paddr = pool->paddr + slot * MCAPI_SHARED_SLOT_SIZE + offset;
+
+	if (!pool->cached)
+		return;
+	if (for_device)
+		sm_sync_for_device(p, len, paddr);
+	else
+		sm_sync_for_cpu(p, len, paddr);
+}
+
+/* a slot whose receivers are all done, set up for count new ones; -1 when
+   there is none */
+static int mcapi_trans_shared_take_internal(mcapi_shared_pool* pool, uint32_t count)
+{
+	mcapi_shared_buffer* b;
+	uint32_t busy;
+	int slot, i;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!pool->base && !pool->failed) {
+		pool->base = mcapi_trans_shared_request_internal(pool->cached,
+			MCAPI_SHARED_SLOTS * MCAPI_SHARED_SLOT_SIZE, &pool->paddr);
+		pool->failed = !pool->base;
+	}
+	if (!pool->base) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	if (!~pool->busy) {
+		/* the receivers release them, look for one that is done */
+		for (busy = pool->busy & ~pool->filling; busy; busy &= busy - 1) {
+			slot = __builtin_ctz(busy);
+			b = mcapi_trans_shared_slot_internal(pool, slot);
+			mcapi_trans_shared_sync_internal(pool, slot, 0, sizeof(*b), MCAPI_FALSE);
+			for (i = 0; i < b->count && (b->done[i] || (pool->lost[slot] >> i & 1)); i++)
+				;
+			if (i == b->count)
+				pool->busy &= ~(1u << slot);
 		}
 	}
-	if (!found_domain) {
-		*mcapi_status = MCAPI_ERR_DOMAIN_INVALID;
-	} else if (!found_node) {
-		*mcapi_status = MCAPI_ERR_NODE_INVALID;
+	slot = ~pool->busy ? __builtin_ctz(~pool->busy) : -1;
+	if (slot >= 0) {
+		pool->busy |= 1u << slot;
+		pool->filling |= 1u << slot;
+		b = mcapi_trans_shared_slot_internal(pool, slot);
+		b->count = count;
+		memset((void*)b->done, 0, sizeof(b->done));
 	}
-	return rc;
+	pthread_mutex_unlock(&pool->lock);
+	return slot;
 }
 
-mcapi_boolean_t mcapi_trans_node_init_attributes(
-		mcapi_node_attributes_t* mcapi_node_attributes,
-		mcapi_status_t* mcapi_status
-		) {
-	mcapi_boolean_t rc = MCAPI_TRUE;
-	/* default values are all 0 */
-	memset(mcapi_node_attributes,0,sizeof(mcapi_node_attributes));
-	return rc;
+/* the fan-out of slot has been sent, its receivers may release it; lost
+   has a bit for every reference nobody will release as it was not sent.
+   These are kept here rather than in done[], which the sender does not
+   write once the slot is staged: for a cached one that would mean writing
+   back a line the receivers write to. */
+static void mcapi_trans_shared_put_internal(mcapi_shared_pool* pool, int slot, uint16_t lost)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->filling &= ~(1u << slot);
+	pool->lost[slot] = lost;
+	pthread_mutex_unlock(&pool->lock);
 }
 
+/* gives the staging areas and the buffers back to the driver, with the
+   last node */
+static void mcapi_trans_shared_free_internal(void)
+{
+	mcapi_shared_pool* pool;
+	int i;
 
+	for (i = 0; i < 2; i++) {
+		pool = &mcapi_shared_pools[i];
+		pthread_mutex_lock(&pool->lock);
+		if (pool->base)
+			mcapi_trans_shared_release_internal(pool->cached, pool->base,
+				MCAPI_SHARED_SLOTS * MCAPI_SHARED_SLOT_SIZE, pool->paddr);
+		pool->base = NULL;
+		pool->busy = 0;
+		pool->filling = 0;
+		pool->failed = MCAPI_FALSE;
+		pthread_mutex_unlock(&pool->lock);
+	}
+	pthread_mutex_lock(&mcapi_buffers_lock);
+	for (i = 0; i < MCAPI_BUFFERS_MAX; i++) {
+		if (mcapi_buffers[i].base)
+			mcapi_trans_shared_release_internal(mcapi_buffers[i].cached, mcapi_buffers[i].base,
+				mcapi_buffers[i].size, mcapi_buffers[i].paddr);
+		mcapi_buffers[i].base = NULL;
+	}
+	pthread_mutex_unlock(&mcapi_buffers_lock);
+}
 
 /****************** msgs **********************************/
 
@@ -1150,6 +4472,7 @@ void mcapi_trans_msg_send_i( mcapi_endpoint_t  send_endpoint, mcapi_endpoint_t
 	int index;
 	int id;
 	uint32_t payload;
+	mcapi_boolean_t held = MCAPI_FALSE;
 	mcapi_database* mcapi_db = c_db;
 	
 	if (!mcapi_trans_reserve_request(&id)) {
@@ -1160,30 +4483,102 @@ void mcapi_trans_msg_send_i( mcapi_endpoint_t  send_endpoint, mcapi_endpoint_t
 
 	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(sn, se);
+	if (MCAPI_VPORT_IS(se) || MCAPI_VPORT_IS(re)) {
+		/* posted or refused right away */
+		*mcapi_status = mcapi_trans_mux_send_internal(send_endpoint, receive_endpoint, buffer, buffer_size, 0);
+		if (*mcapi_status != MCAPI_SUCCESS) {
+			mcapi_trans_remove_request(id);
+			return;
+		}
+		setup_request_internal(send_endpoint, receive_endpoint, request, NULL, buffer_size, 0, SEND);
+		MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_TRUE;
+		return;
+	}
+	index = mcapi_trans_get_port_index(sd, sn, se);
 
 	mcapi_dprintf(1,"index %d, se %d, sn %d req id:%d \n", index, se, sn, id);
 
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		return;
 	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+
+	if (mcapi_ep_local[index].co_buf) {
+		*mcapi_status = mcapi_trans_coalesce_add_internal(index, receive_endpoint, buffer, buffer_size, 0);
+		if (*mcapi_status == MCAPI_SUCCESS) {
+			setup_request_internal(send_endpoint, receive_endpoint, request, NULL, buffer_size, 0, SEND);
+			MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_TRUE;
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+		if (*mcapi_status != MCAPI_PENDING) {
+			mcapi_trans_remove_request(id);
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+	}
+
+	if (mcapi_ep_local[index].backlog) {
+		/* keep the order: older backlogged messages go first */
+		mcapi_trans_backlog_drain_internal(index);
+		if (mcapi_ep_local[index].backlog_count || !mcapi_trans_credit_take_internal(index, &held)) {
+			setup_request_internal(send_endpoint, receive_endpoint, request, NULL, buffer_size, 0, SEND);
+			if (mcapi_trans_backlog_push_internal(index, receive_endpoint, buffer, buffer_size, id)) {
+				*mcapi_status = MCAPI_SUCCESS;
+			} else {
+				mcapi_trans_remove_request(id);
+				*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+			}
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return;
+		}
+	} else if (!(held = mcapi_trans_credit_take_now_internal(index)) && !mcapi_ep_local[index].credit_unknown &&
+		(mcapi_ep_local[index].memory_type & MCAPI_ENDP_ATTR_FAIL_ON_MEM_LIMIT)) {
+		/* no free slot on the transport, the send could only fail */
+		mcapi_trans_remove_request(id);
+		*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
 
-	ret = sm_send_packet(index, re, rn, buffer, buffer_size, &payload, 0);
+	ret = sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), buffer, buffer_size, &payload, 0);
+	if (ret && errno == EAGAIN && mcapi_ep_local[index].backlog) {
+		/* the credit was stale, queue the message instead */
+		mcapi_trans_credit_set_internal(index, 0);
+		setup_request_internal(send_endpoint, receive_endpoint, request, NULL, buffer_size, 0, SEND);
+		mcapi_trans_backlog_push_internal(index, receive_endpoint, buffer, buffer_size, id);
+		*mcapi_status = MCAPI_SUCCESS;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
+	if (ret && errno == EAGAIN && (mcapi_ep_local[index].memory_type & MCAPI_ENDP_ATTR_FAIL_ON_MEM_LIMIT)) {
+		/* the credit was stale, fail like an endpoint without credit */
+		mcapi_trans_credit_set_internal(index, 0);
+		mcapi_trans_remove_request(id);
+		*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return;
+	}
 	if (ret) {
 		if (errno == EAGAIN) {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_PENDING;
 		} else {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_ERR_TRANSMISSION;
 		}
+		/* the transport is full, re-read the window before the next send */
+		mcapi_trans_credit_set_internal(index, 0);
 	} else {
-		mcapi_db->requests[*request].completed = MCAPI_TRUE;
+		MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_TRUE;
 		*mcapi_status = MCAPI_SUCCESS;
 	}
 
 	setup_request_internal(send_endpoint, receive_endpoint, request, NULL, buffer_size, payload, SEND);
+	MCAPI_DB_REQUEST(mcapi_db, *request).credit = held &&
+		(*mcapi_status == MCAPI_SUCCESS || *mcapi_status == MCAPI_PENDING);
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
 }
 
 mcapi_boolean_t mcapi_trans_msg_send( mcapi_endpoint_t  send_endpoint, mcapi_endpoint_t  receive_endpoint, char* buffer, size_t buffer_size, mcapi_status_t* mcapi_status)
@@ -1192,18 +4587,45 @@ mcapi_boolean_t mcapi_trans_msg_send( mcapi_endpoint_t  send_endpoint, mcapi_end
 	uint16_t rd,rn,re;
 	int ret;
 	int index;
+	mcapi_boolean_t held;
 
 	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	if (MCAPI_VPORT_IS(se) || MCAPI_VPORT_IS(re)) {
+		*mcapi_status = mcapi_trans_mux_send_internal(send_endpoint, receive_endpoint, buffer, buffer_size, 1);
+		return (*mcapi_status == MCAPI_SUCCESS);
+	}
 
-	index = mcapi_trans_get_port_index(sn, se);
+	index = mcapi_trans_get_port_index(sd, sn, se);
 
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		return MCAPI_FALSE;
 	}
 
-	ret = sm_send_packet(index, re, rn, buffer, buffer_size, NULL, 1);
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	if (mcapi_ep_local[index].co_buf) {
+		*mcapi_status = mcapi_trans_coalesce_add_internal(index, receive_endpoint, buffer, buffer_size, 1);
+		if (*mcapi_status != MCAPI_PENDING) {
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			return (*mcapi_status == MCAPI_SUCCESS);
+		}
+	}
+
+	/* messages still in the backlog go out first */
+	if (mcapi_ep_local[index].backlog_count)
+		mcapi_trans_backlog_flush_internal(index, -1, MCAPI_TIMEOUT_INFINITE);
+
+	/* a blocking send waits for a slot in the driver, so it only holds
+	   credit when there is some, until it returns */
+	held = mcapi_trans_credit_hold_internal(index);
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	ret = mcapi_trans_combine_send_internal(index, re, mcapi_trans_route_cpu_internal(rd, rn), buffer, buffer_size);
+	if (held) {
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		mcapi_trans_credit_put_internal(index);
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	}
 	if (ret) {
 		if (errno == ETIMEDOUT)
 			*mcapi_status = MCAPI_TIMEOUT;
@@ -1217,16 +4639,143 @@ mcapi_boolean_t mcapi_trans_msg_send( mcapi_endpoint_t  send_endpoint, mcapi_end
 }
 
 
+/* sends to the receive endpoints whose statuses are MCAPI_SUCCESS,
+   setting them to the outcome */
+void mcapi_trans_msg_send_multi(mcapi_endpoint_t send_endpoint, const mcapi_endpoint_t* receive_endpoints,
+		mcapi_uint_t count, char* buffer, size_t buffer_size, mcapi_uint_t flags,
+		mcapi_status_t* statuses, mcapi_status_t* mcapi_status)
+{
+	uint16_t sd,sn,se;
+	uint16_t rd,rn,re;
+	uint16_t cpu;
+	int index, slot = -1;
+	mcapi_uint_t i, n, remote, held, refs_sent = 0;
+	send_slot* slots;
+	mcapi_uint_t* which;
+	mcapi_shared_ref* refs;
+	mcapi_shared_buffer* b = NULL;
+	mcapi_shared_pool* pool;
+	uint16_t lost = 0;
+
+	*mcapi_status = MCAPI_SUCCESS;
+	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
+	if (MCAPI_VPORT_IS(se)) {
+		/* a virtual endpoint frames every message anyway */
+		for (i = 0; i < count; i++) {
+			if (statuses[i] == MCAPI_SUCCESS)
+				mcapi_trans_msg_send(send_endpoint, receive_endpoints[i], buffer, buffer_size, &statuses[i]);
+			if (statuses[i] != MCAPI_SUCCESS)
+				*mcapi_status = MCAPI_ERR_GENERAL;
+		}
+		return;
+	}
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
+		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+		return;
+	}
+
+	slots = malloc(count * (sizeof(*slots) + sizeof(*which) + sizeof(*refs)));
+	if (!slots) {
+		*mcapi_status = MCAPI_ERR_MEM_LIMIT;
+		return;
+	}
+	which = (mcapi_uint_t*)(slots + count);
+	refs = (mcapi_shared_ref*)(which + count);
+	/* the memory type of the send endpoint picks the staging area */
+	pool = &mcapi_shared_pools[(mcapi_ep_local[index].memory_type & 0xffff) ==
+		MCAPI_ENDP_ATTR_SHARED_CACHED_MEMORY];
+
+	/* a reference only saves copies when several receivers share it */
+	for (i = 0, remote = 0; i < count; i++) {
+		assert(mcapi_trans_decode_handle_internal(receive_endpoints[i],&rd,&rn,&re));
+		if (statuses[i] == MCAPI_SUCCESS && !MCAPI_VPORT_IS(re) &&
+				mcapi_trans_route_cpu_internal(rd, rn) != MASTER_NODE_NUM)
+			remote++;
+	}
+	if ((flags & MCAPI_MULTI_SHARED) && remote > 1 && buffer_size >= MCAPI_SHARED_MIN)
+		slot = mcapi_trans_shared_take_internal(pool,
+			(remote < MCAPI_SHARED_CONSUMERS) ? remote : MCAPI_SHARED_CONSUMERS);
+	if (slot >= 0) {
+		b = mcapi_trans_shared_slot_internal(pool, slot);
+		b->size = buffer_size;
+		if (pool->cached) {
+			memcpy(MCAPI_SHARED_PAYLOAD(b), buffer, buffer_size);
+			mcapi_trans_shared_sync_internal(pool, slot, 0, sizeof(*b) + buffer_size, MCAPI_TRUE);
+		} else {
+			sm_copy_to_uncached(MCAPI_SHARED_PAYLOAD(b), buffer, buffer_size);
+		}
+	}
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (statuses[i] != MCAPI_SUCCESS)
+			continue;
+		assert(mcapi_trans_decode_handle_internal(receive_endpoints[i],&rd,&rn,&re));
+		if (MCAPI_VPORT_IS(re)) {
+			mcapi_trans_msg_send(send_endpoint, receive_endpoints[i], buffer, buffer_size, &statuses[i]);
+			continue;
+		}
+		cpu = mcapi_trans_route_cpu_internal(rd, rn);
+		slots[n].desc.dst_ep = re;
+		slots[n].desc.dst_cpu = cpu;
+		if (b && cpu != MASTER_NODE_NUM && refs_sent < b->count) {
+			refs[n].magic = MCAPI_SHARED_MAGIC;
+			refs[n].slot = refs_sent++;
+			refs[n].flags = pool->cached ? MCAPI_SHARED_CACHED : 0;
+			refs[n].paddr = pool->paddr + slot * MCAPI_SHARED_SLOT_SIZE;
+			slots[n].desc.buf = &refs[n];
+			slots[n].desc.len = sizeof(refs[n]);
+		} else {
+			slots[n].desc.buf = buffer;
+			slots[n].desc.len = buffer_size;
+		}
+		which[n++] = i;
+	}
+	/* the staged payload is complete before the first reference leaves */
+	__sync_synchronize();
+
+	if (n) {
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		if (mcapi_ep_local[index].co_buf)
+			mcapi_trans_coalesce_flush_internal(index, 1, COALESCE_BEFORE);
+		if (mcapi_ep_local[index].backlog_count)
+			mcapi_trans_backlog_flush_internal(index, -1, MCAPI_TIMEOUT_INFINITE);
+		for (held = 0; held < n && mcapi_trans_credit_hold_internal(index); held++)
+			;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		mcapi_trans_combine_push_internal(index, slots, n);
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		while (held--)
+			mcapi_trans_credit_put_internal(index);
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!slots[i].desc.err)
+			continue;
+		statuses[which[i]] = (slots[i].desc.err == ETIMEDOUT) ? MCAPI_TIMEOUT : MCAPI_ERR_GENERAL;
+		if (slots[i].desc.buf == &refs[i])
+			lost |= 1u << refs[i].slot;
+	}
+	if (b)
+		mcapi_trans_shared_put_internal(pool, slot, lost);
+	for (i = 0; i < count; i++) {
+		if (statuses[i] != MCAPI_SUCCESS)
+			*mcapi_status = MCAPI_ERR_GENERAL;
+	}
+	free(slots);
+}
 
 void mcapi_trans_msg_recv_i( mcapi_endpoint_t  receive_endpoint,  char* buffer, size_t buffer_size, mcapi_request_t* request,mcapi_status_t* mcapi_status)
 {
-	uint16_t sn,se;
+	uint16_t sn = 0, se = 0;
 	uint16_t rd,rn,re;
 	int ret;
 	int index;
 	int id;
 	uint32_t len;
 	mcapi_endpoint_t  send_endpoint;
+	mcapi_boolean_t virtual;
 	mcapi_database* mcapi_db = c_db;
 
 	if (!mcapi_trans_reserve_request(&id)) {
@@ -1236,35 +4785,51 @@ void mcapi_trans_msg_recv_i( mcapi_endpoint_t  receive_endpoint,  char* buffer,
 	*request = id;
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
 
-	index = mcapi_trans_get_port_index(rn, re);
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	virtual = MCAPI_VPORT_IS(re);
 
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (index >= mcapi_limits.endpoints && !virtual) {
 		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		return;
 	}
+	if (!virtual) {
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		if (mcapi_ep_local[index].co_buf)
+			mcapi_trans_coalesce_poll_internal(index);
+	}
 	len = buffer_size;
-	ret = sm_recv_packet(index, &se, &sn, buffer, &len, 0);
+	if (virtual)
+		ret = mcapi_trans_mux_recv_internal(rd, rn, re, &se, &sn, buffer, buffer_size, &len, 0);
+	else if (mcapi_trans_recv_buffered_internal(index))
+		ret = mcapi_trans_recv_internal(index, &se, &sn, buffer, buffer_size, &len, 0);
+	else
+		ret = sm_recv_packet(index, &se, &sn, buffer, &len, 0);
 	if(ret) {
 		if(errno == EAGAIN) {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_PENDING;
 		} else {
-			mcapi_db->requests[*request].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_FALSE;
 			*mcapi_status = MCAPI_ERR_TRANSMISSION;
 		}
 	} else {
-		mcapi_db->requests[*request].completed = MCAPI_TRUE;
+		MCAPI_DB_REQUEST(mcapi_db, *request).completed = MCAPI_TRUE;
 		*mcapi_status = MCAPI_SUCCESS;
 	}
-	mcapi_db->requests[*request].size = len;
-	send_endpoint = mcapi_trans_encode_handle_internal(0,sn,se);
-
-	setup_request_internal(receive_endpoint, send_endpoint, request, buffer, len, 0, RECV);
+	MCAPI_DB_REQUEST(mcapi_db, *request).size = len;
+	send_endpoint = mcapi_trans_sender_handle_internal(sn, se);
+
+	/* a pending receive keeps the room it has in the buffer */
+	setup_request_internal(receive_endpoint, send_endpoint, request, buffer,
+		(*mcapi_status == MCAPI_PENDING && (virtual || mcapi_trans_recv_buffered_internal(index))) ?
+		buffer_size : len, 0, RECV);
+	if (!virtual)
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
 }
 
 
 
-mcapi_boolean_t mcapi_trans_msg_recv( mcapi_endpoint_t  receive_endpoint,  char* buffer, size_t buffer_size, size_t* received_size, mcapi_status_t* mcapi_status)
+mcapi_boolean_t mcapi_trans_msg_recv_worker( mcapi_endpoint_t  receive_endpoint, mcapi_uint_t worker, char* buffer, size_t buffer_size, size_t* received_size, mcapi_status_t* mcapi_status)
 {
 	uint16_t sn,se;
 	uint16_t rd,rn,re;
@@ -1272,20 +4837,56 @@ mcapi_boolean_t mcapi_trans_msg_recv( mcapi_endpoint_t  receive_endpoint,  char*
 	int index;
 	uint32_t len;
 	mcapi_endpoint_t  send_endpoint;
+	dispatch_state* d;
 
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
 
-	index = mcapi_trans_get_port_index(rn, re);
+	if (MCAPI_VPORT_IS(re)) {
+		/* the receivers of a carrier take turns reading, whatever the worker */
+		len = buffer_size;
+		ret = mcapi_trans_mux_recv_internal(rd, rn, re, &se, &sn, buffer, buffer_size, &len, 1);
+		goto done;
+	}
+	index = mcapi_trans_get_port_index(rd, rn, re);
 
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		return MCAPI_FALSE;
 	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	/* the reply to a coalesced message may depend on it leaving first */
+	if (mcapi_ep_local[index].co_buf)
+		mcapi_trans_coalesce_flush_internal(index, 1, COALESCE_BEFORE);
 	len = buffer_size;
-	ret = sm_recv_packet(index, &se, &sn, buffer, &len, 1);
+	if (mcapi_ep_local[index].dispatch) {
+		if (worker >= mcapi_ep_local[index].dispatch->queues &&
+				mcapi_ep_local[index].dispatch->queues > 1) {
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			*mcapi_status = MCAPI_ERR_PARAMETER;
+			return MCAPI_FALSE;
+		}
+		d = mcapi_ep_local[index].dispatch;
+		/* a delete leaves d to its last user */
+		pthread_mutex_lock(&d->lock);
+		d->users++;
+		pthread_mutex_unlock(&d->lock);
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		ret = mcapi_trans_dispatch_recv_internal(index, d, worker, &se, &sn, buffer, buffer_size, &len);
+	} else if (mcapi_trans_recv_buffered_internal(index)) {
+		/* the local state is in use until a message arrives, so the
+		   receivers of such an endpoint take turns in the driver */
+		ret = mcapi_trans_recv_wait_internal(index, &se, &sn, buffer, buffer_size, &len);
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	} else {
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		ret = sm_recv_packet(index, &se, &sn, buffer, &len, 1);
+	}
+done:
 	if (ret) {
 		if (errno == ETIMEDOUT)
 			*mcapi_status = MCAPI_TIMEOUT;
+		else if (errno == EINVAL)
+			*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		else
 			*mcapi_status = MCAPI_ERR_GENERAL;
 		return MCAPI_FALSE;
@@ -1296,31 +4897,51 @@ mcapi_boolean_t mcapi_trans_msg_recv( mcapi_endpoint_t  receive_endpoint,  char*
 	}
 }
 
+mcapi_boolean_t mcapi_trans_msg_recv( mcapi_endpoint_t  receive_endpoint,  char* buffer, size_t buffer_size, size_t* received_size, mcapi_status_t* mcapi_status)
+{
+	return mcapi_trans_msg_recv_worker(receive_endpoint, 0, buffer, buffer_size, received_size, mcapi_status);
+}
+
 
 mcapi_uint_t mcapi_trans_msg_available( mcapi_endpoint_t receive_endpoint, mcapi_status_t* mcapi_status)
 {
 	uint16_t rd,rn,re;
 	int index;
 	int ret;
+	mcapi_uint_t avail;
 	struct sm_session_status status;
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
+	if (MCAPI_VPORT_IS(re))
+		return mcapi_trans_mux_available_internal(rd, rn, re, mcapi_status);
 	assert(rn == 0);
 
-	index = mcapi_trans_get_port_index(rn, re);
+	index = mcapi_trans_get_port_index(rd, rn, re);
 
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_ENDP_INVALID;
 		return MCAPI_NULL;
 	}
+	pthread_mutex_lock(&mcapi_ep_lock[index].lock);
 
 	ret = sm_get_session_status(index, &status);
 	if (ret) {
 		*mcapi_status = MCAPI_ERR_GENERAL;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
 		return MCAPI_NULL;
 	}
 	mcapi_dprintf(1, "%s avail = %d\n", __func__, status.n_avail);
+	if (mcapi_ep_local[index].co_buf)
+		mcapi_trans_coalesce_poll_internal(index);
 	*mcapi_status = MCAPI_SUCCESS;
-	return status.n_avail;
+	/* a coalesced packet counts once in the driver, add its other messages */
+	avail = status.n_avail + mcapi_ep_local[index].ring_count + mcapi_ep_local[index].rx_left;
+	if (mcapi_ep_local[index].dispatch)
+		avail += mcapi_trans_dispatch_count_internal(mcapi_ep_local[index].dispatch);
+	/* the queue length is known now, a burst can be fetched right away */
+	if (status.n_avail > 1 && mcapi_ep_local[index].ring && !mcapi_ep_local[index].ring_count)
+		mcapi_trans_prefetch_fill_internal(index, status.n_avail);
+	pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	return avail;
 }
 
 
@@ -1344,8 +4965,8 @@ void mcapi_trans_pktchan_recv_open_i( mcapi_pktchan_recv_hndl_t* recv_handle, mc
 	uint16_t rd,rn,re;
 	int index;
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1355,19 +4976,19 @@ void mcapi_trans_pktchan_recv_open_i( mcapi_pktchan_recv_hndl_t* recv_handle, mc
 
 	if (!completed) {
 
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_TRUE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_TRUE;
 
 		/* fill in the channel handle */
-		*recv_handle = mcapi_trans_encode_handle_internal(0,rn,re);
+		*recv_handle = mcapi_trans_encode_handle_internal(rd,rn,re);
 
 
 		/* has the channel been connected yet? */
-		if ( c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.channel_type == MCAPI_PKT_CHAN) {
+		if ( MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.channel_type == MCAPI_PKT_CHAN) {
 			completed = MCAPI_TRUE;
 		}
 
 		mcapi_dprintf(2," mcapi_trans_open_pktchan_recv_i (node_num=%d,port_num=%d) handle=%x\n",
-				c_db->domains[0].nodes[0].node_num,c_db->domains[0].nodes[0].node_d.endpoints[index].port_num,*recv_handle); 
+				mcapi_trans_self_internal()->node_num,MCAPI_DB_LOCAL_ENDPOINT(index).port_num,*recv_handle); 
 	}
 
 }
@@ -1379,8 +5000,8 @@ void mcapi_trans_pktchan_send_open_i( mcapi_pktchan_send_hndl_t* send_handle, mc
 	int index;
 	mcapi_dprintf(1,"%s send_handle %d\n", __func__,send_endpoint);
 	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1388,18 +5009,18 @@ void mcapi_trans_pktchan_send_open_i( mcapi_pktchan_send_hndl_t* send_handle, mc
 	if (!completed) {
 
 		/* mark the endpoint as open */
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_TRUE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_TRUE;
 
 		/* fill in the channel handle */
-		*send_handle = mcapi_trans_encode_handle_internal(0,sn,se);
+		*send_handle = mcapi_trans_encode_handle_internal(sd,sn,se);
 
 		/* has the channel been connected yet? */
-		if ( c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.channel_type == MCAPI_PKT_CHAN) {
+		if ( MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.channel_type == MCAPI_PKT_CHAN) {
 			completed = MCAPI_TRUE;
 		}
 
 		mcapi_dprintf(2," mcapi_trans_open_pktchan_send_i (node_num=%d,port_num=%d) handle=%x\n",
-				c_db->domains[0].nodes[0].node_num,c_db->domains[0].nodes[0].node_d.endpoints[index].port_num,*send_handle);
+				mcapi_trans_self_internal()->node_num,MCAPI_DB_LOCAL_ENDPOINT(index).port_num,*send_handle);
 	}
 
 }
@@ -1414,22 +5035,22 @@ void  mcapi_trans_pktchan_send_i( mcapi_pktchan_send_hndl_t send_handle, void* b
 	mcapi_dprintf(1,"%s send_handle %d\n", __func__,send_handle);
 	assert(mcapi_trans_decode_handle_internal(send_handle,&sd,&sn,&se));
 
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_CHAN_INVALID;
 		return;
 	}
 
-	assert(mcapi_trans_decode_handle_internal(c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.recv_endpt,&rd,&rn,&re));
+	assert(mcapi_trans_decode_handle_internal(MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt,&rd,&rn,&re));
 	mcapi_dprintf(1,"index %d, re %d, rn %d\n", index, re, rn);
-	ret = sm_send_packet(index, re, rn, buffer, size, NULL, 0);
+	ret = sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), buffer, size, NULL, 0);
 	if (ret) {
 		mcapi_dprintf(1,"send failed\n");
 		*mcapi_status = MCAPI_ERR_TRANSMISSION;
 	} else
 		*mcapi_status = MCAPI_SUCCESS;
 
-	setup_request_internal(send_handle, c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.recv_endpt, request, NULL, size, 0, SEND);
+	setup_request_internal(send_handle, MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt, request, NULL, size, 0, SEND);
 }
 
 
@@ -1443,13 +5064,13 @@ mcapi_boolean_t  mcapi_trans_pktchan_send( mcapi_pktchan_send_hndl_t send_handle
 	mcapi_dprintf(1,"%s send_handle %d\n", __func__,send_handle);
 	assert(mcapi_trans_decode_handle_internal(send_handle,&sd,&sn,&se));
 
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS)
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints)
 		return MCAPI_FALSE;
 
-	assert(mcapi_trans_decode_handle_internal(c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.recv_endpt,&rd,&rn,&re));
+	assert(mcapi_trans_decode_handle_internal(MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt,&rd,&rn,&re));
 	mcapi_dprintf(1,"index %d, re %d, rn %d\n", index, re, rn);
-	ret = sm_send_packet(index, re, rn, buffer, size, NULL, 1);
+	ret = sm_send_packet(index, re, mcapi_trans_route_cpu_internal(rd, rn), buffer, size, NULL, 1);
 	if (ret) {
 		mcapi_dprintf(1,"send failed\n");
 		ret = MCAPI_FALSE;
@@ -1473,8 +5094,8 @@ void mcapi_trans_pktchan_recv_i( mcapi_pktchan_recv_hndl_t receive_handle,  void
 	buffer_entry* db_buff = NULL;
 
 	assert(mcapi_trans_decode_handle_internal(receive_handle,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_ERR_CHAN_INVALID;
 		return;
 	}
@@ -1482,7 +5103,7 @@ void mcapi_trans_pktchan_recv_i( mcapi_pktchan_recv_hndl_t receive_handle,  void
 		*mcapi_status = MCAPI_ERR_REQUEST_LIMIT;
 		return;
 	}
-	db_buff = &c_db->buffers[i];
+	db_buff = &MCAPI_DB_BUFFER(c_db, i);
 
 	ret = sm_recv_packet(index,&se, &sn, db_buff->buff, &len, 0);
 	if (ret < 0) {
@@ -1495,7 +5116,7 @@ void mcapi_trans_pktchan_recv_i( mcapi_pktchan_recv_hndl_t receive_handle,  void
 	*buffer = db_buff->buff;
 	*mcapi_status = MCAPI_SUCCESS;
 
-	send_endpoint = mcapi_trans_encode_handle_internal(0,sn,se);
+	send_endpoint = mcapi_trans_sender_handle_internal(sn, se);
 	setup_request_internal(send_endpoint, receive_handle, request, db_buff->buff, len, 0, RECV);
 }
 
@@ -1512,14 +5133,14 @@ mcapi_boolean_t mcapi_trans_pktchan_recv( mcapi_pktchan_recv_hndl_t receive_hand
 	buffer_entry* db_buff = NULL;
 
 	assert(mcapi_trans_decode_handle_internal(receive_handle,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS)
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints)
 		return MCAPI_FALSE;
 
 	if (!mcapi_trans_reserve_request(&i))
 		return MCAPI_ERR_REQUEST_LIMIT;
 
-	db_buff = &c_db->buffers[i];
+	db_buff = &MCAPI_DB_BUFFER(c_db, i);
 
 	ret = sm_recv_packet(index,&se, &sn, db_buff->buff, &len, 1);
 	if (ret < 0) {
@@ -1531,7 +5152,7 @@ mcapi_boolean_t mcapi_trans_pktchan_recv( mcapi_pktchan_recv_hndl_t receive_hand
 	*buffer = db_buff->buff;
 	ret = MCAPI_SUCCESS;
 
-	send_endpoint = mcapi_trans_encode_handle_internal(0,sn,se);
+	send_endpoint = mcapi_trans_sender_handle_internal(sn, se);
 	return ret;
 
 }
@@ -1553,9 +5174,10 @@ mcapi_boolean_t mcapi_trans_pktchan_free( void* buffer)
 	int i;
 	uint32_t offset;
 
-	if ((buffer >= c_db->buffers[0].buff) && (buffer <= c_db->buffers[MCAPI_MAX_BUFFERS].buff)) {
-		offset = ((uint32_t)buffer & (~(MCAPI_MAX_MSG_SIZE - 1))) - (uint32_t)c_db->buffers[0].buff;
-		i = offset / MCAPI_MAX_MSG_SIZE;
+	if (((char*)buffer >= MCAPI_DB_BUFFER(c_db, 0).buff) &&
+			((char*)buffer < MCAPI_DB_BUFFER(c_db, mcapi_limits.buffers).buff)) {
+		offset = (char*)buffer - MCAPI_DB_BUFFER(c_db, 0).buff;
+		i = offset / sizeof(buffer_entry);
 		mcapi_trans_remove_request(i);
 	} else 
 		rc = MCAPI_FALSE;
@@ -1570,8 +5192,8 @@ void mcapi_trans_pktchan_recv_close_i( mcapi_pktchan_recv_hndl_t  receive_handle
 	int index;
 
 	assert(mcapi_trans_decode_handle_internal(receive_handle,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1580,7 +5202,7 @@ void mcapi_trans_pktchan_recv_close_i( mcapi_pktchan_recv_hndl_t  receive_handle
 	mcapi_boolean_t completed =  (*mcapi_status == MCAPI_SUCCESS) ? MCAPI_FALSE : MCAPI_TRUE; 
 	if (!completed) {    
 
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_FALSE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_FALSE;
 		completed = MCAPI_TRUE;    
 	}  
 
@@ -1593,8 +5215,8 @@ void mcapi_trans_pktchan_send_close_i( mcapi_pktchan_send_hndl_t  send_handle,mc
 	int index;
 
 	assert(mcapi_trans_decode_handle_internal(send_handle,&sd,&sn,&se));
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1603,7 +5225,7 @@ void mcapi_trans_pktchan_send_close_i( mcapi_pktchan_send_hndl_t  send_handle,mc
 	mcapi_boolean_t completed =  (*mcapi_status == MCAPI_SUCCESS) ? MCAPI_FALSE : MCAPI_TRUE;
 
 	if (!completed) {
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_FALSE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_FALSE;
 	}
 
 }
@@ -1628,8 +5250,8 @@ void mcapi_trans_sclchan_recv_open_i( mcapi_sclchan_recv_hndl_t* recv_handle, mc
 	uint16_t rd,rn,re;
 	int index;
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1639,19 +5261,19 @@ void mcapi_trans_sclchan_recv_open_i( mcapi_sclchan_recv_hndl_t* recv_handle, mc
 
 	if (!completed) {
 
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_TRUE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_TRUE;
 
 		/* fill in the channel handle */
-		*recv_handle = mcapi_trans_encode_handle_internal(0,rn,re);
+		*recv_handle = mcapi_trans_encode_handle_internal(rd,rn,re);
 
 
 		/* has the channel been connected yet? */
-		if ( c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.channel_type == MCAPI_SCL_CHAN) {
+		if ( MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.channel_type == MCAPI_SCL_CHAN) {
 			completed = MCAPI_TRUE;
 		}
 
 		mcapi_dprintf(2," mcapi_trans_open_pktchan_recv_i (node_num=%d,port_num=%d) handle=%x\n",
-				c_db->domains[0].nodes[0].node_num,c_db->domains[0].nodes[0].node_d.endpoints[index].port_num,*recv_handle); 
+				mcapi_trans_self_internal()->node_num,MCAPI_DB_LOCAL_ENDPOINT(index).port_num,*recv_handle); 
 	}
 
 
@@ -1664,8 +5286,8 @@ void mcapi_trans_sclchan_send_open_i( mcapi_sclchan_send_hndl_t* send_handle, mc
 	mcapi_boolean_t completed =  (*mcapi_status == MCAPI_SUCCESS) ? MCAPI_FALSE : MCAPI_TRUE;
 	int index;
 	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1673,18 +5295,18 @@ void mcapi_trans_sclchan_send_open_i( mcapi_sclchan_send_hndl_t* send_handle, mc
 	if (!completed) {
 
 		/* mark the endpoint as open */
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_TRUE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_TRUE;
 
 		/* fill in the channel handle */
-		*send_handle = mcapi_trans_encode_handle_internal(0,sn,se);
+		*send_handle = mcapi_trans_encode_handle_internal(sd,sn,se);
 
 		/* has the channel been connected yet? */
-		if ( c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.channel_type == MCAPI_SCL_CHAN) {
+		if ( MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.channel_type == MCAPI_SCL_CHAN) {
 			completed = MCAPI_TRUE;
 		}
 
 		mcapi_dprintf(2," mcapi_trans_open_sclchan_send_i (node_num=%d,port_num=%d) handle=%x completed %d\n",
-				c_db->domains[0].nodes[0].node_num,c_db->domains[0].nodes[0].node_d.endpoints[index].port_num,*send_handle, completed);
+				mcapi_trans_self_internal()->node_num,MCAPI_DB_LOCAL_ENDPOINT(index).port_num,*send_handle, completed);
 	}
 
 }
@@ -1704,8 +5326,8 @@ void mcapi_trans_sclchan_recv_close_i( mcapi_sclchan_recv_hndl_t  recv_handle,mc
 	int index;
 
 	assert(mcapi_trans_decode_handle_internal(recv_handle,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1714,7 +5336,7 @@ void mcapi_trans_sclchan_recv_close_i( mcapi_sclchan_recv_hndl_t  recv_handle,mc
 	mcapi_boolean_t completed =  (*mcapi_status == MCAPI_SUCCESS) ? MCAPI_FALSE : MCAPI_TRUE; 
 	if (!completed) {
 
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_FALSE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_FALSE;
 		completed = MCAPI_TRUE;
 	}
 
@@ -1726,8 +5348,8 @@ void mcapi_trans_sclchan_send_close_i( mcapi_sclchan_send_hndl_t send_handle,mca
 	int index;
 
 	assert(mcapi_trans_decode_handle_internal(send_handle,&sd,&sn,&se));
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		*mcapi_status = MCAPI_FALSE;
 		return;
 	}
@@ -1736,7 +5358,7 @@ void mcapi_trans_sclchan_send_close_i( mcapi_sclchan_send_hndl_t send_handle,mca
 	mcapi_boolean_t completed =  (*mcapi_status == MCAPI_SUCCESS) ? MCAPI_FALSE : MCAPI_TRUE;
 
 	if (!completed) {
-		c_db->domains[0].nodes[0].node_d.endpoints[index].open = MCAPI_FALSE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).open = MCAPI_FALSE;
 	}
 
 }
@@ -1753,14 +5375,14 @@ mcapi_boolean_t mcapi_trans_sclchan_send( mcapi_sclchan_send_hndl_t send_handle,
 
 	assert(mcapi_trans_decode_handle_internal(send_handle,&sd,&sn,&se));
 
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;;
 	}
 
-	assert(mcapi_trans_decode_handle_internal(c_db->domains[0].nodes[sn].node_d.endpoints[index].recv_queue.recv_endpt,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	assert(mcapi_trans_decode_handle_internal(MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt,&rd,&rn,&re));
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;
 	}
 
@@ -1781,7 +5403,7 @@ mcapi_boolean_t mcapi_trans_sclchan_send( mcapi_sclchan_send_hndl_t send_handle,
 	}
 
 	mcapi_dprintf(1,"size %d\n", size);
-	ret = sm_send_scalar(index, re, rn, scalar0, scalar1, size, 1);
+	ret = sm_send_scalar(index, re, mcapi_trans_route_cpu_internal(rd, rn), scalar0, scalar1, size, 1);
 	if (ret)
 		mcapi_dprintf(1,"send failed %x\n", ret);
 	return MCAPI_TRUE;
@@ -1799,8 +5421,8 @@ mcapi_boolean_t mcapi_trans_sclchan_recv( mcapi_sclchan_recv_hndl_t receive_hand
 	int index;
 
 	assert(mcapi_trans_decode_handle_internal(receive_handle,&rd,&rn,&re));
-	index = mcapi_trans_get_port_index(rn, re);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(rd, rn, re);
+	if (index >= mcapi_limits.endpoints) {
 		return MCAPI_FALSE;
 	}
 
@@ -1832,7 +5454,7 @@ mcapi_boolean_t mcapi_trans_sclchan_recv( mcapi_sclchan_recv_hndl_t receive_hand
 
 
 /****************** test,wait & cancel ****************************/
-mcapi_boolean_t mcapi_trans_test_i( mcapi_request_t* request, size_t* size,mcapi_status_t* mcapi_status)
+static mcapi_boolean_t mcapi_trans_test_i_internal( mcapi_request_t* request, size_t* size,mcapi_status_t* mcapi_status)
 {
 	mcapi_boolean_t rc;
 	uint16_t sd,sn,se;
@@ -1849,69 +5471,126 @@ mcapi_boolean_t mcapi_trans_test_i( mcapi_request_t* request, size_t* size,mcapi
 	*mcapi_status = 0;
 	rc = MCAPI_FALSE;
 
-	if (mcapi_db->requests[id].valid == MCAPI_FALSE) {
+	if (MCAPI_DB_REQUEST(mcapi_db, id).valid && !MCAPI_DB_REQUEST(mcapi_db, id).cancelled)
+		mcapi_trans_coalesce_poll_request_internal(id);
+	if (MCAPI_DB_REQUEST(mcapi_db, id).valid == MCAPI_FALSE) {
 		*mcapi_status = MCAPI_ERR_REQUEST_INVALID;
 		rc = MCAPI_FALSE;
-	} else if (mcapi_db->requests[id].cancelled) {
+	} else if (MCAPI_DB_REQUEST(mcapi_db, id).cancelled) {
 		*mcapi_status = MCAPI_ERR_REQUEST_CANCELLED;
 		rc = MCAPI_FALSE;
-	} else if ((mcapi_db->requests[id].completed)) {
+	} else if (MCAPI_DB_REQUEST(mcapi_db, id).backlogged) {
+		/* still in the sender's backlog, see if it can leave now */
+		assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(mcapi_db, id).handle,&sd,&sn,&se));
+		index = mcapi_trans_get_port_index(sd, sn, se);
+		if (index < mcapi_limits.endpoints)
+			mcapi_trans_backlog_drain_internal(index);
+		if (MCAPI_DB_REQUEST(mcapi_db, id).backlogged) {
+			*mcapi_status = MCAPI_PENDING;
+		} else {
+			*mcapi_status = MCAPI_DB_REQUEST(mcapi_db, id).status;
+			if (size)
+				*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+			rc = (*mcapi_status == MCAPI_SUCCESS);
+		}
+	} else if ((MCAPI_DB_REQUEST(mcapi_db, id).completed)) {
 		*mcapi_status = MCAPI_SUCCESS;
+		if (MCAPI_DB_REQUEST(mcapi_db, id).type == SEND)
+			*mcapi_status = MCAPI_DB_REQUEST(mcapi_db, id).status;
 		if (size)
-			*size = mcapi_db->requests[id].size;
-		rc = MCAPI_TRUE;
-	} else if (!(mcapi_db->requests[id].completed)) {
+			*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+		rc = (*mcapi_status == MCAPI_SUCCESS);
+	} else if (!(MCAPI_DB_REQUEST(mcapi_db, id).completed)) {
 		/* try to complete the request */
 		/*  receives to an empty channel or get_endpt for an endpt that
 		    doesn't yet exist are the only two types of non-blocking functions
 		    that don't complete immediately for this implementation */
-		if (mcapi_db->requests[id].type != GET_ENDPT) {
-			assert(mcapi_trans_decode_handle_internal(mcapi_db->requests[id].handle,&sd,&sn,&se));
-			assert(mcapi_trans_decode_handle_internal(mcapi_db->requests[id].ep_endpoint,&rd,&rn,&re));
-			index = mcapi_trans_get_port_index(sn, se);
-			if (index >= MCAPI_MAX_ENDPOINTS) {
+		if (MCAPI_DB_REQUEST(mcapi_db, id).type != GET_ENDPT) {
+			assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(mcapi_db, id).handle,&sd,&sn,&se));
+			assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(mcapi_db, id).ep_endpoint,&rd,&rn,&re));
+			index = mcapi_trans_get_port_index(sd, sn, se);
+			if (index >= mcapi_limits.endpoints && !MCAPI_VPORT_IS(se)) {
 				*mcapi_status = MCAPI_ERR_NODE_NOTINIT;
 				return MCAPI_FALSE;
 			}
 		} else {
 			index = 0;
-			re = mcapi_db->requests[id].ep_port_num;
-			rn = mcapi_db->requests[id].ep_node_num;
+			se = 0;
+			re = MCAPI_VPORT_SESSION(MCAPI_DB_REQUEST(mcapi_db, id).ep_port_num);
+			rn = MCAPI_DB_REQUEST(mcapi_db, id).ep_node_num;
+			rd = MCAPI_DB_REQUEST(mcapi_db, id).ep_domain_num;
 		}
 		if (size)
-			*size = mcapi_db->requests[id].size;
-		rc = sm_wait_nonblocking(index, re, rn, mcapi_db->requests[id].buffer,
-					size, mcapi_db->requests[id].type, mcapi_db->requests[id].payload, 0, 0);
+			*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+		if (MCAPI_DB_REQUEST(mcapi_db, id).type == RECV && MCAPI_VPORT_IS(se)) {
+			rc = mcapi_trans_mux_recv_request_internal(id, 0, 0);
+			if (!rc && size)
+				*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+		} else if (MCAPI_DB_REQUEST(mcapi_db, id).type == RECV && mcapi_trans_recv_buffered_internal(index)) {
+			rc = mcapi_trans_recv_request_internal(index, id, re, mcapi_trans_route_cpu_internal(rd, rn), 0, 0);
+			if (!rc && size)
+				*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+		} else
+			rc = sm_wait_nonblocking(index, re, mcapi_trans_route_cpu_internal(rd, rn), MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+					size, MCAPI_DB_REQUEST(mcapi_db, id).type, MCAPI_DB_REQUEST(mcapi_db, id).payload, 0, 0);
 		if (rc) {
 			if (errno == EAGAIN)
 				*mcapi_status = MCAPI_PENDING;
 			else
 				*mcapi_status = MCAPI_ERR_GENERAL;
-			mcapi_db->requests[id].completed = MCAPI_FALSE;
+			MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_FALSE;
 			rc = MCAPI_FALSE;
 		} else {
-			if (mcapi_db->requests[id].type == GET_ENDPT) {
+			if (MCAPI_DB_REQUEST(mcapi_db, id).type == GET_ENDPT) {
 				if (mcapi_trans_get_endpoint_internal(
-						(mcapi_endpoint_t *)mcapi_db->requests[id].buffer,
-						mcapi_db->requests[id].ep_node_num,
-						mcapi_db->requests[id].ep_port_num)) {
-					mcapi_db->requests[id].completed = MCAPI_TRUE;
+						(mcapi_endpoint_t *)MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_domain_num,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_node_num,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_port_num)) {
+					mcapi_trans_remote_confirm_internal(
+						*(mcapi_endpoint_t *)MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+						mcapi_trans_route_cpu_internal(rd, rn));
+					MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_TRUE;
 					*mcapi_status = MCAPI_SUCCESS;
 					rc = MCAPI_TRUE;
 				} else {
-					mcapi_db->requests[id].completed = MCAPI_TRUE;
+					MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_TRUE;
 					*mcapi_status = MCAPI_ERR_PARAMETER;
 					rc = MCAPI_FALSE;
 				}
 			} else {
-				mcapi_db->requests[id].completed = MCAPI_TRUE;
+				MCAPI_DB_REQUEST(mcapi_db, id).completed = MCAPI_TRUE;
 				*mcapi_status = MCAPI_SUCCESS;
 				if (size)
-					mcapi_db->requests[id].size = *size;
+					MCAPI_DB_REQUEST(mcapi_db, id).size = *size;
 				rc = MCAPI_TRUE;
 			}
 		}
 	}
+	if (rc && MCAPI_DB_REQUEST(mcapi_db, id).type == SEND)
+		mcapi_trans_credit_return_internal(id);
+	return rc;
+}
+
+/* test a request with the state of its endpoint locked */
+mcapi_boolean_t mcapi_trans_test_i( mcapi_request_t* request, size_t* size,mcapi_status_t* mcapi_status)
+{
+	uint16_t d,n,e;
+	int index = mcapi_limits.endpoints;
+	mcapi_boolean_t rc;
+	mcapi_request_data* r;
+
+	assert(mcapi_trans_valid_request_handle(request));
+	r = &MCAPI_DB_REQUEST(c_db, *request);
+	if (r->type == SEND || r->type == RECV) {
+		assert(mcapi_trans_decode_handle_internal(r->handle,&d,&n,&e));
+		index = mcapi_trans_get_port_index(d, n, e);
+	}
+	if (index < mcapi_limits.endpoints)
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+	rc = mcapi_trans_test_i_internal(request, size, mcapi_status);
+	if (index < mcapi_limits.endpoints)
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
 	return rc;
 }
 
@@ -1924,61 +5603,121 @@ mcapi_boolean_t mcapi_trans_wait( mcapi_request_t* request, size_t* size,
 	int id;
 	mcapi_timeout_t time = 0;
 	mcapi_boolean_t rc;
+	mcapi_boolean_t locked = MCAPI_FALSE;
 	mcapi_database *mcapi_db = c_db;
 
 	assert(mcapi_trans_valid_request_handle(request));
 	id = *request;
-	if (mcapi_db->requests[id].type != GET_ENDPT) {
-		assert(mcapi_trans_decode_handle_internal(mcapi_db->requests[id].handle,&sd,&sn,&se));
-		assert(mcapi_trans_decode_handle_internal(mcapi_db->requests[id].ep_endpoint,&rd,&rn,&re));
-		index = mcapi_trans_get_port_index(sn, se);
-		if (index >= MCAPI_MAX_ENDPOINTS) {
+	if (MCAPI_DB_REQUEST(mcapi_db, id).cancelled) {
+		*mcapi_status = MCAPI_ERR_REQUEST_CANCELLED;
+		mcapi_trans_remove_request(id);
+		return MCAPI_FALSE;
+	}
+	if (MCAPI_DB_REQUEST(mcapi_db, id).type != GET_ENDPT) {
+		assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(mcapi_db, id).handle,&sd,&sn,&se));
+		assert(mcapi_trans_decode_handle_internal(MCAPI_DB_REQUEST(mcapi_db, id).ep_endpoint,&rd,&rn,&re));
+		if (MCAPI_VPORT_IS(se)) {
+			/* a virtual endpoint's sends complete when posted */
+			rc = (MCAPI_DB_REQUEST(mcapi_db, id).completed ||
+				(MCAPI_DB_REQUEST(mcapi_db, id).type == RECV &&
+				!mcapi_trans_mux_recv_request_internal(id, timeout, 1)));
+			if (rc) {
+				*mcapi_status = MCAPI_SUCCESS;
+				if (size)
+					*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+			} else if (errno == EINVAL) {
+				*mcapi_status = MCAPI_ERR_ENDP_INVALID;
+			} else {
+				*mcapi_status = (errno == ETIMEDOUT) ? MCAPI_TIMEOUT : MCAPI_ERR_GENERAL;
+			}
+			mcapi_trans_remove_request(id);
+			return rc;
+		}
+		index = mcapi_trans_get_port_index(sd, sn, se);
+		if (index >= mcapi_limits.endpoints) {
 			*mcapi_status = MCAPI_ERR_NODE_NOTINIT;
 			return MCAPI_FALSE;
 		}
+		pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+		locked = MCAPI_TRUE;
 	} else {
 		index = 0;
-		re = mcapi_db->requests[id].ep_port_num;
-		rn = mcapi_db->requests[id].ep_node_num;
+		re = MCAPI_VPORT_SESSION(MCAPI_DB_REQUEST(mcapi_db, id).ep_port_num);
+		rn = MCAPI_DB_REQUEST(mcapi_db, id).ep_node_num;
+		rd = MCAPI_DB_REQUEST(mcapi_db, id).ep_domain_num;
 	}
 	if (size)
-		*size = mcapi_db->requests[id].size;
-	if (mcapi_db->requests[id].completed == MCAPI_TRUE) {
+		*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+	mcapi_trans_coalesce_poll_request_internal(id);
+	if (MCAPI_DB_REQUEST(mcapi_db, id).backlogged &&
+		!mcapi_trans_backlog_flush_internal(index, id, timeout)) {
+		/* like a driver timeout the request stays valid and can be waited on again */
+		*mcapi_status = MCAPI_TIMEOUT;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return MCAPI_FALSE;
+	}
+	if (MCAPI_DB_REQUEST(mcapi_db, id).completed == MCAPI_TRUE) {
 		mcapi_dprintf(1,"%s request (type:%d) has already completed! \n",
-							   __func__, mcapi_db->requests[id].type);
+							   __func__, MCAPI_DB_REQUEST(mcapi_db, id).type);
 		*mcapi_status = MCAPI_SUCCESS;
+		if (MCAPI_DB_REQUEST(mcapi_db, id).type == SEND) {
+			*mcapi_status = MCAPI_DB_REQUEST(mcapi_db, id).status;
+			mcapi_trans_credit_return_internal(id);
+		}
 		mcapi_trans_remove_request(id);
-		return MCAPI_TRUE;
+		if (locked)
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		return (*mcapi_status == MCAPI_SUCCESS);
+	}
+	if (MCAPI_DB_REQUEST(mcapi_db, id).type == RECV && mcapi_trans_recv_buffered_internal(index)) {
+		rc = mcapi_trans_recv_request_internal(index, id, re, mcapi_trans_route_cpu_internal(rd, rn), timeout, 1);
+		if (!rc && size)
+			*size = MCAPI_DB_REQUEST(mcapi_db, id).size;
+		pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+	} else {
+		/* nothing local is touched while the driver waits */
+		if (locked)
+			pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+		rc = sm_wait_nonblocking(index, re, mcapi_trans_route_cpu_internal(rd, rn), MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+			size, MCAPI_DB_REQUEST(mcapi_db, id).type, MCAPI_DB_REQUEST(mcapi_db, id).payload, timeout, 1);
 	}
-	rc = sm_wait_nonblocking(index, re, rn, mcapi_db->requests[id].buffer,
-			size, mcapi_db->requests[id].type, mcapi_db->requests[id].payload, timeout, 1);
 	if (rc) {
 		if (errno == ETIMEDOUT)
 			*mcapi_status = MCAPI_TIMEOUT;
 		else
 			*mcapi_status = MCAPI_ERR_GENERAL;
-		mcapi_db->requests[id].completed == MCAPI_FALSE;
+		MCAPI_DB_REQUEST(mcapi_db, id).completed == MCAPI_FALSE;
 		mcapi_trans_remove_request(id);
 		return MCAPI_FALSE;
 	} else {
-		if (mcapi_db->requests[id].type == GET_ENDPT) {
+		if (MCAPI_DB_REQUEST(mcapi_db, id).type == GET_ENDPT) {
 			if (mcapi_trans_get_endpoint_internal(
-						(mcapi_endpoint_t *)mcapi_db->requests[id].buffer,
-						mcapi_db->requests[id].ep_node_num,
-						mcapi_db->requests[id].ep_port_num)) {
-				mcapi_db->requests[id].completed == MCAPI_TRUE;
+						(mcapi_endpoint_t *)MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_domain_num,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_node_num,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_port_num)) {
+				mcapi_trans_remote_confirm_internal(
+					*(mcapi_endpoint_t *)MCAPI_DB_REQUEST(mcapi_db, id).buffer,
+					mcapi_trans_route_cpu_internal(MCAPI_DB_REQUEST(mcapi_db, id).ep_domain_num,
+						MCAPI_DB_REQUEST(mcapi_db, id).ep_node_num));
+				MCAPI_DB_REQUEST(mcapi_db, id).completed == MCAPI_TRUE;
 				*mcapi_status = MCAPI_SUCCESS;
 				rc = MCAPI_TRUE;
 			} else {
-				mcapi_db->requests[id].completed == MCAPI_FALSE;
+				MCAPI_DB_REQUEST(mcapi_db, id).completed == MCAPI_FALSE;
 				*mcapi_status = MCAPI_ERR_PARAMETER;
 				rc = MCAPI_FALSE;
 			}
 		} else {
-			mcapi_db->requests[id].completed == MCAPI_TRUE;
+			MCAPI_DB_REQUEST(mcapi_db, id).completed == MCAPI_TRUE;
 			*mcapi_status = MCAPI_SUCCESS;
 			if (size)
-				mcapi_db->requests[id].size = *size;
+				MCAPI_DB_REQUEST(mcapi_db, id).size = *size;
+			if (MCAPI_DB_REQUEST(mcapi_db, id).credit) {
+				pthread_mutex_lock(&mcapi_ep_lock[index].lock);
+				mcapi_trans_credit_return_internal(id);
+				pthread_mutex_unlock(&mcapi_ep_lock[index].lock);
+			}
 			rc = MCAPI_TRUE;
 		}
 		mcapi_trans_remove_request(id);
@@ -2002,8 +5741,85 @@ void mcapi_trans_cancel( mcapi_request_t* request)
 {
 }
 
+/* prints the layout of the shared database and how much of it is resident */
+static void mcapi_trans_display_db_internal(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct {
+		const char* name;
+		size_t off;
+		size_t len;
+	} parts[] = {
+		{"header", 0, c_db->domains_off},
+		{"domains", c_db->domains_off, c_db->nodes_off - c_db->domains_off},
+		{"nodes", c_db->nodes_off, c_db->endpoints_off - c_db->nodes_off},
+		{"endpoints", c_db->endpoints_off, c_db->requests_off - c_db->endpoints_off},
+		{"requests", c_db->requests_off, c_db->reserves_off - c_db->requests_off},
+		{"reserves", c_db->reserves_off, c_db->endpoint_owners_off - c_db->reserves_off},
+		{"owners", c_db->endpoint_owners_off, c_db->domain_routes_off - c_db->endpoint_owners_off},
+		{"routes", c_db->domain_routes_off, c_db->port_map_off - c_db->domain_routes_off},
+		{"ports", c_db->port_map_off, c_db->pooled_off - c_db->port_map_off},
+		{"pooled", c_db->pooled_off, c_db->buffers_off - c_db->pooled_off},
+		{"buffers", c_db->buffers_off, c_db->size - c_db->buffers_off},
+	};
+	size_t i;
+
+	printf("mcapi database %s%s: %u bytes, %zu of %zu pages resident\n", mcapi_db_path,
+		mcapi_db_hugetlb ? " (huge pages)" : "", c_db->size,
+		mcapi_trans_db_resident_internal(0, c_db->size), (c_db->size + page - 1) / page);
+	printf("  domains %u nodes %u endpoints %u buffers %u queue elements %u\n",
+		mcapi_limits.domains, mcapi_limits.nodes, mcapi_limits.endpoints,
+		mcapi_limits.buffers, mcapi_limits.queue_elements);
+	for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+		printf("  %-10s offset %8zx size %8zx resident pages %zu\n", parts[i].name,
+			parts[i].off, parts[i].len,
+			parts[i].len ? mcapi_trans_db_resident_internal(parts[i].off, parts[i].len) : 0);
+}
+
+/* the <domain, node>s the routing table knows */
+static void mcapi_trans_display_routes_internal(void)
+{
+	mcapi_route* r;
+	int id, d, n;
+
+	for (id = 0; id <= MCAPI_DOMAIN_MASK; id++) {
+		d = MCAPI_DB_DOMAIN_ROUTE(c_db, id);
+		if (!d)
+			continue;
+		for (n = 0; n < MCAPI_ROUTE_NODES; n++) {
+			r = &MCAPI_DB_ROUTE(c_db, d - 1, n);
+			if (r->node_index)
+				printf("  route %d:%d node index %u\n", id, n, r->node_index - 1);
+			else if (r->cpu)
+				printf("  route %d:%d cpu %u\n", id, n, r->cpu - 1);
+		}
+	}
+}
+
+/* the fan-out staging areas in use */
+static void mcapi_trans_display_shared_internal(void)
+{
+	mcapi_shared_pool* pool;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		pool = &mcapi_shared_pools[i];
+		pthread_mutex_lock(&pool->lock);
+		if (pool->base)
+			printf("  fan-out %s: %d of %d slots busy\n",
+				pool->cached ? "cached" : "uncached", __builtin_popcount(pool->busy),
+				MCAPI_SHARED_SLOTS);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
 void mcapi_trans_display_state (void* handle)
 {
+	if (c_db) {
+		mcapi_trans_display_db_internal();
+		mcapi_trans_display_routes_internal();
+		mcapi_trans_display_shared_internal();
+	}
 }
 
 void mca_set_debug_level (int d)
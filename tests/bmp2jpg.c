@@ -25,6 +25,8 @@
 #define WRONG wrong(__LINE__);
 
 extern void *sm_request_uncached_buf(uint32_t size, uint32_t *paddr);
+extern void sm_copy_to_uncached(void *dst, const void *src, size_t len);
+extern void sm_copy_from_uncached(void *dst, const void *src, size_t len);
 
 struct stat bmp_statbuf;
 
@@ -46,13 +48,22 @@ static char *jpg_path = "test.jpg";
 	
 static void jpg_output(void)
 {
+  void *jpg_data;
+
   if ((jpg_fd = open(jpg_path, O_RDWR | O_CREAT, S_IRWXU)) < 0)
 		printf("opening data file '%s' failed", jpg_path);
 
   printf("img->jpg_buffer = 0x%x\n", img_info.jpg_buffer);
   printf("img->jpg_len = 0x%x\n", img_info.jpg_len);
 
-  write(jpg_fd, img_info.jpg_buffer, img_info.jpg_len);
+  /* write() would read the uncached buffer a few bytes at a time */
+  if ((jpg_data = malloc(img_info.jpg_len)) == NULL) {
+		printf("malloc() failed");
+		return;
+  }
+  sm_copy_from_uncached(jpg_data, (void *)img_info.jpg_buffer, img_info.jpg_len);
+  write(jpg_fd, jpg_data, img_info.jpg_len);
+  free(jpg_data);
 }
 
 unsigned long paddr;
@@ -116,6 +127,7 @@ int main () {
   int i,s = 0, rc = 0,pass_num=0;
   mcapi_uint_t avail;
   unsigned int *buffer;
+  void *bmp_data;
 
   system("ffmpeg -f video4linux2 -r 5 -s 320x240 -i /dev/video0 test.bmp");
 
@@ -133,10 +145,14 @@ int main () {
   if(image_info_alloc())
     return -1;
 
-  if (read(bmp_fd, img_info.bmp_buffer, img_info.bmp_len) != img_info.bmp_len){
+  /* read() would fill the uncached buffer a few bytes at a time */
+  if ((bmp_data = malloc(img_info.bmp_len)) == NULL ||
+      read(bmp_fd, bmp_data, img_info.bmp_len) != img_info.bmp_len){
 		printf("reading file from '%s' failed", bmp_path);
 		return -1;
   }
+  sm_copy_to_uncached((void *)img_info.bmp_buffer, bmp_data, img_info.bmp_len);
+  free(bmp_data);
 
   /* create a node */
   mcapi_initialize(DOMAIN,NODE,NULL,&parms,&version,&status);
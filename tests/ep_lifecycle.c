@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2020, Analog Devices, Inc.  All rights reserved.
+ *
+ * Test: ep_lifecycle
+ * Description: Endpoint create/delete rate. Like a request/response service
+ *				making reply endpoints, every round creates a batch of
+ *				MCAPI_PORT_ANY endpoints with mcapi_endpoint_create_many()
+ *				and deletes them again with mcapi_endpoint_delete_many().
+ *				It runs once without the session pool and once with it
+ *				(MCAPI_SESSION_POOL), so that every endpoint costs a
+ *				CMD_SM_CREATE and a CMD_SM_SHUTDOWN in the first run and
+ *				none in the second.
+ * Result: One line per run with endpoints/s, and the speedup.
+*/
+
+#include <mcapi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#define DOMAIN				0
+#define MASTER_NODE			0
+/* leave some sessions to the other processes */
+#define MAX_BATCH			(MCAPI_MAX_ENDPOINTS / 2)
+#define MAX_POOL			16
+
+static int help(void)
+{
+	printf("Usage: ep_lifecycle <options>\n");
+	printf("\nAvailable options:\n");
+	printf("\t-h,--help\t\tthis help\n");
+	printf("\t-r,--rounds\t\tcreate/delete rounds(default:1000)\n");
+	printf("\t-b,--batch\t\tendpoints per round(default:4, max:%d)\n", MAX_BATCH);
+	printf("\t-p,--pool\t\tsessions in the pool of the second run(default:the batch, max:%d)\n",
+		MAX_POOL);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* endpoints/s with a session pool of pool, 0 on failure */
+static double run(int pool, int rounds, int batch)
+{
+	mcapi_port_t ports[MAX_BATCH];
+	mcapi_endpoint_t endpoints[MAX_BATCH];
+	mcapi_status_t statuses[MAX_BATCH];
+	mcapi_param_t parms;
+	mcapi_info_t version;
+	mcapi_status_t status;
+	char value[16];
+	double start, end;
+	int i;
+
+	/* read by the first node of the process */
+	snprintf(value, sizeof(value), "%d", pool);
+	setenv("MCAPI_SESSION_POOL", value, 1);
+	mcapi_initialize(DOMAIN, MASTER_NODE, NULL, &parms, &version, &status);
+	if (status != MCAPI_SUCCESS) {
+		printf("mcapi_initialize failed, status %d\n", status);
+		return 0;
+	}
+	for (i = 0; i < batch; i++)
+		ports[i] = MCAPI_PORT_ANY;
+
+	start = now();
+	for (i = 0; i < rounds; i++) {
+		mcapi_endpoint_create_many(batch, ports, endpoints, statuses, &status);
+		if (status != MCAPI_SUCCESS)
+			break;
+		mcapi_endpoint_delete_many(batch, endpoints, statuses, &status);
+		if (status != MCAPI_SUCCESS)
+			break;
+	}
+	end = now();
+	mcapi_finalize(&status);
+	if (i != rounds) {
+		printf("pool %d: stopped after %d rounds\n", pool, i);
+		return 0;
+	}
+	return (double)rounds * batch / (end - start);
+}
+
+int main(int argc, char *argv[])
+{
+	const char short_options[] = "hr:b:p:";
+	const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"rounds", 1, NULL, 'r'},
+		{"batch", 1, NULL, 'b'},
+		{"pool", 1, NULL, 'p'},
+		{0, 0, 0, 0},
+	};
+	int rounds = 1000, batch = 4, pool = 0;
+	double before, after;
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'p':
+			pool = atoi(optarg);
+			break;
+		default:
+			return help();
+		}
+	}
+	if (rounds < 1 || batch < 1 || batch > MAX_BATCH || pool < 0 || pool > MAX_POOL)
+		return help();
+	if (!pool)
+		pool = batch;
+
+	before = run(0, rounds, batch);
+	after = run(pool, rounds, batch);
+	printf("no pool   : %10.0f endpoints/s\n", before);
+	printf("pool of %2d: %10.0f endpoints/s\n", pool, after);
+	if (before && after)
+		printf("speedup   : %10.2f\n", after / before);
+	return (before && after) ? 0 : 1;
+}
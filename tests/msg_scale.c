@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2020, Analog Devices, Inc.  All rights reserved.
+ *
+ * Test: msg_scale
+ * Description: Multithreaded message throughput. For 1, 2, 4 ... N threads,
+ *				every thread creates its own pair of local endpoints and
+ *				sends/receives messages between them (or only sends to a
+ *				SHARC endpoint with -n). The aggregate rate for each thread
+ *				count shows how close to linear the library scales when
+ *				N threads drive N endpoints. With -c all threads send
+ *				through one shared endpoint instead, which exercises the
+ *				send combining of mcapi_msg_send(). With -p every thread also
+ *				counts its cache misses (perf events), to see how much the
+ *				threads' endpoints and requests share cache lines.
+ * Result: One line per thread count with messages/s and speedup.
+*/
+
+#include <mcapi.h>
+#include <mcapi_test.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define DOMAIN				0
+#define MASTER_NODE			0
+/* thread i uses ports BASE_PORT + 2i and BASE_PORT + 2i + 1 */
+#define BASE_PORT			300
+/* sessions are shared by all threads, two per thread */
+#define MAX_THREADS			(MCAPI_MAX_ENDPOINTS / 2 - 1)
+
+#define BUFF_SIZE			64u
+
+struct scale_prams {
+	int id;
+	int messages;
+	size_t size;
+	mcapi_node_t remote_node;
+	mcapi_port_t remote_port;
+	mcapi_endpoint_t shared_tx;	/* 0 when every thread has its own */
+	int perf;
+	int failed;
+	/* results */
+	double start;
+	double end;
+	uint64_t misses;
+};
+
+static pthread_barrier_t start_barrier;
+
+static int help(void)
+{
+	printf("Usage: msg_scale <options>\n");
+	printf("\nAvailable options:\n");
+	printf("\t-h,--help\t\tthis help\n");
+	printf("\t-t,--threads\t\tmaximum number of threads(default:4, max:%d)\n", MAX_THREADS);
+	printf("\t-m,--messages\t\tmessages per thread(default:10000)\n");
+	printf("\t-s,--size\t\tmessage size in bytes(default:16, max:%u)\n", BUFF_SIZE);
+	printf("\t-c,--combine\t\tall threads send through one endpoint\n");
+	printf("\t-p,--perf\t\talso report cache misses per message\n");
+	printf("\t-n,--node\t\tsend to port %d of this remote node instead of a local endpoint\n",
+		SLAVE_PORT_NUM1);
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* cache miss counter of the calling thread, -1 when there is none */
+static int open_miss_counter(void)
+{
+	struct perf_event_attr pe;
+
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CACHE_MISSES;
+	pe.disabled = 1;
+	pe.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void *thread_scale_fun(void *arg)
+{
+	struct scale_prams *prams = (struct scale_prams *)arg;
+	mcapi_endpoint_t tx, rx = 0, dest;
+	mcapi_status_t status;
+	char buffer[BUFF_SIZE];
+	size_t size;
+	int i, miss_fd = -1;
+
+	memset(buffer, prams->id, sizeof(buffer));
+	if (prams->perf)
+		miss_fd = open_miss_counter();
+	if (prams->shared_tx) {
+		tx = prams->shared_tx;
+	} else {
+		tx = mcapi_endpoint_create(BASE_PORT + 2 * prams->id, &status);
+		if (status != MCAPI_SUCCESS)
+			goto create_error;
+	}
+	if (prams->remote_node != MASTER_NODE) {
+		dest = mcapi_endpoint_get(DOMAIN, prams->remote_node, prams->remote_port,
+				MCA_INFINITE, &status);
+	} else {
+		rx = mcapi_endpoint_create(BASE_PORT + 2 * prams->id + 1, &status);
+		dest = rx;
+	}
+	if (status != MCAPI_SUCCESS)
+		goto create_error;
+
+	pthread_barrier_wait(&start_barrier);
+	if (miss_fd >= 0)
+		ioctl(miss_fd, PERF_EVENT_IOC_ENABLE, 0);
+	prams->start = now();
+	for (i = 0; i < prams->messages; i++) {
+		mcapi_msg_send(tx, dest, buffer, prams->size, 1, &status);
+		if (status != MCAPI_SUCCESS)
+			break;
+		if (rx) {
+			mcapi_msg_recv(rx, buffer, sizeof(buffer), &size, &status);
+			if (status != MCAPI_SUCCESS)
+				break;
+		}
+	}
+	prams->end = now();
+	if (miss_fd >= 0) {
+		ioctl(miss_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(miss_fd, &prams->misses, sizeof(prams->misses)) != sizeof(prams->misses))
+			prams->misses = 0;
+		close(miss_fd);
+	}
+	if (i != prams->messages) {
+		printf("Thread [%d] stopped after %d messages, status %d\n",
+			prams->id, i, status);
+		prams->failed = 1;
+	}
+	pthread_barrier_wait(&start_barrier);
+
+	if (rx)
+		mcapi_endpoint_delete(rx, &status);
+	if (!prams->shared_tx)
+		mcapi_endpoint_delete(tx, &status);
+	return NULL;
+
+create_error:
+	printf("Thread [%d] endpoint setup failed, status %d\n", prams->id, status);
+	prams->failed = 1;
+	if (miss_fd >= 0)
+		close(miss_fd);
+	/* still take part in both barriers so the others are not stuck */
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	return NULL;
+}
+
+/* run with nthreads threads, returns the aggregate messages/s and the
+   cache misses of all threads in *misses */
+static double run(int nthreads, struct scale_prams *base, uint64_t *misses)
+{
+	pthread_t pthId[MAX_THREADS];
+	struct scale_prams prams[MAX_THREADS];
+	double start = 0, end = 0;
+	int i, failed = 0;
+
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		prams[i] = *base;
+		prams[i].id = i;
+		if (pthread_create(&pthId[i], NULL, thread_scale_fun, &prams[i])) {
+			printf("create thread %d failed\n", i);
+			exit(1);
+		}
+	}
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	/* the threads time themselves: with fewer cores than threads this
+	   thread may only run again once they are done */
+	*misses = 0;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(pthId[i], NULL);
+		failed |= prams[i].failed;
+		if (!i || prams[i].start < start)
+			start = prams[i].start;
+		if (!i || prams[i].end > end)
+			end = prams[i].end;
+		*misses += prams[i].misses;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	if (failed)
+		return 0;
+	return nthreads * base->messages / (end - start);
+}
+
+int main(int argc, char *argv[])
+{
+	const char short_options[] = "ht:m:s:cpn:";
+	const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"threads", 1, NULL, 't'},
+		{"messages", 1, NULL, 'm'},
+		{"size", 1, NULL, 's'},
+		{"combine", 0, NULL, 'c'},
+		{"perf", 0, NULL, 'p'},
+		{"node", 1, NULL, 'n'},
+		{0, 0, 0, 0},
+	};
+	struct scale_prams base;
+	mcapi_param_t parms;
+	mcapi_info_t version;
+	mcapi_status_t status;
+	int max_threads = 4;
+	uint64_t misses;
+	double rate, single = 0;
+	int n;
+
+	memset(&base, 0, sizeof(base));
+	base.messages = 10000;
+	base.size = 16;
+	base.remote_node = MASTER_NODE;
+	base.remote_port = SLAVE_PORT_NUM1;
+
+	while (1) {
+		int c;
+		if ((c = getopt_long(argc, argv, short_options, long_options, NULL)) < 0)
+			break;
+		switch (c) {
+		case 'h':
+			help();
+			return 0;
+		case 't':
+			max_threads = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			base.messages = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			base.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			base.shared_tx = 1;
+			break;
+		case 'p':
+			base.perf = 1;
+			break;
+		case 'n':
+			base.remote_node = strtol(optarg, NULL, 0);
+			break;
+		default:
+			printf("Invalid switch or option needs an argument.\
+				  \ntry msg_scale --help for more information.\n");
+			return -1;
+		}
+	}
+	if (max_threads <= 0 || max_threads > MAX_THREADS || base.messages <= 0 ||
+		base.size == 0 || base.size > BUFF_SIZE) {
+		help();
+		return -1;
+	}
+
+	mcapi_initialize(DOMAIN, MASTER_NODE, NULL, &parms, &version, &status);
+	if (status != MCAPI_SUCCESS) {
+		printf("initialize failed, status %d\n", status);
+		return -1;
+	}
+
+	if (base.perf) {
+		int fd = open_miss_counter();
+		if (fd < 0) {
+			printf("no cache miss counter, perf events unavailable\n");
+			base.perf = 0;
+		} else {
+			close(fd);
+		}
+	}
+
+	if (base.shared_tx) {
+		/* the per thread ports start at BASE_PORT, use the one below */
+		base.shared_tx = mcapi_endpoint_create(BASE_PORT - 1, &status);
+		if (status != MCAPI_SUCCESS) {
+			printf("endpoint create failed, status %d\n", status);
+			mcapi_finalize(&status);
+			return -1;
+		}
+	}
+
+	printf("threads\tmsgs/s\t\tspeedup%s\n", base.perf ? "\tmisses/msg" : "");
+	for (n = 1; n <= max_threads; n *= 2) {
+		rate = run(n, &base, &misses);
+		if (rate == 0) {
+			printf("%d\tfailed\n", n);
+			break;
+		}
+		if (n == 1)
+			single = rate;
+		printf("%d\t%.0f\t\t%.2f", n, rate, rate / single);
+		if (base.perf)
+			printf("\t%.2f", (double)misses / ((double)n * base.messages));
+		printf("\n");
+		if (n < max_threads && n * 2 > max_threads)
+			n = max_threads / 2;
+	}
+
+	if (base.shared_tx)
+		mcapi_endpoint_delete(base.shared_tx, &status);
+	mcapi_finalize(&status);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2020, Analog Devices, Inc.  All rights reserved.
+ *
+ * Test: uncached_copy
+ * Description: Copy rate into and out of an uncached buffer from
+ *				sm_request_uncached_buf(), like the staging of bulk
+ *				transfers such as bmp2jpg, with memcpy() and with the
+ *				library's sm_copy_to_uncached()/sm_copy_from_uncached(),
+ *				and the same through a cached buffer of
+ *				sm_request_cached_buf() with its cache syncs, to pick the
+ *				faster memory type per payload size.
+ *				Without the ICC driver (e.g. on a x86 host) a malloc()
+ *				buffer stands in for the uncached one. Cycles are read
+ *				from the time stamp counter on x86, elsewhere they are
+ *				the elapsed time at the CPU clock (--mhz, else cpufreq).
+ * Result: Bytes per cycle of every copy, and whether the data survived.
+*/
+
+#include <mcapi.h>
+#include <mcapi_dev_impl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+static double mhz;
+
+static int help(void)
+{
+	printf("Usage: uncached_copy <options>\n");
+	printf("\nAvailable options:\n");
+	printf("\t-h,--help\t\tthis help\n");
+	printf("\t-s,--size\t\tbytes per copy(default:230400, a 320x240 bmp)\n");
+	printf("\t-r,--rounds\t\tcopies per measurement(default:100)\n");
+	printf("\t-o,--offset\t\tmisalignment of the cached buffer(default:0)\n");
+	printf("\t-m,--mhz\t\tCPU clock when there is no cycle counter(default:cpufreq)\n");
+	return 0;
+}
+
+static double cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	return (double)__rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e6 + ts.tv_nsec / 1e3) * mhz;
+#endif
+}
+
+#if !defined(__i386__) && !defined(__x86_64__)
+static double cpufreq_mhz(void)
+{
+	FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+	unsigned long khz = 0;
+
+	if (f) {
+		if (fscanf(f, "%lu", &khz) != 1)
+			khz = 0;
+		fclose(f);
+	}
+	return khz / 1000.0;
+}
+#endif
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t len);
+
+static void libc_copy(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+static uint32_t cached_paddr;
+static char *cached;
+
+/* into the cached buffer and out to the other core */
+static void cached_copy_in(void *dst, const void *src, size_t len)
+{
+	memcpy(dst, src, len);
+	sm_sync_for_device(dst, len, cached_paddr);
+}
+
+/* back from the other core and out of the cached buffer */
+static void cached_copy_out(void *dst, const void *src, size_t len)
+{
+	sm_sync_for_cpu((void *)src, len, cached_paddr);
+	memcpy(dst, src, len);
+}
+
+/* bytes per cycle of rounds copies of size bytes */
+static double run(copy_fn copy, void *dst, const void *src, size_t size, int rounds)
+{
+	double start, end;
+	int i;
+
+	copy(dst, src, size);
+	start = cycles();
+	for (i = 0; i < rounds; i++)
+		copy(dst, src, size);
+	end = cycles();
+	return (double)size * rounds / (end - start);
+}
+
+int main(int argc, char *argv[])
+{
+	const char short_options[] = "hs:r:o:m:";
+	const struct option long_options[] = {
+		{"help", 0, NULL, 'h'},
+		{"size", 1, NULL, 's'},
+		{"rounds", 1, NULL, 'r'},
+		{"offset", 1, NULL, 'o'},
+		{"mhz", 1, NULL, 'm'},
+		{0, 0, 0, 0},
+	};
+	size_t size = 320 * 240 * 3, i;
+	int rounds = 100, offset = 0, c, ok = 1;
+	uint32_t paddr;
+	char *shared, *src, *dst, *mem;
+	int uncached = 1;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'o':
+			offset = atoi(optarg);
+			break;
+		case 'm':
+			mhz = atof(optarg);
+			break;
+		default:
+			return help();
+		}
+	}
+	if (!size || rounds < 1 || offset < 0 || offset > 63)
+		return help();
+#if !defined(__i386__) && !defined(__x86_64__)
+	if (!mhz)
+		mhz = cpufreq_mhz();
+	if (!mhz) {
+		printf("no CPU clock known, give it with --mhz\n");
+		return 1;
+	}
+#endif
+
+	shared = (sm_dev_initialize() < 0) ? NULL : sm_request_uncached_buf(size, &paddr);
+	if (!shared) {
+		printf("no uncached buffer, measuring a malloc() one\n");
+		shared = malloc(size);
+		uncached = 0;
+	}
+	mem = malloc(2 * (size + 64));
+	if (!shared || !mem) {
+		printf("out of memory\n");
+		return 1;
+	}
+	src = mem + offset;
+	dst = mem + size + 64 + offset;
+	for (i = 0; i < size; i++)
+		src[i] = (char)(i * 31 + 7);
+
+	printf("%zu bytes, %d rounds, copy kernel %s\n", size, rounds, sm_copy_kernel());
+	printf("%-22s %6.3f bytes/cycle\n", "memcpy in",
+		run(libc_copy, shared, src, size, rounds));
+	printf("%-22s %6.3f bytes/cycle\n", "sm_copy_to_uncached",
+		run(sm_copy_to_uncached, shared, src, size, rounds));
+	memset(dst, 0, size);
+	printf("%-22s %6.3f bytes/cycle\n", "memcpy out",
+		run(libc_copy, dst, shared, size, rounds));
+	memset(dst, 0, size);
+	printf("%-22s %6.3f bytes/cycle\n", "sm_copy_from_uncached",
+		run(sm_copy_from_uncached, dst, shared, size, rounds));
+	ok = !memcmp(src, dst, size);
+	if (uncached)
+		cached = sm_request_cached_buf(size, &cached_paddr);
+	if (cached) {
+		printf("%-22s %6.3f bytes/cycle\n", "cached in + sync",
+			run(cached_copy_in, cached, src, size, rounds));
+		memset(dst, 0, size);
+		printf("%-22s %6.3f bytes/cycle\n", "sync + cached out",
+			run(cached_copy_out, dst, cached, size, rounds));
+		ok = ok && !memcmp(src, dst, size);
+		sm_release_cached_buf(cached, size, cached_paddr);
+	}
+	printf("data %s\n", ok ? "ok" : "CORRUPTED");
+
+	if (uncached) {
+		sm_release_uncached_buf(shared, size, paddr);
+		sm_dev_finalize();
+	} else {
+		free(shared);
+	}
+	free(mem);
+	return ok ? 0 : 1;
+}
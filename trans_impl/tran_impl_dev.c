@@ -14,10 +14,106 @@
 #include <transport_sm.h>
 #include <icc.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 
 int fd;
 extern mcapi_database* c_db;
 
+/* Per thread transport context. Sessions are created and torn down through
+   the process descriptor fd, while each thread sends, receives and polls
+   through a descriptor of its own: the driver takes the blocking mode from
+   the open file, so one thread switching O_NONBLOCK must not change the
+   behaviour of another thread's ioctl. The descriptors are on sm_ctx_list
+   until sm_dev_finalize() closes them all; it bumps sm_ctx_gen too, so a
+   thread that still has one of an earlier generation opens a new one
+   rather than use a number that may have been handed out again. */
+struct sm_thread_ctx {
+	int fd;		/* -1 not opened yet, -2 open failed (use fd) */
+	int nonblock;	/* mode currently set on fd, -1 if unknown */
+	unsigned gen;	/* sm_ctx_gen when fd was opened */
+	struct sm_thread_ctx *next;	/* on sm_ctx_list while fd is open */
+};
+static __thread struct sm_thread_ctx sm_ctx = { -1, -1, 0, NULL };
+static struct sm_thread_ctx *sm_ctx_list;
+static unsigned sm_ctx_gen;
+static pthread_mutex_t sm_ctx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sm_ctx_key;
+static pthread_once_t sm_ctx_once = PTHREAD_ONCE_INIT;
+
+/* thread exit: close the descriptor, unless finalize has done it */
+static void sm_ctx_release(void *arg)
+{
+	struct sm_thread_ctx *ctx = arg;
+	struct sm_thread_ctx **p;
+
+	pthread_mutex_lock(&sm_ctx_lock);
+	for (p = &sm_ctx_list; *p; p = &(*p)->next) {
+		if (*p == ctx) {
+			*p = ctx->next;
+			close(ctx->fd);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sm_ctx_lock);
+}
+
+static void sm_ctx_key_create(void)
+{
+	pthread_key_create(&sm_ctx_key, sm_ctx_release);
+}
+
+/* the descriptor the calling thread uses for data path ioctls */
+static int sm_thread_fd(void)
+{
+	unsigned gen = __atomic_load_n(&sm_ctx_gen, __ATOMIC_ACQUIRE);
+
+	if (sm_ctx.gen != gen) {
+		/* closed by sm_dev_finalize() */
+		sm_ctx.fd = -1;
+		sm_ctx.gen = gen;
+	}
+	if (sm_ctx.fd >= 0)
+		return sm_ctx.fd;
+	if (sm_ctx.fd == -2)
+		return fd;
+	sm_ctx.fd = open("/dev/icc", O_RDWR);
+	if (sm_ctx.fd < 0) {
+		sm_ctx.fd = -2;
+		return fd;
+	}
+	sm_ctx.nonblock = -1;
+	pthread_mutex_lock(&sm_ctx_lock);
+	sm_ctx.gen = sm_ctx_gen;
+	sm_ctx.next = sm_ctx_list;
+	sm_ctx_list = &sm_ctx;
+	pthread_mutex_unlock(&sm_ctx_lock);
+	pthread_once(&sm_ctx_once, sm_ctx_key_create);
+	/* closed by sm_ctx_release() when the thread exits */
+	pthread_setspecific(sm_ctx_key, &sm_ctx);
+	return sm_ctx.fd;
+}
+
+/* switch O_NONBLOCK on d; the thread's own descriptor remembers its mode,
+   so back to back calls in the same mode cost no fcntl() */
+static void sm_set_blocking(int d, int blocking)
+{
+	int flags;
+
+	if (d == sm_ctx.fd && sm_ctx.nonblock == !blocking)
+		return;
+	flags = fcntl(d, F_GETFL, 0);
+	if (flags < 0)
+		return;
+	if (blocking)
+		flags &= ~O_NONBLOCK;
+	else
+		flags |= O_NONBLOCK;
+	fcntl(d, F_SETFL, flags);
+	if (d == sm_ctx.fd)
+		sm_ctx.nonblock = !blocking;
+}
+
 int sm_dev_initialize()
 {
 	fd = open("/dev/icc", O_RDWR);
@@ -29,6 +125,15 @@ int sm_dev_initialize()
 
 void sm_dev_finalize()
 {
+	struct sm_thread_ctx *ctx;
+
+	/* the descriptors of every thread, not only the caller's */
+	pthread_mutex_lock(&sm_ctx_lock);
+	for (ctx = sm_ctx_list; ctx; ctx = ctx->next)
+		close(ctx->fd);
+	sm_ctx_list = NULL;
+	__atomic_add_fetch(&sm_ctx_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&sm_ctx_lock);
 	close(fd);
 }
 
@@ -104,11 +209,18 @@ int sm_close_session(uint32_t session_idx)
 	return ret;
 }
 
+/* the error of a send or query means the remote port is gone (its
+   session was shut down, its core reset), not that it is busy */
+static inline int sm_peer_lost(int err)
+{
+	return err != EAGAIN && err != ETIMEDOUT && err != EINTR;
+}
+
 int sm_send_packet(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
 		void *buf, uint32_t len, uint32_t *payload, int blocking)
 {
 	int ret;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
@@ -117,14 +229,10 @@ int sm_send_packet(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
 	pkt.dst_cpu = dst_cpu;
 	pkt.buf_len = len;
 	pkt.buf = buf;
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
-	ret = ioctl(fd, CMD_SM_SEND, &pkt);
+	sm_set_blocking(d, blocking);
+	ret = ioctl(d, CMD_SM_SEND, &pkt);
+	if (ret && sm_peer_lost(errno))
+		mcapi_trans_remote_invalidate_internal(dst_cpu);
 	if (payload)
 		*payload = pkt.payload;
 	return ret;
@@ -134,7 +242,7 @@ int sm_recv_packet(uint32_t session_idx, uint16_t *dst_ep, uint16_t *dst_cpu,
 		void *buf, uint32_t *len, int blocking)
 {
 	int ret = 0;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
@@ -146,14 +254,8 @@ int sm_recv_packet(uint32_t session_idx, uint16_t *dst_ep, uint16_t *dst_cpu,
 	if (len)
 		pkt.buf_len = *len;
 
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
-	ret = ioctl(fd, CMD_SM_RECV, &pkt);
+	sm_set_blocking(d, blocking);
+	ret = ioctl(d, CMD_SM_RECV, &pkt);
 	if (!ret) {
 		if (dst_ep)
 			*dst_ep = pkt.remote_ep;
@@ -165,11 +267,65 @@ int sm_recv_packet(uint32_t session_idx, uint16_t *dst_ep, uint16_t *dst_cpu,
 	return ret;
 }
 
+/* Send count packets through one session, setting the descriptor mode once
+   for the whole batch. Every packet is attempted; desc[i].err tells how it
+   went. Returns the number of packets sent. */
+int sm_send_packets(uint32_t session_idx, struct sm_send_desc *desc, uint32_t count, int blocking)
+{
+	int d = sm_thread_fd();
+	uint32_t i;
+	int sent = 0;
+	struct sm_packet pkt;
+
+	sm_set_blocking(d, blocking);
+	for (i = 0; i < count; i++) {
+		memset(&pkt, 0, sizeof(struct sm_packet));
+		pkt.session_idx = session_idx;
+		pkt.remote_ep = desc[i].dst_ep;
+		pkt.dst_cpu = desc[i].dst_cpu;
+		pkt.buf_len = desc[i].len;
+		pkt.buf = desc[i].buf;
+		if (ioctl(d, CMD_SM_SEND, &pkt)) {
+			desc[i].err = errno;
+			if (sm_peer_lost(errno))
+				mcapi_trans_remote_invalidate_internal(desc[i].dst_cpu);
+		} else {
+			desc[i].err = 0;
+			sent++;
+		}
+	}
+	return sent;
+}
+
+/* Receive up to count queued packets without blocking, switching the
+   descriptor to non-blocking mode once for the whole batch. Returns the
+   number of packets received; errno is set when it is 0. */
+int sm_recv_packets(uint32_t session_idx, struct sm_recv_desc *desc, uint32_t count)
+{
+	int d = sm_thread_fd();
+	uint32_t i;
+	struct sm_packet pkt;
+
+	sm_set_blocking(d, 0);
+	for (i = 0; i < count; i++) {
+		memset(&pkt, 0, sizeof(struct sm_packet));
+		pkt.session_idx = session_idx;
+		pkt.buf = desc[i].buf;
+		pkt.buf_len = desc[i].len;
+		if (ioctl(d, CMD_SM_RECV, &pkt))
+			break;
+		desc[i].len = pkt.buf_len;
+		desc[i].src_ep = pkt.remote_ep;
+		desc[i].src_cpu = pkt.dst_cpu;
+	}
+	return i;
+}
+
 int sm_send_scalar(uint32_t session_idx, uint16_t dst_ep, uint16_t dst_cpu,
 		uint32_t scalar0, uint32_t scalar1, uint32_t size, int blocking)
 {
 	int ret;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
@@ -193,14 +349,8 @@ int sm_send_scalar(uint32_t session_idx, uint16_t dst_ep, uint16_t dst_cpu,
 		pkt.type = SM_SESSION_SCALAR_READY_64;
 		break;
 	}
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
-	ret = ioctl(fd, CMD_SM_SEND, &pkt);
+	sm_set_blocking(d, blocking);
+	ret = ioctl(d, CMD_SM_SEND, &pkt);
 	return ret;
 }
 
@@ -208,20 +358,14 @@ int sm_recv_scalar(uint32_t session_idx, uint16_t *src_ep, uint16_t *src_cpu,
 		uint32_t *scalar0, uint32_t *scalar1, uint32_t *size, int blocking)
 {
 	int ret = 0;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
 	pkt.session_idx = session_idx;
 	pkt.type = SM_SESSION_SCALAR_READY_64;
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
-	ret = ioctl(fd, CMD_SM_RECV, &pkt);
+	sm_set_blocking(d, blocking);
+	ret = ioctl(d, CMD_SM_RECV, &pkt);
 	if (ret)
 		return ret;
 	if (src_ep)
@@ -240,26 +384,23 @@ int sm_recv_scalar(uint32_t session_idx, uint16_t *src_ep, uint16_t *src_cpu,
 int sm_get_remote_ep(uint32_t dst_ep, uint32_t dst_cpu, int timeout, int blocking)
 {
 	int ret;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
 	pkt.remote_ep = dst_ep;
 	pkt.dst_cpu = dst_cpu;
 	pkt.timeout = timeout;
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
-	ret = ioctl(fd, CMD_SM_QUERY_REMOTE_EP, &pkt);
+	sm_set_blocking(d, blocking);
+	ret = ioctl(d, CMD_SM_QUERY_REMOTE_EP, &pkt);
+	if (ret && sm_peer_lost(errno))
+		mcapi_trans_remote_invalidate_internal(dst_cpu);
 	return ret;
 }
 
 int sm_get_session_status(uint32_t session_idx, struct sm_session_status *status)
 {
+	int d = sm_thread_fd();
 	int ret;
 	struct sm_packet pkt;
 
@@ -270,7 +411,7 @@ int sm_get_session_status(uint32_t session_idx, struct sm_session_status *status
 	pkt.session_idx = session_idx;
 	pkt.param = status;
 	pkt.param_len = sizeof(*status);
-	ret = ioctl(fd, CMD_SM_GET_SESSION_STATUS, &pkt);
+	ret = ioctl(d, CMD_SM_GET_SESSION_STATUS, &pkt);
 	return ret;
 }
 
@@ -278,7 +419,7 @@ int sm_wait_nonblocking(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
 	void *buf, uint32_t *len, uint32_t type, uint32_t payload, unsigned int timeout, int blocking)
 {
 	int ret;
-	int flags;
+	int d = sm_thread_fd();
 	struct sm_packet pkt;
 
 	memset(&pkt, 0, sizeof(struct sm_packet));
@@ -291,22 +432,46 @@ int sm_wait_nonblocking(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
 	pkt.payload = payload;
 	if (len)
 		pkt.buf_len = *len;
-	if (flags = fcntl(fd, F_GETFL, 0) > 0) {
-		if (blocking)
-			flags &= ~O_NONBLOCK;
-		else
-			flags |= O_NONBLOCK;
-		fcntl(fd, F_SETFL, flags);
-	}
+	sm_set_blocking(d, blocking);
 
-	ret = ioctl(fd, CMD_SM_WAIT, &pkt);
+	ret = ioctl(d, CMD_SM_WAIT, &pkt);
 	if (len)
 		*len = pkt.buf_len;
 	return ret;
 }
 
+/* Waits up to timeout for a packet on the session like a RECV
+   sm_wait_nonblocking(), and also returns where it comes from, like
+   sm_recv_packet(). */
+int sm_wait_recv_packet(uint32_t session_idx, uint32_t dst_ep, uint32_t dst_cpu,
+		uint16_t *src_ep, uint16_t *src_cpu, void *buf, uint32_t *len, unsigned int timeout)
+{
+	int ret;
+	int d = sm_thread_fd();
+	struct sm_packet pkt;
+
+	memset(&pkt, 0, sizeof(struct sm_packet));
+	pkt.session_idx = session_idx;
+	pkt.remote_ep = dst_ep;
+	pkt.dst_cpu = dst_cpu;
+	pkt.buf = buf;
+	pkt.buf_len = *len;
+	pkt.type = RECV;
+	pkt.timeout = timeout;
+	sm_set_blocking(d, 1);
+
+	ret = ioctl(d, CMD_SM_WAIT, &pkt);
+	if (!ret) {
+		*src_ep = pkt.remote_ep;
+		*src_cpu = pkt.dst_cpu;
+		*len = pkt.buf_len;
+	}
+	return ret;
+}
+
 int sm_get_node_status(uint32_t node, uint32_t *session_mask, uint32_t *session_pending, uint32_t *nfree)
 {
+	int d = sm_thread_fd();
 	int ret;
 	struct sm_packet pkt;
 	struct sm_node_status param;
@@ -315,7 +480,7 @@ int sm_get_node_status(uint32_t node, uint32_t *session_mask, uint32_t *session_
 	memset(&param, 0, sizeof(param));
 	pkt.param = &param;
 	pkt.param_len = sizeof(param);
-	ret = ioctl(fd, CMD_SM_GET_NODE_STATUS, &pkt);
+	ret = ioctl(d, CMD_SM_GET_NODE_STATUS, &pkt);
 
 	if (session_mask)
 		*session_mask = param.session_mask;
@@ -357,6 +522,277 @@ int sm_release_uncached_buf(void *buf, uint32_t size, uint32_t paddr)
 	return ret;
 }
 
+/* Cacheable shared buffers: the CPU works on them through its caches, and
+   hands them to the other core with sm_sync_for_device() (a clean) and
+   takes them back with sm_sync_for_cpu() (an invalidate). Without the
+   ioctls for them in icc.h there are none: requests and syncs fail with
+   ENOTSUP. Only an emulator build (SM_EMULATOR), where both sides share
+   the host's coherent memory, hands out uncached buffers instead, which
+   need no syncs: those do nothing then. */
+#if defined(CMD_SM_REQUEST_CACHED_BUF) && defined(CMD_SM_RELEASE_CACHED_BUF) && \
+	defined(CMD_SM_SYNC_FOR_DEVICE) && defined(CMD_SM_SYNC_FOR_CPU)
+#define SM_HAVE_CACHED_BUF 1
+#endif
+
+/* whether sm_request_cached_buf() can give out anything */
+int sm_have_cached_buf(void)
+{
+#if defined(SM_HAVE_CACHED_BUF) || defined(SM_EMULATOR)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void *sm_request_cached_buf(uint32_t size, uint32_t *paddr)
+{
+#ifdef SM_HAVE_CACHED_BUF
+	int ret;
+	struct sm_packet pkt;
+
+	memset(&pkt, 0, sizeof(struct sm_packet));
+	pkt.type = CMD_SM_REQUEST_CACHED_BUF;
+	pkt.buf_len = size;
+	ret = ioctl(fd, CMD_SM_REQUEST_CACHED_BUF, &pkt);
+	if (ret)
+		return NULL;
+	if (paddr)
+		*paddr = pkt.paddr;
+
+	return pkt.buf;
+#elif defined(SM_EMULATOR)
+	return sm_request_uncached_buf(size, paddr);
+#else
+	errno = ENOTSUP;
+	return NULL;
+#endif
+}
+
+int sm_release_cached_buf(void *buf, uint32_t size, uint32_t paddr)
+{
+#ifdef SM_HAVE_CACHED_BUF
+	struct sm_packet pkt;
+
+	memset(&pkt, 0, sizeof(struct sm_packet));
+	pkt.type = CMD_SM_RELEASE_CACHED_BUF;
+	pkt.buf_len = size;
+	pkt.buf = buf;
+	pkt.paddr = paddr;
+	return ioctl(fd, CMD_SM_RELEASE_CACHED_BUF, &pkt);
+#elif defined(SM_EMULATOR)
+	return sm_release_uncached_buf(buf, size, paddr);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+#ifdef SM_HAVE_CACHED_BUF
+static int sm_sync_buf(uint32_t cmd, void *buf, uint32_t size, uint32_t paddr)
+{
+	struct sm_packet pkt;
+
+	memset(&pkt, 0, sizeof(struct sm_packet));
+	pkt.type = cmd;
+	pkt.buf_len = size;
+	pkt.buf = buf;
+	pkt.paddr = paddr;
+	return ioctl(sm_thread_fd(), cmd, &pkt);
+}
+#endif
+
+/* buf, size bytes of a cached buffer at paddr, goes to the other core */
+int sm_sync_for_device(void *buf, uint32_t size, uint32_t paddr)
+{
+#ifdef SM_HAVE_CACHED_BUF
+	return sm_sync_buf(CMD_SM_SYNC_FOR_DEVICE, buf, size, paddr);
+#elif defined(SM_EMULATOR)
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/* buf, size bytes of a cached buffer at paddr, comes back from the other core */
+int sm_sync_for_cpu(void *buf, uint32_t size, uint32_t paddr)
+{
+#ifdef SM_HAVE_CACHED_BUF
+	return sm_sync_buf(CMD_SM_SYNC_FOR_CPU, buf, size, paddr);
+#elif defined(SM_EMULATOR)
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/* Copies into and out of the buffers of sm_request_uncached_buf(). Every
+   access to them is a bus transaction, so what counts is their number and
+   width: both copies align the uncached side and move SM_COPY_BLOCK bytes
+   per iteration with the widest registers of the build (NEON, AVX or SSE2,
+   else 64 bit words), in ascending order so that write combining can merge
+   the stores. On x86 the stores into the buffer are non-temporal and, with
+   SSE4.1, the loads from it too. The unaligned ends go byte by byte. */
+#define SM_COPY_BLOCK 64
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SM_COPY_KERNEL "neon"
+#define SM_COPY_ALIGN 16
+
+static inline void sm_copy_block(uint8_t *d, const uint8_t *s)
+{
+	uint8x16_t a = vld1q_u8(s), b = vld1q_u8(s + 16);
+	uint8x16_t c = vld1q_u8(s + 32), e = vld1q_u8(s + 48);
+
+	vst1q_u8(d, a);
+	vst1q_u8(d + 16, b);
+	vst1q_u8(d + 32, c);
+	vst1q_u8(d + 48, e);
+}
+#define sm_copy_block_in sm_copy_block
+#define sm_copy_block_out sm_copy_block
+#define sm_copy_fence() __sync_synchronize()
+
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define SM_COPY_KERNEL "avx"
+#define SM_COPY_ALIGN 32
+
+static inline void sm_copy_block_in(uint8_t *d, const uint8_t *s)
+{
+	__m256i a = _mm256_loadu_si256((const __m256i *)s);
+	__m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+
+	_mm256_stream_si256((__m256i *)d, a);
+	_mm256_stream_si256((__m256i *)(d + 32), b);
+}
+
+static inline void sm_copy_block_out(uint8_t *d, const uint8_t *s)
+{
+#ifdef __AVX2__
+	__m256i a = _mm256_stream_load_si256((__m256i *)s);
+	__m256i b = _mm256_stream_load_si256((__m256i *)(s + 32));
+#else
+	__m256i a = _mm256_load_si256((const __m256i *)s);
+	__m256i b = _mm256_load_si256((const __m256i *)(s + 32));
+#endif
+	_mm256_storeu_si256((__m256i *)d, a);
+	_mm256_storeu_si256((__m256i *)(d + 32), b);
+}
+#define sm_copy_fence() _mm_sfence()
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#define sm_copy_load(p) _mm_stream_load_si128((__m128i *)(p))
+#else
+#define sm_copy_load(p) _mm_load_si128((const __m128i *)(p))
+#endif
+#define SM_COPY_KERNEL "sse2"
+#define SM_COPY_ALIGN 16
+
+static inline void sm_copy_block_in(uint8_t *d, const uint8_t *s)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)s);
+	__m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+	__m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+	__m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+	_mm_stream_si128((__m128i *)d, a);
+	_mm_stream_si128((__m128i *)(d + 16), b);
+	_mm_stream_si128((__m128i *)(d + 32), c);
+	_mm_stream_si128((__m128i *)(d + 48), e);
+}
+
+static inline void sm_copy_block_out(uint8_t *d, const uint8_t *s)
+{
+	__m128i a = sm_copy_load(s);
+	__m128i b = sm_copy_load(s + 16);
+	__m128i c = sm_copy_load(s + 32);
+	__m128i e = sm_copy_load(s + 48);
+
+	_mm_storeu_si128((__m128i *)d, a);
+	_mm_storeu_si128((__m128i *)(d + 16), b);
+	_mm_storeu_si128((__m128i *)(d + 32), c);
+	_mm_storeu_si128((__m128i *)(d + 48), e);
+}
+#define sm_copy_fence() _mm_sfence()
+
+#else
+#define SM_COPY_KERNEL "word"
+#define SM_COPY_ALIGN 8
+
+/* the aligned side is d for copies in, s for copies out */
+static inline void sm_copy_block(uint8_t *d, const uint8_t *s)
+{
+	uint64_t w[SM_COPY_BLOCK / 8];
+	int i;
+
+	memcpy(w, s, sizeof(w));
+	for (i = 0; i < SM_COPY_BLOCK / 8; i++)
+		((volatile uint64_t *)d)[i] = w[i];
+}
+#define sm_copy_block_in sm_copy_block
+
+static inline void sm_copy_block_out(uint8_t *d, const uint8_t *s)
+{
+	uint64_t w[SM_COPY_BLOCK / 8];
+	int i;
+
+	for (i = 0; i < SM_COPY_BLOCK / 8; i++)
+		w[i] = ((const volatile uint64_t *)s)[i];
+	memcpy(d, w, sizeof(w));
+}
+#define sm_copy_fence() __sync_synchronize()
+#endif
+
+/* bytes before the first SM_COPY_ALIGN boundary of p, at most len */
+static inline size_t sm_copy_head(const void *p, size_t len)
+{
+	size_t head = -(uintptr_t)p & (SM_COPY_ALIGN - 1);
+
+	return head < len ? head : len;
+}
+
+void sm_copy_to_uncached(void *dst, const void *src, size_t len)
+{
+	volatile uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i, head = sm_copy_head(dst, len);
+
+	for (i = 0; i < head; i++)
+		d[i] = s[i];
+	for (; len - i >= SM_COPY_BLOCK; i += SM_COPY_BLOCK)
+		sm_copy_block_in((uint8_t *)d + i, s + i);
+	for (; i < len; i++)
+		d[i] = s[i];
+	/* the buffer is complete before it is handed on */
+	sm_copy_fence();
+}
+
+void sm_copy_from_uncached(void *dst, const void *src, size_t len)
+{
+	uint8_t *d = dst;
+	const volatile uint8_t *s = src;
+	size_t i, head = sm_copy_head(src, len);
+
+	for (i = 0; i < head; i++)
+		d[i] = s[i];
+	for (; len - i >= SM_COPY_BLOCK; i += SM_COPY_BLOCK)
+		sm_copy_block_out(d + i, (const uint8_t *)s + i);
+	for (; i < len; i++)
+		d[i] = s[i];
+}
+
+/* the kernel the copies were built with */
+const char *sm_copy_kernel(void)
+{
+	return SM_COPY_KERNEL;
+}
+
 void mcapi_trans_connect_channel_internal (mcapi_endpoint_t send_endpoint,
 		mcapi_endpoint_t receive_endpoint,channel_type type)
 {
@@ -371,8 +807,8 @@ void mcapi_trans_connect_channel_internal (mcapi_endpoint_t send_endpoint,
 	assert(mcapi_trans_decode_handle_internal(send_endpoint,&sd,&sn,&se));
 	assert(mcapi_trans_decode_handle_internal(receive_endpoint,&rd,&rn,&re));
 
-	index = mcapi_trans_get_port_index(sn, se);
-	if (index >= MCAPI_MAX_ENDPOINTS) {
+	index = mcapi_trans_get_port_index(sd, sn, se);
+	if (index >= mcapi_limits.endpoints) {
 		return;
 	}
 
@@ -382,15 +818,15 @@ void mcapi_trans_connect_channel_internal (mcapi_endpoint_t send_endpoint,
 		icc_type = SP_SESSION_SCALAR;
 	else
 		return;
-	ret = sm_connect_session(index, re, rn, icc_type);
+	ret = sm_connect_session(index, re, mcapi_trans_route_cpu_internal(rd, rn), icc_type);
 	if (ret) {
 		printf("%s failed\n", __func__);
 		return;
 	} else {
 		/* update the send endpoint */
-		c_db->domains[0].nodes[0].node_d.endpoints[index].connected = MCAPI_TRUE;
-		c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.recv_endpt = receive_endpoint;
-		c_db->domains[0].nodes[0].node_d.endpoints[index].recv_queue.channel_type = type;
+		MCAPI_DB_LOCAL_ENDPOINT(index).connected = MCAPI_TRUE;
+		MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.recv_endpt = receive_endpoint;
+		MCAPI_DB_LOCAL_ENDPOINT(index).recv_queue.channel_type = type;
 
 		printf("%s %d connected %d\n", __func__, send_endpoint, receive_endpoint);
 	}